@@ -6,6 +6,7 @@ LOCAL_MODULE    := moc
 LOCAL_SRC_FILES :=                \
     client/clearsilver/util/filter.c     \
     client/clearsilver/util/missing.c    \
+    client/clearsilver/util/neo_arena.c  \
     client/clearsilver/util/neo_date.c   \
     client/clearsilver/util/neo_err.c    \
     client/clearsilver/util/neo_files.c  \
@@ -42,6 +42,7 @@
 #include "util/neo_date.h"
 #include "util/neo_files.h"
 #include "util/neo_hash.h"
+#include "util/neo_arena.h"
 #include "util/neo_hdf.h"
 #include "util/neo_rand.h"
 #include "util/neo_net.h"
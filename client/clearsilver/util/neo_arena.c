@@ -0,0 +1,210 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#include "cs_config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "neo_misc.h"
+#include "neo_err.h"
+#include "neo_arena.h"
+
+#define ARENA_ALIGN(x)  (((x) + 15) & ~(size_t)15)
+#define CHUNK_HEAD      ARENA_ALIGN(sizeof(struct _arena_chunk))
+
+struct _arena_chunk
+{
+  struct _arena_chunk *next;    /* the one allocated before */
+};
+
+/*
+ * The owner thread takes arenas from local without lock. Arenas released by
+ * other threads are pushed onto remote with a CAS, and the owner takes them
+ * all with one exchange when local runs out.
+ */
+struct _arena_pool
+{
+  NE_ARENA *local;
+  NE_ARENA *remote;
+  int num;                      /* arenas cached, approximate */
+};
+
+static __thread NE_ARENA_POOL *ThreadPool = NULL;
+
+static struct _arena_chunk *_alloc_chunk (size_t size)
+{
+  struct _arena_chunk *c;
+
+  c = (struct _arena_chunk *) malloc (CHUNK_HEAD + size);
+  if (c == NULL) return NULL;
+  c->next = NULL;
+  return c;
+}
+
+static void _free_arena (NE_ARENA *arena)
+{
+  struct _arena_chunk *c, *n;
+
+  for (c = arena->chunk; c != NULL; c = n)
+  {
+    n = c->next;
+    free(c);
+  }
+  free(arena);
+}
+
+NEOERR *ne_arena_get (NE_ARENA **arena)
+{
+  NE_ARENA_POOL *pool = ThreadPool;
+  NE_ARENA *my_arena;
+
+  *arena = NULL;
+
+  if (pool == NULL)
+  {
+    /* lives as long as the thread's arenas, never freed */
+    pool = (NE_ARENA_POOL *) calloc (1, sizeof(NE_ARENA_POOL));
+    if (pool == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate memory for arena pool");
+    ThreadPool = pool;
+  }
+
+  if (pool->local == NULL)
+    pool->local = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE);
+
+  if (pool->local != NULL)
+  {
+    my_arena = pool->local;
+    pool->local = my_arena->next;
+    __atomic_fetch_sub(&pool->num, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    my_arena = (NE_ARENA *) calloc (1, sizeof(NE_ARENA));
+    if (my_arena == NULL)
+      return nerr_raise(NERR_NOMEM, "Unable to allocate memory for arena");
+    my_arena->chunk = _alloc_chunk(NE_ARENA_CHUNK);
+    if (my_arena->chunk == NULL)
+    {
+      free(my_arena);
+      return nerr_raise(NERR_NOMEM, "Unable to allocate memory for arena");
+    }
+    my_arena->pos = (char *)my_arena->chunk + CHUNK_HEAD;
+    my_arena->end = my_arena->pos + NE_ARENA_CHUNK;
+    my_arena->pool = pool;
+  }
+
+  my_arena->next = NULL;
+  *arena = my_arena;
+  return STATUS_OK;
+}
+
+void ne_arena_release (NE_ARENA **arena)
+{
+  NE_ARENA *my_arena = *arena;
+  NE_ARENA_POOL *pool;
+  struct _arena_chunk *c;
+  NE_ARENA *old;
+
+  if (my_arena == NULL) return;
+  *arena = NULL;
+
+  pool = my_arena->pool;
+  if (__atomic_fetch_add(&pool->num, 1, __ATOMIC_RELAXED) >= NE_ARENA_CACHE)
+  {
+    __atomic_fetch_sub(&pool->num, 1, __ATOMIC_RELAXED);
+    _free_arena(my_arena);
+    return;
+  }
+
+  /* keep the first chunk only, most arenas never need another one */
+  while (my_arena->chunk->next != NULL)
+  {
+    c = my_arena->chunk;
+    my_arena->chunk = c->next;
+    free(c);
+  }
+  my_arena->pos = (char *)my_arena->chunk + CHUNK_HEAD;
+  my_arena->end = my_arena->pos + NE_ARENA_CHUNK;
+  my_arena->used = 0;
+
+  if (pool == ThreadPool)
+  {
+    my_arena->next = pool->local;
+    pool->local = my_arena;
+    return;
+  }
+
+  old = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+  do {
+    my_arena->next = old;
+  } while (!__atomic_compare_exchange_n(&pool->remote, &old, my_arena, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void *ne_arena_alloc (NE_ARENA *arena, size_t size)
+{
+  struct _arena_chunk *c;
+  void *p;
+
+  size = ARENA_ALIGN(size);
+
+  if (size > (size_t)(arena->end - arena->pos))
+  {
+    if (size > NE_ARENA_CHUNK / 4)
+    {
+      /* a chunk of it's own, pos stays in the current one, not full yet */
+      c = _alloc_chunk(size);
+      if (c == NULL) return NULL;
+      c->next = arena->chunk;
+      arena->chunk = c;
+      arena->used += size;
+      return (char *)c + CHUNK_HEAD;
+    }
+
+    c = _alloc_chunk(NE_ARENA_CHUNK);
+    if (c == NULL) return NULL;
+    c->next = arena->chunk;
+    arena->chunk = c;
+    arena->pos = (char *)c + CHUNK_HEAD;
+    arena->end = arena->pos + NE_ARENA_CHUNK;
+  }
+
+  p = arena->pos;
+  arena->pos += size;
+  arena->used += size;
+  return p;
+}
+
+void *ne_arena_calloc (NE_ARENA *arena, size_t size)
+{
+  void *p;
+
+  p = ne_arena_alloc(arena, size);
+  if (p != NULL) memset(p, 0, size);
+  return p;
+}
+
+char *ne_arena_strndup (NE_ARENA *arena, const char *s, size_t len)
+{
+  char *p;
+
+  p = (char *) ne_arena_alloc(arena, len + 1);
+  if (p == NULL) return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+char *ne_arena_strdup (NE_ARENA *arena, const char *s)
+{
+  return ne_arena_strndup(arena, s, strlen(s));
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2001-2004 Brandon Long
+ * All Rights Reserved.
+ *
+ * ClearSilver Templating System
+ *
+ * This code is made available under the terms of the ClearSilver License.
+ * http://www.clearsilver.net/license.hdf
+ *
+ */
+
+#ifndef __NEO_ARENA_H_
+#define __NEO_ARENA_H_ 1
+
+__BEGIN_DECLS
+
+#include <stdlib.h>
+#include "neo_misc.h"
+#include "neo_err.h"
+
+/*
+ * NE_ARENA is a bump allocator for data with one lifetime, e.g. everything
+ * belongs to one request. Memory is taken from chunks of NE_ARENA_CHUNK
+ * bytes (bigger requests get a chunk of their own), and is never freed one
+ * by one: the whole arena is given back at once by ne_arena_release().
+ *
+ * Arenas are cached by a free list per thread. An arena may be released on
+ * another thread than the one got it, it goes back to the getter's list.
+ * An arena itself is not thread safe, only one thread can use it at a time.
+ */
+#define NE_ARENA_CHUNK      8192
+#define NE_ARENA_CACHE      1024    /* max arenas cached by one thread */
+
+typedef struct _arena_pool NE_ARENA_POOL;
+
+typedef struct _arena
+{
+  struct _arena_chunk *chunk;   /* newest first, the last one is kept */
+  char *pos;                    /* free space of the chunk in use */
+  char *end;
+  size_t used;                  /* bytes allocated since last release */
+
+  NE_ARENA_POOL *pool;          /* free list the arena goes back to */
+  struct _arena *next;
+} NE_ARENA;
+
+/*
+ * Function: ne_arena_get - get an empty arena
+ * Description: ne_arena_get takes an arena from the calling thread's free
+ *              list, or creates a new one.
+ * Input: arena - pointer to a NE_ARENA pointer
+ * Output: arena - the arena
+ * Returns: NERR_NOMEM
+ */
+NEOERR *ne_arena_get (NE_ARENA **arena);
+
+/*
+ * Function: ne_arena_release - give back all memory of an arena
+ * Description: ne_arena_release frees everything allocated from the arena
+ *              in one go, and puts the arena back on the free list of the
+ *              thread which got it. Chunks past the first are freed.
+ * Input: arena - pointer to a NE_ARENA pointer
+ * Output: arena - set to NULL
+ */
+void ne_arena_release (NE_ARENA **arena);
+
+void *ne_arena_alloc (NE_ARENA *arena, size_t size);
+void *ne_arena_calloc (NE_ARENA *arena, size_t size);
+char *ne_arena_strndup (NE_ARENA *arena, const char *s, size_t len);
+char *ne_arena_strdup (NE_ARENA *arena, const char *s);
+
+__END_DECLS
+
+#endif /* __NEO_ARENA_H_ */
@@ -56,10 +56,32 @@ static UINT32 hash_hdf_hash(const void *a)
   return ne_crc((UINT8 *)(ha->name), ha->name_len);
 }
 
+/* the value to keep for a dupl or wf _set_value() in an arena */
+static char *_arena_value (NE_ARENA *arena, const char *value, int wf)
+{
+  char *v;
+
+  v = ne_arena_strdup(arena, value);
+  if (v != NULL && wf) free((char *)value);
+  return v;
+}
+
+/* the tree got something malloc()'d, hdf_destroy() has to walk it */
+static void _arena_dirty (HDF *hdf)
+{
+  if (hdf->top != NULL && hdf->top->arena != NULL)
+    hdf->top->arena_dirty = 1;
+}
+
 static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
                            const char *value, int dupl, int wf, HDF *top)
 {
-  *hdf = calloc (1, sizeof (HDF));
+  NE_ARENA *arena = top ? top->arena : NULL;
+
+  if (arena != NULL)
+    *hdf = ne_arena_calloc (arena, sizeof (HDF));
+  else
+    *hdf = calloc (1, sizeof (HDF));
   if (*hdf == NULL)
   {
     return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
@@ -70,10 +92,13 @@ static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
   if (name != NULL)
   {
     (*hdf)->name_len = nlen;
-    (*hdf)->name = (char *) malloc (nlen + 1);
+    if (arena != NULL)
+      (*hdf)->name = (char *) ne_arena_alloc (arena, nlen + 1);
+    else
+      (*hdf)->name = (char *) malloc (nlen + 1);
     if ((*hdf)->name == NULL)
     {
-      free((*hdf));
+      if (arena == NULL) free((*hdf));
       (*hdf) = NULL;
       return nerr_raise (NERR_NOMEM,
 	  "Unable to allocate memory for hdf element: %s", name);
@@ -83,7 +108,18 @@ static NEOERR *_alloc_hdf (HDF **hdf, const char *name, size_t nlen,
   }
   if (value != NULL)
   {
-    if (dupl)
+    if (arena != NULL && (dupl || wf))
+    {
+      (*hdf)->alloc_value = 0;
+      (*hdf)->value = _arena_value(arena, value, !dupl && wf);
+      if ((*hdf)->value == NULL)
+      {
+	(*hdf) = NULL;
+	return nerr_raise (NERR_NOMEM,
+	    "Unable to allocate memory for hdf element %s", name);
+      }
+    }
+    else if (dupl)
     {
       (*hdf)->alloc_value = 1;
       (*hdf)->value = strdup(value);
@@ -123,12 +159,33 @@ static void _dealloc_hdf_attr(HDF_ATTR **attr)
   *attr = NULL;
 }
 
+/* free what an arena tree malloc()'d, the nodes stay in the arena */
+static void _dealloc_hdf_heap (HDF *hdf)
+{
+  for (; hdf != NULL; hdf = hdf->next)
+  {
+    if (hdf->child != NULL)
+      _dealloc_hdf_heap(hdf->child);
+    if (hdf->attr != NULL)
+      _dealloc_hdf_attr(&(hdf->attr));
+    if (hdf->hash != NULL)
+      ne_hash_destroy(&hdf->hash);
+  }
+}
+
 static void _dealloc_hdf (HDF **hdf)
 {
   HDF *myhdf = *hdf;
   HDF *next = NULL;
 
   if (myhdf == NULL) return;
+  if (myhdf->top->arena != NULL)
+  {
+    if (myhdf->top->arena_dirty)
+      _dealloc_hdf_heap(myhdf);
+    *hdf = NULL;
+    return;
+  }
   if (myhdf->child != NULL)
     _dealloc_hdf(&(myhdf->child));
 
@@ -187,6 +244,29 @@ NEOERR* hdf_init (HDF **hdf)
   return STATUS_OK;
 }
 
+NEOERR* hdf_init_arena (HDF **hdf, NE_ARENA *arena)
+{
+  NEOERR *err;
+  HDF *my_hdf;
+
+  *hdf = NULL;
+
+  err = nerr_init();
+  if (err != STATUS_OK)
+    return nerr_pass (err);
+
+  my_hdf = ne_arena_calloc (arena, sizeof (HDF));
+  if (my_hdf == NULL)
+    return nerr_raise (NERR_NOMEM, "Unable to allocate memory for hdf element");
+
+  my_hdf->top = my_hdf;
+  my_hdf->arena = arena;
+
+  *hdf = my_hdf;
+
+  return STATUS_OK;
+}
+
 void hdf_destroy (HDF **hdf)
 {
   if (*hdf == NULL) return;
@@ -410,6 +490,7 @@ NEOERR* hdf_set_attr (HDF *hdf, const char *name, const char *key,
   _walk_hdf(hdf, name, &obj);
   if (obj == NULL)
     return nerr_raise(NERR_ASSERT, "Unable to set attribute on none existant node");
+  _arena_dirty(obj);
 
   if (obj->attr != NULL)
   {
@@ -561,6 +642,7 @@ NEOERR* _hdf_hash_level(HDF *hdf)
 
   err = ne_hash_init(&(hdf->hash), hash_hdf_hash, hash_hdf_comp, NULL);
   if (err) return nerr_pass(err);
+  _arena_dirty(hdf);
 
   child = hdf->child;
   while (child)
@@ -589,6 +671,7 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
   {
     return nerr_raise(NERR_ASSERT, "Unable to set %s on NULL hdf", name);
   }
+  if (attr != NULL) _arena_dirty(hdf);
 
   /* HACK: allow setting of this node by passing an empty name */
   if (name == NULL || name[0] == '\0')
@@ -621,6 +704,14 @@ static NEOERR* _set_value (HDF *hdf, const char *name, const char *value,
       hdf->alloc_value = 0;
       hdf->value = NULL;
     }
+    else if (hdf->top->arena != NULL && (dupl || wf))
+    {
+      hdf->alloc_value = 0;
+      hdf->value = _arena_value(hdf->top->arena, value, !dupl && wf);
+      if (hdf->value == NULL)
+	return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+	    value, name);
+    }
     else if (dupl)
     {
       hdf->alloc_value = 1;
@@ -776,6 +867,14 @@ skip_search:
 	  hp->alloc_value = 0;
 	  hp->value = NULL;
 	}
+	else if (hdf->top->arena != NULL && (dupl || wf))
+	{
+	  hp->alloc_value = 0;
+	  hp->value = _arena_value(hdf->top->arena, value, !dupl && wf);
+	  if (hp->value == NULL)
+	    return nerr_raise (NERR_NOMEM, "Unable to duplicate value %s for %s",
+		value, name);
+	}
 	else if (dupl)
 	{
 	  hp->alloc_value = 1;
@@ -1143,6 +1242,29 @@ static NEOERR *_string_dump_cb (void *rock, const char *fmt, ...)
   return nerr_pass(err);
 }
 
+struct _dump_buf
+{
+  char *buf;
+  size_t len;
+  size_t pos;
+};
+
+static NEOERR *_buf_dump_cb (void *rock, const char *fmt, ...)
+{
+  struct _dump_buf *db = (struct _dump_buf *)rock;
+  va_list ap;
+  int n;
+
+  va_start (ap, fmt);
+  n = vsnprintf(db->buf + db->pos, db->len - db->pos, fmt, ap);
+  va_end(ap);
+  if (n < 0 || (size_t)n >= db->len - db->pos)
+    return nerr_raise(NERR_NOMEM, "hdf doesn't fit in %lu bytes",
+	(unsigned long)db->len);
+  db->pos += n;
+  return STATUS_OK;
+}
+
 #define DUMP_TYPE_DOTTED 0
 #define DUMP_TYPE_COMPACT 1
 #define DUMP_TYPE_PRETTY 2
@@ -1357,6 +1479,27 @@ NEOERR *hdf_write_string (HDF *hdf, char **s)
   return STATUS_OK;
 }
 
+NEOERR *hdf_write_buf (HDF *hdf, char *buf, size_t len, size_t *olen)
+{
+  struct _dump_buf db;
+  NEOERR *err;
+
+  *olen = 0;
+  if (len == 0)
+    return nerr_raise(NERR_NOMEM, "hdf doesn't fit in 0 bytes");
+
+  db.buf = buf;
+  db.len = len;
+  db.pos = 0;
+  buf[0] = '\0';
+
+  err = hdf_dump_cb(hdf, NULL, DUMP_TYPE_COMPACT, 0, &db, _buf_dump_cb);
+  if (err) return nerr_pass(err);
+
+  *olen = db.pos;
+  return STATUS_OK;
+}
+
 
 #define SKIPWS(s) while (*s && isspace(*s)) s++;
 
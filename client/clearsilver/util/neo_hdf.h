@@ -61,6 +61,7 @@ __BEGIN_DECLS
 #include <stdio.h>
 #include "neo_err.h"
 #include "neo_hash.h"
+#include "neo_arena.h"
 
 #define FORCE_HASH_AT 10
 
@@ -114,6 +115,12 @@ struct _hdf
    * load method */
   void *fileload_ctx;
   HDFFILELOAD fileload;
+
+  /* Should only be set on the head node, see hdf_init_arena() */
+  NE_ARENA *arena;
+  /* attributes and hashes are malloc()'d even in an arena, set once there
+   * are some to free */
+  int arena_dirty;
 };
 
 /*
@@ -126,6 +133,22 @@ struct _hdf
  */
 NEOERR* hdf_init (HDF **hdf);
 
+/*
+ * Function: hdf_init_arena - Initialize an HDF data set in an arena
+ * Description: hdf_init_arena is hdf_init, except that the nodes, names
+ *              and values of the data set are allocated from arena, and
+ *              are only freed with it (values given by hdf_set_buf are
+ *              copied into the arena, and freed at once).
+ *              hdf_destroy is still needed if the data set may have
+ *              attributes, otherwise it does nothing. The arena must
+ *              outlive the data set, and is used from one thread at a time.
+ * Input: hdf - pointer to an HDF pointer
+ *        arena - the arena, see ne_arena_get()
+ * Output: hdf - allocated hdf node
+ * Returns: NERR_NOMEM - unable to allocate memory for dataset
+ */
+NEOERR* hdf_init_arena (HDF **hdf, NE_ARENA *arena);
+
 /*
  * Function: hdf_destroy - deallocate an HDF data set
  * Description: hdf_destroy is used to deallocate all memory associated
@@ -548,6 +571,19 @@ NEOERR* hdf_read_string_ignore (HDF *hdf, const char *s, int ignore);
  */
 NEOERR* hdf_write_string (HDF *hdf, char **s);
 
+/*
+ * Function: hdf_write_buf - serialize an HDF dataset into a buffer
+ * Description: hdf_write_buf writes what hdf_write_string would return
+ *              straight into buf, '\0' terminated, without a temporary
+ *              string.
+ * Input: hdf - the dataset
+ *        buf - buffer to write to
+ *        len - size of buf
+ * Output: olen - length written, the '\0' excluded
+ * Returns: NERR_NOMEM - the dataset doesn't fit in len bytes
+ */
+NEOERR* hdf_write_buf (HDF *hdf, char *buf, size_t len, size_t *olen);
+
 /*
  * Function: hdf_dump - dump an HDF dataset to stdout
  * Description:
@@ -26,6 +26,7 @@ __BEGIN_DECLS
 #define FLAGS_NONE       0
 #define FLAGS_CACHE_ONLY 1    /* get, set, del, cas, incr */
 #define FLAGS_SYNC       2    /* set, del */
+#define FLAGS_BINARY     4    /* hdf in pack_hdf_bin() encoding, echoed by server */
 
 enum {
     REQ_CMD_NONE = 0,
@@ -33,10 +34,25 @@ enum {
     REQ_CMD_CACHE_SET,
     REQ_CMD_CACHE_DEL,
     REQ_CMD_CACHE_EMPTY,
+    REQ_CMD_CACHE_MGET,
+    REQ_CMD_CACHE_MSET,
+    REQ_CMD_CACHE_MDEL,
+    REQ_CMD_CACHE_DEL_PREFIX,
+    REQ_CMD_CACHE_DEL_TAG,
     REQ_CMD_CONFIG_GET = 200,   /* Get Config information from network */
     REQ_CMD_STATS = 1000        /* MAX system command is 1000 */
 };
 
+/* parameters of the cache commands */
+#define VNAME_CACHE_KEY    "cachekey"      /* DATA_TYPE_STRING */
+#define VNAME_CACHE_VAL    "cacheval"      /* DATA_TYPE_ANY */
+#define VNAME_CACHE_NAME   "cachename"     /* DATA_TYPE_STRING, shared cache */
+#define VNAME_CACHE_KEYS   "cachekeys"     /* list of keys, for MGET/MSET/MDEL */
+#define VNAME_CACHE_VALS   "cachevals"     /* list of values, of MSET/MGET */
+#define VNAME_CACHE_NUM    "cachenum"      /* DATA_TYPE_INT, keys done by MDEL */
+#define VNAME_CACHE_TAGS   "cachetags"     /* list of tags, of SET */
+#define VNAME_CACHE_TAG    "cachetag"      /* DATA_TYPE_STRING, of DEL_TAG */
+
 /* ok start point */
 enum {REP_OK = 1000};
 #define PROCESS_OK(ret)  (ret >= REP_OK)
@@ -47,7 +47,17 @@ static int _mevt_trigger(moc_t *evt, char *key, unsigned short cmd,
     /*
      * don't escape the hdf because some body need set in param
      */
-    vsize = pack_hdf(evt->hdfsnd, evt->payload + evt->psize, MAX_PACKET_LEN);
+    if (flags & FLAGS_BINARY)
+        vsize = pack_hdf_bin(evt->hdfsnd, evt->payload + evt->psize,
+                             MAX_PACKET_LEN - evt->psize);
+    else
+        vsize = pack_hdf(evt->hdfsnd, evt->payload + evt->psize,
+                         MAX_PACKET_LEN - evt->psize);
+    if (vsize == 0 && hdf_obj_child(evt->hdfsnd)) {
+        mtc_err("%s's hdf too large to send", evt->ename);
+        evt->errcode = REP_ERR_PACK;
+        return REP_ERR_PACK;
+    }
     evt->psize += vsize;
 
     /* 13 plus 4 equals 17 */
@@ -424,6 +434,60 @@ static NEOERR* _moc_regist_callback(moc_arg *arg, char *module, char *cmd,
     return STATUS_OK;
 }
 
+/*
+ * one REQ_CMD_CACHE_MGET, MSET or MDEL for n keys (vals for mset only)
+ */
+static int _moc_cache_multi(moc_arg *arg, char *module, char *cachename,
+                            unsigned short cmd, char **keys, char **vals,
+                            int n, bool eventloop)
+{
+    char name[64];
+    moc_t *evt;
+
+    if (!arg || !module || !keys || n <= 0) return REP_ERR;
+
+    evt = hash_lookup(arg->evth, module);
+    if (!evt) {
+        mtc_err("can't found %s module", module);
+        return REP_ERR;
+    }
+
+    if (cachename) hdf_set_value(evt->hdfsnd, VNAME_CACHE_NAME, cachename);
+    for (int i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), VNAME_CACHE_KEYS".%d", i);
+        hdf_set_value(evt->hdfsnd, name, keys[i]);
+        if (vals) {
+            snprintf(name, sizeof(name), VNAME_CACHE_VALS".%d", i);
+            hdf_set_value(evt->hdfsnd, name, vals[i]);
+        }
+    }
+
+    return _mevt_trigger(evt, NULL, cmd, FLAGS_SYNC, eventloop, arg);
+}
+
+/*
+ * one REQ_CMD_CACHE_DEL_PREFIX or DEL_TAG, name is the prefix or tag
+ */
+static int _moc_cache_drop(moc_arg *arg, char *module, char *cachename,
+                           unsigned short cmd, char *name, bool eventloop)
+{
+    moc_t *evt;
+
+    if (!arg || !module || !name) return REP_ERR;
+
+    evt = hash_lookup(arg->evth, module);
+    if (!evt) {
+        mtc_err("can't found %s module", module);
+        return REP_ERR;
+    }
+
+    if (cachename) hdf_set_value(evt->hdfsnd, VNAME_CACHE_NAME, cachename);
+    hdf_set_value(evt->hdfsnd, cmd == REQ_CMD_CACHE_DEL_TAG ?
+                  VNAME_CACHE_TAG : VNAME_CACHE_KEY, name);
+
+    return _mevt_trigger(evt, NULL, cmd, FLAGS_SYNC, eventloop, arg);
+}
+
 
 /*
  * easy to use set
@@ -547,6 +611,38 @@ NEOERR* moc_regist_callback(char *module, char *cmd, MocCallback cmdcbk)
     return nerr_pass(_moc_regist_callback(m_arg, module, cmd, cmdcbk));
 }
 
+int moc_cache_mget(char *module, char *cachename, char **keys, int n)
+{
+    return _moc_cache_multi(m_arg, module, cachename, REQ_CMD_CACHE_MGET,
+                            keys, NULL, n, true);
+}
+
+int moc_cache_mset(char *module, char *cachename, char **keys, char **vals,
+                   int n)
+{
+    if (!vals) return REP_ERR;
+    return _moc_cache_multi(m_arg, module, cachename, REQ_CMD_CACHE_MSET,
+                            keys, vals, n, true);
+}
+
+int moc_cache_mdel(char *module, char *cachename, char **keys, int n)
+{
+    return _moc_cache_multi(m_arg, module, cachename, REQ_CMD_CACHE_MDEL,
+                            keys, NULL, n, true);
+}
+
+int moc_cache_del_prefix(char *module, char *cachename, char *prefix)
+{
+    return _moc_cache_drop(m_arg, module, cachename, REQ_CMD_CACHE_DEL_PREFIX,
+                           prefix, true);
+}
+
+int moc_cache_del_tag(char *module, char *cachename, char *tag)
+{
+    return _moc_cache_drop(m_arg, module, cachename, REQ_CMD_CACHE_DEL_TAG,
+                           tag, true);
+}
+
 /*
  * thread safe set
  * ===============
@@ -636,3 +732,39 @@ int moc_errcode_r(moc_arg *arg, char *module)
 {
     return _moc_errcode(arg, module);
 }
+
+int moc_cache_mget_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, int n)
+{
+    return _moc_cache_multi(arg, module, cachename, REQ_CMD_CACHE_MGET,
+                            keys, NULL, n, false);
+}
+
+int moc_cache_mset_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, char **vals, int n)
+{
+    if (!vals) return REP_ERR;
+    return _moc_cache_multi(arg, module, cachename, REQ_CMD_CACHE_MSET,
+                            keys, vals, n, false);
+}
+
+int moc_cache_mdel_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, int n)
+{
+    return _moc_cache_multi(arg, module, cachename, REQ_CMD_CACHE_MDEL,
+                            keys, NULL, n, false);
+}
+
+int moc_cache_del_prefix_r(moc_arg *arg, char *module, char *cachename,
+                           char *prefix)
+{
+    return _moc_cache_drop(arg, module, cachename, REQ_CMD_CACHE_DEL_PREFIX,
+                           prefix, false);
+}
+
+int moc_cache_del_tag_r(moc_arg *arg, char *module, char *cachename,
+                        char *tag)
+{
+    return _moc_cache_drop(arg, module, cachename, REQ_CMD_CACHE_DEL_TAG,
+                           tag, false);
+}
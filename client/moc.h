@@ -147,6 +147,7 @@ NEOERR* moc_set_param_float(char *module, char *key, float val);
  * key: 用来选择处理后端的关键字（如UIN等），提供的话可以有效避免缓存冗余，可以为NULL
  * cmd: 命令号，不可重复使用，必填
  * flags: 请求标志，不可重复使用，必填
+ *        带 FLAGS_BINARY 时参数以二进制编码发送（pack_hdf_bin），服务端回包及推送也用此编码
  * 返回值为该操作返回码, 分为三段区间, 取值范围参考 moc-private.h 中 REP_xxx
  * 如果服务业务端有其他数据返回时, 返回数据存储在 evt->rcvdata 中
  */
@@ -168,6 +169,28 @@ int moc_errcode(char *module);
  */
 NEOERR* moc_regist_callback(char *module, char *cmd, MocCallback cmdcbk);
 
+/*
+ * 批量缓存操作
+ * 一次请求读/写/删 module 后台缓存中的 n 个 key, 代替 n 次单 key 请求
+ * cachename: 服务端共享缓存名（server.hdf 的 Cache 段）, NULL 为该模块自己的缓存
+ * 返回值同 moc_trigger()
+ * mget: keys[i] 的值在 moc_hdfrcv(module) 的 cachevals.i 中, 未命中的不存在
+ * mdel: 删除的个数在 moc_hdfrcv(module) 的 cachenum 中
+ */
+int moc_cache_mget(char *module, char *cachename, char **keys, int n);
+int moc_cache_mset(char *module, char *cachename, char **keys, char **vals,
+                   int n);
+int moc_cache_mdel(char *module, char *cachename, char **keys, int n);
+
+/*
+ * 按前缀或标签批量删除缓存
+ * prefix: 服务端配置的 index_prefix, 或其下一段分组, 如 "user_", "user_42_"
+ * tag: REQ_CMD_CACHE_SET 时 cachetags 列表中给出的标签
+ * 返回值同 moc_trigger(), 删除的个数在 moc_hdfrcv(module) 的 cachenum 中
+ */
+int moc_cache_del_prefix(char *module, char *cachename, char *prefix);
+int moc_cache_del_tag(char *module, char *cachename, char *tag);
+
 /*
  * thread safe set
  * ===============
@@ -195,6 +218,17 @@ int moc_trigger_r(moc_arg *arg, char *module, char *key, unsigned short cmd,
 HDF* moc_hdfrcv_r(moc_arg *arg, char *module);
 int  moc_errcode_r(moc_arg *arg, char *module);
 
+int moc_cache_mget_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, int n);
+int moc_cache_mset_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, char **vals, int n);
+int moc_cache_mdel_r(moc_arg *arg, char *module, char *cachename,
+                     char **keys, int n);
+int moc_cache_del_prefix_r(moc_arg *arg, char *module, char *cachename,
+                           char *prefix);
+int moc_cache_del_tag_r(moc_arg *arg, char *module, char *cachename,
+                        char *tag);
+
 
 __END_DECLS
 #endif    /* __MOC_H__ */
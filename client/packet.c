@@ -1,22 +1,24 @@
 #include "moc-private.h"
 
-size_t unpack_data_str(unsigned char *buf, size_t len, char **val)
+static size_t unpack_data(unsigned char *buf, size_t len, uint32_t type,
+                          unsigned char **val)
 {
     const unsigned char *mykey;
     uint32_t ksize, vtype, vsize, ttsize;
     unsigned char *pos;
     
-    if (!buf) return 0;
+    if (!buf || len < 3*sizeof(uint32_t)) return 0;
 
     pos = buf;
     
     vtype = * (uint32_t *) pos; vtype = ntohl(vtype);
     ttsize = sizeof(uint32_t);
 
-    if (vtype != DATA_TYPE_STRING) return 0;
+    if (vtype != type) return 0;
 
     pos = pos + sizeof(uint32_t);
     ksize = * (uint32_t *) pos; ksize = ntohl(ksize);
+    if (ksize > len - 3*sizeof(uint32_t)) return 0;
 
     pos = pos + sizeof(uint32_t);
     mykey = pos;
@@ -25,16 +27,37 @@ size_t unpack_data_str(unsigned char *buf, size_t len, char **val)
     ttsize += ksize + 2*sizeof(uint32_t);
     
     vsize = * (uint32_t *) pos; vsize = ntohl(vsize);
+    if (vsize > len - ttsize) return 0;
     pos = pos + sizeof(uint32_t);
 
-    *val = (char*)pos;
+    *val = pos;
 
     pos = pos + vsize;
-    ttsize += sizeof(uint32_t) + vsize;
+    ttsize += vsize;
 
     return ttsize;
 }
 
+size_t unpack_data_str(unsigned char *buf, size_t len, char **val)
+{
+    return unpack_data(buf, len, DATA_TYPE_STRING, (unsigned char**)val);
+}
+
+size_t unpack_data_array(unsigned char *buf, size_t len, unsigned char **val)
+{
+    return unpack_data(buf, len, DATA_TYPE_ARRAY, val);
+}
+
+/* empty *hdf for unpack, an arena one stays in it's arena */
+static void unpack_hdf_reset(HDF **hdf)
+{
+    NE_ARENA *arena = *hdf ? (*hdf)->arena : NULL;
+
+    hdf_destroy(hdf);
+    if (arena) hdf_init_arena(hdf, arena);
+    else hdf_init(hdf);
+}
+
 size_t unpack_hdf(unsigned char *buf, size_t len, HDF **hdf)
 {
     size_t ttsize;
@@ -42,8 +65,11 @@ size_t unpack_hdf(unsigned char *buf, size_t len, HDF **hdf)
     
     if (!buf || !hdf) return 0;
 
-    hdf_destroy(hdf);
-    hdf_init(hdf);
+    if (len >= sizeof(uint32_t) &&
+        ntohl(* (uint32_t *) buf) == DATA_TYPE_ARRAY)
+        return unpack_hdf_bin(buf, len, hdf);
+
+    unpack_hdf_reset(hdf);
 
     ttsize = unpack_data_str(buf, len, &val);
     if (val) hdf_read_string(*hdf, val);
@@ -76,19 +102,369 @@ size_t pack_data_str(const char *key, const char *val, unsigned char *buf, size_
 size_t pack_hdf(HDF *hdf, unsigned char *buf, size_t len)
 {
     size_t vsize;
-    char *p;
-    
-    if (!hdf || !buf) return 0;
-    
-    NEOERR *err = hdf_write_string(hdf, &p);
-    if (err != STATUS_OK) return 0;
+    NEOERR *err;
+
+    if (!hdf || !buf || len < 5*sizeof(uint32_t) + 1) return 0;
+
+    /* vtype, ksize, "root", vsize, the string and it's '\0', EOF
+     * the string is written in place, no temporary copy */
+    err = hdf_write_buf(hdf, (char*)buf + 4*sizeof(uint32_t),
+                        len - 5*sizeof(uint32_t), &vsize);
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
+        return 0;
+    }
+    vsize += 1;
+
+    * (uint32_t *) buf = htonl(DATA_TYPE_STRING);
+    * ((uint32_t *) buf + 1) = htonl(4);
+    memcpy(buf+8, "root", 4);
+    * ((uint32_t *) buf + 3) = htonl(vsize);
+    * (uint32_t *) (buf + 4*sizeof(uint32_t) + vsize) = htonl(DATA_TYPE_EOF);
+
+    return 5*sizeof(uint32_t) + vsize;
+}
+
+
+/*
+ * binary encoding
+ * ===============
+ */
+#define BIN_NAME_MAX 255
+#define BIN_VARINT_MAX 10
+
+static size_t bin_varint_len(uint64_t v)
+{
+    size_t n = 1;
+
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+static size_t bin_put_varint(unsigned char *p, uint64_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+
+    return n;
+}
+
+size_t unpack_varint(const unsigned char *p, size_t len, uint64_t *v)
+{
+    size_t n = 0;
+    int shift = 0;
+
+    *v = 0;
+    while (n < len && n < BIN_VARINT_MAX) {
+        *v |= (uint64_t)(p[n] & 0x7F) << shift;
+        if (!(p[n++] & 0x80)) return n;
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/* Values which are canonical unsigned decimals are packed as integers, so
+ * they unpack to the very same string. */
+static uint32_t bin_value_type(const char *val, uint64_t *ival)
+{
+    const char *p = val;
+    uint64_t v = 0;
+
+    if (*p == '\0' || (*p == '0' && *(p+1) != '\0')) return DATA_TYPE_STRING;
+
+    for (; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9') return DATA_TYPE_STRING;
+        if (v > (UINT64_MAX - (*p - '0')) / 10) return DATA_TYPE_STRING;
+        v = v * 10 + (*p - '0');
+    }
+
+    *ival = v;
+
+    return v <= UINT32_MAX ? DATA_TYPE_U32 : DATA_TYPE_ULONG;
+}
+
+/* Pack the children of hdf, return the size, or -1 on buffer full. */
+static ssize_t pack_bin_children(HDF *hdf, unsigned char *buf, size_t len)
+{
+    HDF *node;
+    HDF_ATTR *attr;
+    unsigned char *p;
+    char *name, *val;
+    size_t pos = 0, ksize, asize, alen, need;
+    ssize_t vsize;
+    uint64_t ival;
+    uint32_t vtype;
+
+    for (node = hdf_obj_child(hdf); node; node = hdf_obj_next(node)) {
+        name = hdf_obj_name(node);
+        ksize = strlen(name);
+        if (ksize > BIN_NAME_MAX) return -1;
+        val = hdf_obj_value(node);
+
+        if (val) {
+            vtype = bin_value_type(val, &ival);
+            if (vtype == DATA_TYPE_STRING) {
+                vsize = strlen(val);
+                need = 2 + ksize + bin_varint_len(vsize) + vsize;
+            } else {
+                need = 2 + ksize + bin_varint_len(ival);
+            }
+            if (pos + need > len) return -1;
 
-    vsize = pack_data_str("root", p, buf, len);
+            p = buf + pos;
+            *p++ = vtype;
+            *p++ = ksize;
+            memcpy(p, name, ksize);
+            p += ksize;
+            if (vtype == DATA_TYPE_STRING) {
+                p += bin_put_varint(p, vsize);
+                memcpy(p, val, vsize);
+            } else {
+                bin_put_varint(p, ival);
+            }
+            pos += need;
+        }
 
-    free(p);
+        for (attr = hdf_obj_attr(node); attr; attr = attr->next) {
+            alen = strlen(attr->key) + 1;
+            asize = alen + strlen(attr->value);
+            need = 2 + ksize + bin_varint_len(asize) + asize;
+            if (pos + need > len) return -1;
 
-    * (uint32_t *) (buf+vsize) = htonl(DATA_TYPE_EOF);
-    vsize += sizeof(uint32_t);
+            p = buf + pos;
+            *p++ = DATA_TYPE_ATTR;
+            *p++ = ksize;
+            memcpy(p, name, ksize);
+            p += ksize;
+            p += bin_put_varint(p, asize);
+            memcpy(p, attr->key, alen);
+            memcpy(p + alen, attr->value, asize - alen);
+            pos += need;
+        }
+
+        if (hdf_obj_child(node)) {
+            /* children are packed after the longest vsize, and moved down
+             * once their size is known */
+            need = 2 + ksize + BIN_VARINT_MAX;
+            if (pos + need > len) return -1;
+
+            p = buf + pos;
+            *p++ = DATA_TYPE_ARRAY;
+            *p++ = ksize;
+            memcpy(p, name, ksize);
+            p += ksize;
+            vsize = pack_bin_children(node, p + BIN_VARINT_MAX,
+                                      len - pos - need);
+            if (vsize < 0) return -1;
+            asize = bin_put_varint(p, vsize);
+            memmove(p + asize, p + BIN_VARINT_MAX, vsize);
+            pos += 2 + ksize + asize + vsize;
+        }
+    }
+
+    return pos;
+}
+
+static int unpack_bin_children(HDF *hdf, unsigned char *buf, size_t len,
+                               int depth)
+{
+    unsigned char *p;
+    char name[BIN_NAME_MAX+1], sval[24], *val;
+    size_t pos = 0, ksize, n, alen;
+    uint64_t ival, vsize;
+    uint32_t vtype;
+    HDF *node;
+    NEOERR *err = STATUS_OK;
+
+    if (depth == PACK_MAX_DEPTH) return -1;
+
+    while (pos < len) {
+        if (len - pos < 2) return -1;
+
+        p = buf + pos;
+        vtype = p[0];
+        ksize = p[1];
+        if (ksize == 0 || ksize > len - pos - 2) return -1;
+        memcpy(name, p+2, ksize);
+        name[ksize] = '\0';
+        pos += 2 + ksize;
+        p = buf + pos;
+
+        n = unpack_varint(p, len - pos, &ival);
+        if (n == 0) return -1;
+        pos += n;
+        p += n;
+
+        switch (vtype) {
+        case DATA_TYPE_U32:
+        case DATA_TYPE_ULONG:
+            snprintf(sval, sizeof(sval), "%llu", (unsigned long long)ival);
+            err = hdf_set_value(hdf, name, sval);
+            break;
+        case DATA_TYPE_STRING:
+        case DATA_TYPE_ATTR:
+        case DATA_TYPE_ARRAY:
+            vsize = ival;
+            if (vsize > len - pos) return -1;
+            pos += vsize;
+
+            if (vtype == DATA_TYPE_ARRAY) {
+                err = hdf_get_node(hdf, name, &node);
+                if (err != STATUS_OK) break;
+                if (unpack_bin_children(node, p, vsize, depth + 1) != 0)
+                    return -1;
+                break;
+            }
+
+            val = malloc(vsize + 1);
+            if (!val) return -1;
+            memcpy(val, p, vsize);
+            val[vsize] = '\0';
+
+            if (vtype == DATA_TYPE_STRING) {
+                /* hdf takes val */
+                err = hdf_set_buf(hdf, name, val);
+                break;
+            }
+
+            alen = strlen(val);
+            if (alen == vsize) {
+                free(val);
+                return -1;
+            }
+            err = hdf_set_attr(hdf, name, val, val + alen + 1);
+            free(val);
+            break;
+        default:
+            return -1;
+        }
+
+        if (err != STATUS_OK) {
+            nerr_ignore(&err);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+size_t pack_hdf_bin(HDF *hdf, unsigned char *buf, size_t len)
+{
+    ssize_t vsize;
+
+    if (!hdf || !buf || len < 5*sizeof(uint32_t)) return 0;
+
+    /* vtype, ksize, "root", vsize, children, EOF */
+    vsize = pack_bin_children(hdf, buf + 4*sizeof(uint32_t),
+                              len - 5*sizeof(uint32_t));
+    if (vsize < 0) return 0;
+
+    * (uint32_t *) buf = htonl(DATA_TYPE_ARRAY);
+    * ((uint32_t *) buf + 1) = htonl(4);
+    memcpy(buf+8, "root", 4);
+    * ((uint32_t *) buf + 3) = htonl(vsize);
+    * (uint32_t *) (buf + 4*sizeof(uint32_t) + vsize) = htonl(DATA_TYPE_EOF);
+
+    return 5*sizeof(uint32_t) + vsize;
+}
+
+size_t pack_hdf_bin_head(const char *key, size_t vsize,
+                         unsigned char *buf, size_t len)
+{
+    size_t ksize = strlen(key), rsize;
+    unsigned char *p;
+
+    if (ksize > BIN_NAME_MAX) return 0;
+
+    /* the root array's value is the one child */
+    rsize = 2 + ksize + bin_varint_len(vsize) + vsize;
+    if (len < 4*sizeof(uint32_t) + rsize - vsize) return 0;
+
+    * (uint32_t *) buf = htonl(DATA_TYPE_ARRAY);
+    * ((uint32_t *) buf + 1) = htonl(4);
+    memcpy(buf+8, "root", 4);
+    * ((uint32_t *) buf + 3) = htonl(rsize);
+
+    p = buf + 4*sizeof(uint32_t);
+    *p++ = DATA_TYPE_STRING;
+    *p++ = ksize;
+    memcpy(p, key, ksize);
+    p += ksize;
+    p += bin_put_varint(p, vsize);
+
+    return p - buf;
+}
+
+size_t unpack_hdf_bin(unsigned char *buf, size_t len, HDF **hdf)
+{
+    size_t ttsize;
+    unsigned char *val = NULL;
     
-    return vsize;
+    if (!buf || !hdf) return 0;
+
+    ttsize = unpack_data_array(buf, len, &val);
+    if (ttsize == 0) return 0;
+
+    unpack_hdf_reset(hdf);
+
+    if (unpack_bin_children(*hdf, val, ttsize - (val - buf), 0) != 0)
+        return 0;
+
+    return ttsize;
+}
+
+char* unpack_hdf_bin_value(unsigned char *buf, size_t len, const char *key,
+                           char *vbuf, size_t vlen)
+{
+    unsigned char *p, *val = NULL;
+    size_t pos = 0, end, ksize, n;
+    size_t klen = strlen(key);
+    uint64_t ival;
+    uint32_t vtype;
+
+    if (!buf || !key || !vbuf || vlen == 0) return NULL;
+
+    end = unpack_data_array(buf, len, &val);
+    if (end == 0) return NULL;
+    end -= val - buf;
+
+    while (end - pos > 2) {
+        p = val + pos;
+        vtype = p[0];
+        ksize = p[1];
+        if (ksize > end - pos - 2) return NULL;
+        n = unpack_varint(p + 2 + ksize, end - pos - 2 - ksize, &ival);
+        if (n == 0) return NULL;
+        pos += 2 + ksize + n;
+
+        if (vtype == DATA_TYPE_STRING || vtype == DATA_TYPE_ATTR ||
+            vtype == DATA_TYPE_ARRAY) {
+            if (ival > end - pos) return NULL;
+            pos += ival;
+        }
+
+        if (ksize != klen || memcmp(p+2, key, klen)) continue;
+
+        if (vtype == DATA_TYPE_U32 || vtype == DATA_TYPE_ULONG) {
+            snprintf(vbuf, vlen, "%llu", (unsigned long long)ival);
+            return vbuf;
+        } else if (vtype == DATA_TYPE_STRING) {
+            if (ival >= vlen) ival = vlen - 1;
+            memcpy(vbuf, p + 2 + ksize + n, ival);
+            vbuf[ival] = '\0';
+            return vbuf;
+        }
+    }
+
+    return NULL;
 }
@@ -9,7 +9,8 @@ enum {
     DATA_TYPE_ULONG,
     DATA_TYPE_STRING,
     DATA_TYPE_ARRAY,
-    DATA_TYPE_ANY                /* used in data_cell_search, include all type */
+    DATA_TYPE_ANY,               /* used in data_cell_search, include all type */
+    DATA_TYPE_ATTR               /* hdf attribute, in binary encoding only */
 };
 
 /*
@@ -18,15 +19,56 @@ enum {
  */
 size_t unpack_hdf(unsigned char *buf, size_t len, HDF **hdf);
 size_t unpack_data_str(unsigned char *buf, size_t len, char **val);
+size_t unpack_data_array(unsigned char *buf, size_t len, unsigned char **val);
 
 /*
  * packet a hdf's CHILD to transable string
  * hdf: input hdf dataset, should contain child,
  *      it's own value will be ignore
+ * the string is written into buf directly. return 0 if it don't fit in len.
  */
 size_t pack_hdf(HDF *hdf, unsigned char *buf, size_t len);
 size_t pack_data_str(const char *key, const char *val,
                      unsigned char *buf, size_t len);
 
+/*
+ * binary encoding of the hdf, for requests flagged FLAGS_BINARY:
+ * no text escaping, and integers as varint.
+ * packed as a DATA_TYPE_ARRAY named "root", whose value is it's children,
+ * each one as
+ *     1 vtype, 1 ksize, ksize name, then
+ *     DATA_TYPE_U32/ULONG varint value
+ *     DATA_TYPE_STRING    varint vsize, vsize value (without '\0')
+ *     DATA_TYPE_ATTR      varint vsize, attribute name '\0' attribute value
+ *     DATA_TYPE_ARRAY     varint vsize, vsize children
+ * varint is 7 bits per byte, low bits first, high bit set on all but the last.
+ * unsigned decimal values are packed as integers, others as string.
+ * unpack_hdf() detects this encoding too.
+ * nesting deeper than PACK_MAX_DEPTH arrays is refused on unpack.
+ */
+#define PACK_MAX_DEPTH      32
+size_t pack_hdf_bin(HDF *hdf, unsigned char *buf, size_t len);
+/*
+ * pack_hdf_bin() of a hdf with only key, a string of vsize bytes (without
+ * '\0'), in parts, so the string is sent from where it is: the head is
+ * written into buf, the string follows it, then PACK_BIN_TAIL_LEN bytes of 0.
+ * return the head size, 0 if it don't fit in len
+ */
+#define PACK_BIN_HEAD_MAX   (5*sizeof(uint32_t) + 2 + 255 + 10)
+#define PACK_BIN_TAIL_LEN   sizeof(uint32_t)
+size_t pack_hdf_bin_head(const char *key, size_t vsize,
+                         unsigned char *buf, size_t len);
+size_t unpack_hdf_bin(unsigned char *buf, size_t len, HDF **hdf);
+/*
+ * get the value of the top level key from a pack_hdf_bin() buffer, without
+ * unpacking it. the value is copied (integers formated) into vbuf.
+ */
+char* unpack_hdf_bin_value(unsigned char *buf, size_t len, const char *key,
+                           char *vbuf, size_t vlen);
+/*
+ * read a varint of the binary encoding, return it's size, 0 if broken
+ */
+size_t unpack_varint(const unsigned char *p, size_t len, uint64_t *v);
+
 __END_DECLS
 #endif    /* __MPACKET_H__ */
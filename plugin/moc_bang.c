@@ -20,7 +20,7 @@ static NEOERR* cmd_join(struct bang_entry *e, QueueEntry *q)
     hdf_set_value(q->hdfsnd, "success", "1");
 
     if (!(q->req->flags & FLAGS_SYNC)) {
-        err = base_msg_touser("login", q->hdfsnd, q->req->fd);
+        err = base_msg_touser("login", q->hdfsnd, q->req->tcpsock);
         if (err != STATUS_OK) {
             return nerr_pass(err);
         }
@@ -103,21 +103,20 @@ static NEOERR* cmd_turn(struct bang_entry *e, QueueEntry *q)
     NEOERR   *err;
 
     char          *redir;
-    unsigned char *redirbuf = NULL;
-    size_t         redirsize = 0;
+    struct base_msg *redirmsg = NULL;
     HDF           *redirnode;
 
     BASE_GET_UID(q, uid);
-    REQ_GET_PARAM_STR(q->hdfrcv, "redirection", redir);
+    REQ_GET_PARAM_STR(q, "redirection", redir);
     user = hash_lookup(info->inherited_info->userh, uid);
 
     mtc_dbg("%s turns to %s", uid, redir);
 
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".userid", uid);
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".redirection", redir);
-    redirnode = hdf_get_obj(q->hdfrcv, PRE_OUTPUT);
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".userid", uid);
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".redirection", redir);
+    redirnode = hdf_get_obj(queue_entry_hdfrcv(q), PRE_OUTPUT);
 
-    err = base_msg_new("turn", redirnode, &redirbuf, &redirsize);
+    err = base_msg_new("turn", redirnode, &redirmsg);
     if (err != STATUS_OK) {
         return nerr_pass(err);
     }
@@ -134,11 +133,11 @@ static NEOERR* cmd_turn(struct bang_entry *e, QueueEntry *q)
             continue;
         }
         mtc_dbg("need to tell %s", ouser->inherited_user.uid);
-        base_msg_send(redirbuf, redirsize, ouser->inherited_user.fd);
+        base_msg_send(redirmsg, ouser->inherited_user.tcpsock);
         ouser = USER_NEXT(user->current_battling_table->battling_user_hash);
     } USER_END;
 
-    base_msg_free(redirbuf);
+    base_msg_free(redirmsg);
 
     return STATUS_OK;
 }
@@ -196,6 +195,7 @@ static void bang_process_driver(EventEntry *entry, QueueEntry *q)
         hdf_set_int_value(q->hdfsnd, "msg_stats",    st->msg_stats);
         hdf_set_int_value(q->hdfsnd, "proc_suc",     st->proc_suc);
         hdf_set_int_value(q->hdfsnd, "proc_fai",     st->proc_fai);
+        sys_cache_stats(q->hdfsnd, e->cd);
         break;
 
     default:
@@ -247,11 +247,12 @@ static EventEntry* bang_init_driver(void)
     err = base_info_init(&(m_bang->inherited_info));
     JUMP_NOK(err, error);
 
-    e->cd = cache_create(hdf_get_int_value(g_cfg, CONFIG_PATH".numobjs", 1024), 0);
+    e->cd = cache_create_config(CONFIG_PATH);
     if (e->cd == NULL) {
         mtc_err("init cache failure");
         goto error;
     }
+    e->inherited_entry.cache = e->cd;
 
     return (EventEntry *) e;
 
@@ -9,7 +9,7 @@ NEOERR* base_cmd_join(struct base_info *binfo, QueueEntry *q)
     char *uid;
     NEOERR *err;
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", uid);
+    REQ_GET_PARAM_STR(q, "userid", uid);
 
     base_user_quit(binfo, uid, q, NULL);
     base_user_new(binfo, uid, q, NULL, NULL);
@@ -17,7 +17,7 @@ NEOERR* base_cmd_join(struct base_info *binfo, QueueEntry *q)
     hdf_set_value(q->hdfsnd, "success", "1");
 
     if (!(q->req->flags & FLAGS_SYNC)) {
-        err = base_msg_touser("login", q->hdfsnd, q->req->fd);
+        err = base_msg_touser("login", q->hdfsnd, q->req->tcpsock);
         if (err != STATUS_OK) return nerr_pass(err);
     }
 
@@ -29,14 +29,14 @@ NEOERR* base_cmd_quit(struct base_info *binfo, QueueEntry *q)
     char *uid;
     NEOERR *err;
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", uid);
+    REQ_GET_PARAM_STR(q, "userid", uid);
 
     base_user_quit(binfo, uid, NULL, NULL);
     
     hdf_set_value(q->hdfsnd, "success", "1");
 
     if (!(q->req->flags & FLAGS_SYNC)) {
-        err = base_msg_touser("logout", q->hdfsnd, q->req->fd);
+        err = base_msg_touser("logout", q->hdfsnd, q->req->tcpsock);
         if (err != STATUS_OK) return nerr_pass(err);
     }
 
@@ -66,6 +66,7 @@ static void base_process_driver(EventEntry *entry, QueueEntry *q)
         hdf_set_int_value(q->hdfsnd, "msg_stats", st->msg_stats);
         hdf_set_int_value(q->hdfsnd, "proc_suc", st->proc_suc);
         hdf_set_int_value(q->hdfsnd, "proc_fai", st->proc_fai);
+        sys_cache_stats(q->hdfsnd, e->cd);
         break;
     default:
         st->msg_unrec++;
@@ -84,7 +85,7 @@ static void base_process_driver(EventEntry *entry, QueueEntry *q)
         }
         TRACE_ERR(q, ret, err);
         if (!(q->req->flags & FLAGS_SYNC)) {
-            base_msg_touser("error", q->hdfsnd, q->req->fd);
+            base_msg_touser("error", q->hdfsnd, q->req->tcpsock);
         }
     }
     if (q->req->flags & FLAGS_SYNC) {
@@ -125,11 +126,12 @@ static EventEntry* base_init_driver(void)
     err = base_info_init(&m_base);
     JUMP_NOK(err, error);
     
-    e->cd = cache_create(hdf_get_int_value(g_cfg, CONFIG_PATH".numobjs", 1024), 0);
+    e->cd = cache_create_config(CONFIG_PATH);
     if (e->cd == NULL) {
         mtc_err("init cache failure");
         goto error;
     }
+    e->base.cache = e->cd;
     
     return (EventEntry*)e;
     
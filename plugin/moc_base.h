@@ -35,15 +35,35 @@ void base_user_destroy(void *arg);
 
 /*
  * alloc & decallc message one time, and can be reply to many users
+ * the message is framed in each hdf encoding it's sent in, each in a shbuf
+ * of it's own, shared by all it's users.
+ * datanode is packed again for the first binary user, keep it till
+ * base_msg_free()
  */
-NEOERR* base_msg_new(char *cmd, HDF *datanode, unsigned char **buf, size_t *size);
-NEOERR* base_msg_send(unsigned char *buf, size_t size, int fd);
-void base_msg_free(unsigned char *buf);
+struct base_msg {
+    HDF *node;
+    struct tcp_shbuf *text;
+    struct tcp_shbuf *bin;      /* FLAGS_BINARY one, NULL till a binary user */
+};
+NEOERR* base_msg_new(char *cmd, HDF *datanode, struct base_msg **msg);
+/*
+ * send don't block, the message is queued on tcpsock if the user is slow,
+ * and dropped if the user is too slow to be catched up
+ * sent in the encoding the user talks in (FLAGS_BINARY)
+ */
+NEOERR* base_msg_send(struct base_msg *msg, struct tcp_socket *tcpsock);
+/*
+ * send to n users at once, and return right away: the message is queued on
+ * their tcpsocks with no copy, and sent by the network threads.
+ * users too slow are skipped. socks is reordered, text users first
+ */
+NEOERR* base_msg_bcast(struct base_msg *msg, struct tcp_socket **socks, int n);
+void base_msg_free(struct base_msg *msg);
 
 /*
  * reply a message to only one user
  */
-NEOERR* base_msg_touser(char *cmd, HDF *datanode, int fd);
+NEOERR* base_msg_touser(char *cmd, HDF *datanode, struct tcp_socket *tcpsock);
 
 /*
  * pubic logic function
@@ -5,69 +5,74 @@
 
 static BaseInfo *m_base = NULL;
 
-static NEOERR* cmd_join(struct chat_entry *e, QueueEntry *q)
+/* Push cmd with msgnode to all users but uid, in one go, see base_msg_bcast() */
+static NEOERR* chat_bcast(char *cmd, HDF *msgnode, char *uid)
 {
+    struct tcp_socket **socks;
     BaseUser *user;
-    char *uid;
-    unsigned char *msgbuf = NULL;
-    size_t msgsize = 0;
-    HDF *msgnode;
+    struct base_msg *msg = NULL;
+    int n = 0, max;
     NEOERR *err;
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", uid);
-
-    base_user_quit(m_base, uid, q, NULL);
-    base_user_new(m_base, uid, q, NULL, NULL);
+    err = base_msg_new(cmd, msgnode, &msg);
+    if (err != STATUS_OK) return nerr_pass(err);
 
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".userid", uid);
-    msgnode = hdf_get_obj(q->hdfrcv, PRE_OUTPUT);
+    max = m_base->usernum;
+    socks = malloc((max + 1) * sizeof(struct tcp_socket*));
+    if (!socks) {
+        base_msg_free(msg);
+        return nerr_raise(NERR_NOMEM, "alloc %d users", max);
+    }
 
-    err = base_msg_new("join", msgnode,  &msgbuf, &msgsize);
-    if (err != STATUS_OK) return nerr_pass(err);
-    
     USER_START(m_base->userh, user) {
-        if (strcmp(uid, user->uid)) {
-            mtc_dbg("need to tel %s", user->uid);
-
-            base_msg_send(msgbuf, msgsize, user->fd);
-        }
+        if (n < max && user->tcpsock && strcmp(uid, user->uid))
+            socks[n++] = user->tcpsock;
 
         user = USER_NEXT(m_base->userh);
     } USER_END;
 
-    base_msg_free(msgbuf);
+    mtc_dbg("need to tel %d users", n);
+    err = base_msg_bcast(msg, socks, n);
 
-    return STATUS_OK;
+    free(socks);
+    base_msg_free(msg);
+
+    return nerr_pass(err);
 }
 
-static NEOERR* cmd_quit(struct chat_entry *e, QueueEntry *q)
+static NEOERR* cmd_join(struct chat_entry *e, QueueEntry *q)
 {
-    BaseUser *user;
     char *uid;
-    unsigned char *msgbuf = NULL;
-    size_t msgsize = 0;
     HDF *msgnode;
     NEOERR *err;
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", uid);
+    REQ_GET_PARAM_STR(q, "userid", uid);
 
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".userid", uid);
-    msgnode = hdf_get_obj(q->hdfrcv, PRE_OUTPUT);
+    base_user_quit(m_base, uid, q, NULL);
+    base_user_new(m_base, uid, q, NULL, NULL);
+
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".userid", uid);
+    msgnode = hdf_get_obj(queue_entry_hdfrcv(q), PRE_OUTPUT);
 
-    err = base_msg_new("quit", msgnode,  &msgbuf, &msgsize);
+    err = chat_bcast("join", msgnode, uid);
     if (err != STATUS_OK) return nerr_pass(err);
-    
-    USER_START(m_base->userh, user) {
-        if (strcmp(uid, user->uid)) {
-            mtc_dbg("need to tel %s", user->uid);
 
-            base_msg_send(msgbuf, msgsize, user->fd);
-        }
+    return STATUS_OK;
+}
 
-        user = USER_NEXT(m_base->userh);
-    } USER_END;
+static NEOERR* cmd_quit(struct chat_entry *e, QueueEntry *q)
+{
+    char *uid;
+    HDF *msgnode;
+    NEOERR *err;
+
+    REQ_GET_PARAM_STR(q, "userid", uid);
 
-    base_msg_free(msgbuf);
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".userid", uid);
+    msgnode = hdf_get_obj(queue_entry_hdfrcv(q), PRE_OUTPUT);
+
+    err = chat_bcast("quit", msgnode, uid);
+    if (err != STATUS_OK) return nerr_pass(err);
 
     base_user_quit(m_base, uid, NULL, NULL);
 
@@ -77,35 +82,20 @@ static NEOERR* cmd_quit(struct chat_entry *e, QueueEntry *q)
 static NEOERR* cmd_bcst(struct chat_entry *e, QueueEntry *q)
 {
     char *uid, *msg;
-    BaseUser *user;
-    unsigned char *msgbuf = NULL;
-    size_t msgsize = 0;
     HDF *msgnode;
     NEOERR *err;
 
     BASE_GET_UID(q, uid);
-    REQ_GET_PARAM_STR(q->hdfrcv, "msg", msg);
+    REQ_GET_PARAM_STR(q, "msg", msg);
 
     mtc_dbg("%s broadcast: %s", uid, msg);
 
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".userid", uid);
-    hdf_set_value(q->hdfrcv, PRE_OUTPUT".msg", msg);
-    msgnode = hdf_get_obj(q->hdfrcv, PRE_OUTPUT);
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".userid", uid);
+    hdf_set_value(queue_entry_hdfrcv(q), PRE_OUTPUT".msg", msg);
+    msgnode = hdf_get_obj(queue_entry_hdfrcv(q), PRE_OUTPUT);
 
-    err = base_msg_new("bcst", msgnode,  &msgbuf, &msgsize);
+    err = chat_bcast("bcst", msgnode, uid);
     if (err != STATUS_OK) return nerr_pass(err);
-    
-    USER_START(m_base->userh, user) {
-        if (strcmp(uid, user->uid)) {
-            mtc_dbg("need to tel %s", user->uid);
-
-            base_msg_send(msgbuf, msgsize, user->fd);
-        }
-
-        user = USER_NEXT(m_base->userh);
-    } USER_END;
-
-    base_msg_free(msgbuf);
 
     return STATUS_OK;
 }
@@ -114,7 +104,7 @@ static NEOERR* cmd_pm(struct chat_entry *e, QueueEntry *q)
 {
     char *uid;
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", uid);
+    REQ_GET_PARAM_STR(q, "userid", uid);
 
     return STATUS_OK;
 }
@@ -153,6 +143,7 @@ static void chat_process_driver(EventEntry *entry, QueueEntry *q)
         hdf_set_int_value(q->hdfsnd, "msg_stats", st->msg_stats);
         hdf_set_int_value(q->hdfsnd, "proc_suc", st->proc_suc);
         hdf_set_int_value(q->hdfsnd, "proc_fai", st->proc_fai);
+        sys_cache_stats(q->hdfsnd, e->cd);
         break;
     default:
         st->msg_unrec++;
@@ -208,11 +199,12 @@ static EventEntry* chat_init_driver(void)
     err = base_info_init(&m_base);
     JUMP_NOK(err, error);
     
-    e->cd = cache_create(hdf_get_int_value(g_cfg, CONFIG_PATH".numobjs", 1024), 0);
+    e->cd = cache_create_config(CONFIG_PATH);
     if (e->cd == NULL) {
         mtc_err("init cache failure");
         goto error;
     }
+    e->base.cache = e->cd;
     
     return (EventEntry*)e;
     
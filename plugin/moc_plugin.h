@@ -11,23 +11,12 @@
     cache_setf(cd, val, vsize, timeout, fmt, ##__VA_ARGS__);            \
     free(val);
 
-#define CACHE_SET_INT64(cd, num, timeout, fmt, ...)                 \
-    do {                                                            \
-        vsize = 24;                                                 \
-        val = calloc(1, vsize);                                     \
-        snprintf((char*)val, vsize, "%23lld", (long long int)num);  \
-        cache_setf(cd, val, vsize, timeout, fmt, ##__VA_ARGS__);    \
-        free(val);                                                  \
-    } while (0)
+/* counters, kept binary, read them with cache_get_intf() */
+#define CACHE_SET_INT64(cd, num, timeout, fmt, ...)                     \
+    cache_set_intf(cd, (int64_t)(num), timeout, fmt, ##__VA_ARGS__)
 
-#define CACHE_SET_INT(cd, num, timeout, fmt, ...)                   \
-    do {                                                            \
-        vsize = 12;                                                 \
-        val = calloc(1, vsize);                                     \
-        snprintf((char*)val, vsize, "%d", num);                     \
-        cache_setf(cd, val, vsize, timeout, fmt, ##__VA_ARGS__);    \
-        free(val);                                                  \
-    } while (0)
+#define CACHE_SET_INT(cd, num, timeout, fmt, ...)                       \
+    cache_set_intf(cd, (int64_t)(num), timeout, fmt, ##__VA_ARGS__)
 
 #define TRACE_ERR(q, ret, err)                                          \
     do {                                                                \
@@ -28,6 +28,7 @@ static void skeleton_process_driver(EventEntry *entry, QueueEntry *q)
         hdf_set_int_value(q->hdfsnd, "msg_stats", st->msg_stats);
         hdf_set_int_value(q->hdfsnd, "proc_suc", st->proc_suc);
         hdf_set_int_value(q->hdfsnd, "proc_fai", st->proc_fai);
+        sys_cache_stats(q->hdfsnd, e->cd);
         break;
     default:
         st->msg_unrec++;
@@ -46,7 +47,7 @@ static void skeleton_process_driver(EventEntry *entry, QueueEntry *q)
         }
         TRACE_ERR(q, ret, err);
         if (!(q->req->flags & FLAGS_SYNC)) {
-            base_msg_touser("error", q->hdfsnd, q->req->fd);
+            base_msg_touser("error", q->hdfsnd, q->req->tcpsock);
         }
     }
     if (q->req->flags & FLAGS_SYNC) {
@@ -86,11 +87,12 @@ static EventEntry* skeleton_init_driver(void)
     err = base_info_init(&m_base);
     JUMP_NOK(err, error);
     
-    e->cd = cache_create(hdf_get_int_value(g_cfg, CONFIG_PATH".numobjs", 1024), 0);
+    e->cd = cache_create_config(CONFIG_PATH);
     if (e->cd == NULL) {
         mtc_err("init cache failure");
         goto error;
     }
+    e->base.cache = e->cd;
     
     return (EventEntry*)e;
     
@@ -117,7 +117,7 @@ NEOERR* bang_user_new(BangInfo *info, BangEntry *e,
 
     MCS_NOT_NULLC(info, e, q);
 
-    REQ_GET_PARAM_STR(q->hdfrcv, "userid", userid);
+    REQ_GET_PARAM_STR(q, "userid", userid);
 
     ruser = calloc(1, sizeof(BangUser));
     if (!ruser) {
@@ -217,8 +217,7 @@ NEOERR* bang_state_transit_accept_battle(BangInfo *info, BangUser *user)
 
 NEOERR* bang_state_transit_battling(BangInfo *info, BangUser *user)
 {
-    unsigned char *msgbuf  = NULL;
-    size_t         msgsize = 0;
+    struct base_msg *msg = NULL;
     HDF           *msgnode;
 
     char *uid;
@@ -251,12 +250,15 @@ NEOERR* bang_state_transit_battling(BangInfo *info, BangUser *user)
     hdf_init(&msgnode);
     hdf_set_value(msgnode, "user_has_been_matched", "1");
     hdf_set_int_value(msgnode, "tableid", user->current_battling_table->tableid);
-    err = base_msg_new("battlebegin", msgnode, &msgbuf, &msgsize);
+    err = base_msg_new("battlebegin", msgnode, &msg);
     if (err != STATUS_OK) {
+        hdf_destroy(&msgnode);
         return nerr_pass(err);
     }
 
-    err = base_msg_send(msgbuf, msgsize, user->inherited_user.fd);
+    err = base_msg_send(msg, user->inherited_user.tcpsock);
+    base_msg_free(msg);
+    hdf_destroy(&msgnode);
     if (err != STATUS_OK) {
         return nerr_pass(err);
     }
@@ -275,8 +277,7 @@ NEOERR* bang_state_transit_battling(BangInfo *info, BangUser *user)
  */
 NEOERR* bang_broadcast_to_battle_message(BangInfo *info, BangUser *user)
 {
-    unsigned char *msgbuf  = NULL;
-    size_t         msgsize = 0;
+    struct base_msg *msg = NULL;
     HDF           *msgnode;
 
     BangUser      *ouser;
@@ -327,11 +328,11 @@ NEOERR* bang_broadcast_to_battle_message(BangInfo *info, BangUser *user)
 
     hdf_init(&msgnode);
     hdf_set_int_value(msgnode, "tableid", user->current_battling_table->tableid);
-    err = base_msg_new("battleinvite", msgnode, &msgbuf, &msgsize);
+    err = base_msg_new("battleinvite", msgnode, &msg);
     if (err != STATUS_OK) {
+        hdf_destroy(&msgnode);
         return nerr_pass(err);
     }
-    hdf_destroy(&msgnode);
 
     USER_START(info->bang_idle_user_hash, ouser) {
         /* skip current user or illegal state users */
@@ -361,14 +362,15 @@ NEOERR* bang_broadcast_to_battle_message(BangInfo *info, BangUser *user)
          * Then, we send battle request message to this user, wait for
          * its response(receive, reject or timeout).
          */
-        err = base_msg_send(msgbuf, msgsize, ouser->inherited_user.fd);
+        err = base_msg_send(msg, ouser->inherited_user.tcpsock);
         TRACE_NOK(err);
 
         /* let's track to next idle user */
         ouser = USER_NEXT(info->bang_idle_user_hash);
     } USER_END;
 
-    base_msg_free(msgbuf);
+    base_msg_free(msg);
+    hdf_destroy(&msgnode);
 
     user->state = BANG_STATE_TO_BATTLE; /* now set user state as 'to battle' */
 
@@ -86,6 +86,10 @@ struct base_user *base_user_new(struct base_info *binfo, char *uid, QueueEntry *
             q->req->tcpsock->on_close = user_destroy;
         else
             q->req->tcpsock->on_close = base_user_destroy;
+        /*
+         * later requests of this user go to the same op thread
+         */
+        moc_set_route_key(q->req->tcpsock, uid);
     }
     
     /*
@@ -143,20 +147,31 @@ void base_user_destroy(void *arg)
 /*
  * msg
  */
-static unsigned char static_buf[MAX_PACKET_LEN];
 
-NEOERR* base_msg_new(char *cmd, HDF *datanode, unsigned char **buf, size_t *size)
-{
-    NEOERR *err;
-
-    MCS_NOT_NULLC(cmd, datanode, buf);
-    MCS_NOT_NULLA(size);
+/* server 主动发给 client 的包，reqid == 0, && reply == MSG_REPLY */
+#define MSG_REPLY 10000
 
-    size_t bsize, vsize;
-    unsigned char *rbuf;
+/*
+ * copy from tcp.c rep_head()
+ * the val is packed at rbuf + REPLY_HEAD_LEN already
+ */
+static void msg_frame(unsigned char *rbuf, size_t vsize)
+{
     uint32_t t;
 
-    memset(static_buf, 0x0, MAX_PACKET_LEN);
+    t = htonl(REPLY_HEAD_LEN + vsize);
+    memcpy(rbuf, &t, 4);
+    t = 0;
+    memcpy(rbuf + 4, &t, 4);
+    t = htonl(MSG_REPLY);
+    memcpy(rbuf + 8, &t, 4);
+    t = htonl(vsize);
+    memcpy(rbuf + 12, &t, 4);
+}
+
+static NEOERR* msg_prepare(char *cmd, HDF *datanode)
+{
+    NEOERR *err;
 
     hdf_set_value(datanode, "_Reserve", "moc");
     err = hdf_set_attr(datanode, "_Reserve", "cmd", cmd);
@@ -164,87 +179,158 @@ NEOERR* base_msg_new(char *cmd, HDF *datanode, unsigned char **buf, size_t *size
 
     TRACE_HDF(datanode);
 
-    vsize = pack_hdf(datanode, static_buf, MAX_PACKET_LEN);
-    if(vsize <= 0) return nerr_raise(NERR_ASSERT, "packet error");
+    return STATUS_OK;
+}
 
-    /*
-     * copy from tcp.c tcp_reply_long()
-     */
-    bsize = 4 + 4 + 4 + 4 + vsize;
-    rbuf = calloc(1, bsize);
-    if (!rbuf) return nerr_raise(NERR_NOMEM, "alloc msg buffer");
+/*
+ * pack datanode in it's encoding straight into a new shbuf, behind the
+ * header room, then give back the room not used
+ */
+static NEOERR* msg_pack(HDF *datanode, bool binary, struct tcp_shbuf **out)
+{
+    struct tcp_shbuf *sb;
+    size_t vsize;
+
+    sb = tcp_shbuf_new(REPLY_HEAD_LEN + MAX_PACKET_LEN);
+    if (!sb) return nerr_raise(NERR_NOMEM, "alloc msg buffer");
+
+    if (binary)
+        vsize = pack_hdf_bin(datanode, sb->data + REPLY_HEAD_LEN,
+                             MAX_PACKET_LEN);
+    else
+        vsize = pack_hdf(datanode, sb->data + REPLY_HEAD_LEN, MAX_PACKET_LEN);
+    if (vsize <= 0) {
+        tcp_shbuf_put(sb);
+        return nerr_raise(NERR_ASSERT, "packet error");
+    }
+    msg_frame(sb->data, vsize);
 
-    t = htonl(bsize);
-    memcpy(rbuf, &t, 4);
+    *out = tcp_shbuf_trim(sb, REPLY_HEAD_LEN + vsize);
 
-    /*
-     * server 主动发给 client 的包，reqid == 0, && reply == 10000
-     */
-    t = 0;
-    memcpy(rbuf + 4, &t, 4);
-    t = htonl(10000);
-    memcpy(rbuf + 8, &t, 4);
-    
-    t = htonl(vsize);
-    memcpy(rbuf + 12, &t, 4);
-    memcpy(rbuf + 16, static_buf, vsize);
+    return STATUS_OK;
+}
 
-    *buf = rbuf;
-    *size = bsize;
+/* the FLAGS_BINARY frame, packed on the first binary user */
+static NEOERR* msg_bin(struct base_msg *msg)
+{
+    if (msg->bin) return STATUS_OK;
+
+    return nerr_pass(msg_pack(msg->node, true, &msg->bin));
+}
+
+NEOERR* base_msg_new(char *cmd, HDF *datanode, struct base_msg **msg)
+{
+    struct base_msg *lmsg;
+    NEOERR *err;
+
+    MCS_NOT_NULLC(cmd, datanode, msg);
+
+    err = msg_prepare(cmd, datanode);
+    if (err != STATUS_OK) return nerr_pass(err);
+
+    lmsg = calloc(1, sizeof(struct base_msg));
+    if (!lmsg) return nerr_raise(NERR_NOMEM, "alloc msg");
+
+    lmsg->node = datanode;
+
+    /* the text frame always, most users want it */
+    err = msg_pack(datanode, false, &lmsg->text);
+    if (err != STATUS_OK) {
+        free(lmsg);
+        return nerr_pass(err);
+    }
+
+    *msg = lmsg;
 
     return STATUS_OK;
 }
 
-NEOERR* base_msg_send(unsigned char *buf, size_t size, int fd)
+NEOERR* base_msg_send(struct base_msg *msg, struct tcp_socket *tcpsock)
 {
-    MCS_NOT_NULLA(buf);
-    if (fd <= 0) return nerr_raise(NERR_ASSERT, "fd 非法");
+    struct tcp_shbuf *sb;
+    NEOERR *err;
 
-    /*
-     * copy from tcp.c rep_send()
-     */
-    size_t rv, c;
+    MCS_NOT_NULLB(msg, tcpsock);
+    if (tcpsock->fd <= 0) return nerr_raise(NERR_ASSERT, "fd 非法");
 
-    MSG_DUMP("send: ",  buf, size);
-    
-    c = 0;
-    while (c < size) {
-        rv = send(fd, buf + c, size - c, 0);
-
-        if (rv == size) return STATUS_OK;
-        else if (rv == 0) return STATUS_OK;
-        else if (rv < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
-            return nerr_raise(NERR_IO, "send return %ld", rv);
+    sb = msg->text;
+    if (tcpsock->binary) {
+        err = msg_bin(msg);
+        if (err != STATUS_OK) return nerr_pass(err);
+        sb = msg->bin;
+    }
+
+    if (!tcp_socket_send(tcpsock, sb->data, sb->len, true))
+        return nerr_raise(NERR_IO, "send to %d failure", tcpsock->fd);
+
+    return STATUS_OK;
+}
+
+NEOERR* base_msg_bcast(struct base_msg *msg, struct tcp_socket **socks, int n)
+{
+    struct tcp_socket *t;
+    int i, ntext = 0, queued;
+    NEOERR *err;
+
+    MCS_NOT_NULLB(msg, socks);
+
+    /* text users first, binary ones after, each gets it's encoding */
+    for (i = 0; i < n; i++) {
+        if (socks[i] && !socks[i]->binary) {
+            t = socks[ntext];
+            socks[ntext++] = socks[i];
+            socks[i] = t;
         }
+    }
 
-        c += rv;
+    queued = tcp_broadcast(msg->text, msg->text->data, msg->text->len,
+                           socks, ntext);
+    if (ntext < n) {
+        err = msg_bin(msg);
+        if (err != STATUS_OK) return nerr_pass(err);
+        queued += tcp_broadcast(msg->bin, msg->bin->data, msg->bin->len,
+                                socks + ntext, n - ntext);
     }
+    if (queued < n) mtc_dbg("bcast to %d of %d users", queued, n);
 
     return STATUS_OK;
 }
 
-void base_msg_free(unsigned char *buf)
+void base_msg_free(struct base_msg *msg)
 {
-    if (!buf) return;
-    free(buf);
+    if (!msg) return;
+    if (msg->text) tcp_shbuf_put(msg->text);
+    if (msg->bin) tcp_shbuf_put(msg->bin);
+    free(msg);
 }
 
-NEOERR* base_msg_touser(char *cmd, HDF *datanode, int fd)
+NEOERR* base_msg_touser(char *cmd, HDF *datanode, struct tcp_socket *tcpsock)
 {
     unsigned char *buf;
-    size_t len;
+    size_t vsize;
     NEOERR *err;
 
-    MCS_NOT_NULLB(cmd, datanode);
+    MCS_NOT_NULLC(cmd, datanode, tcpsock);
+    if (tcpsock->fd <= 0) return nerr_raise(NERR_ASSERT, "fd 非法");
 
-    err = base_msg_new(cmd, datanode, &buf, &len);
+    err = msg_prepare(cmd, datanode);
     if (err != STATUS_OK) return nerr_pass(err);
 
-    err = base_msg_send(buf, len, fd);
-    if (err != STATUS_OK) return nerr_pass(err);
+    /*
+     * one user, so only it's encoding, packed in the thread's buffer and
+     * sent from there, the header goes on the stack
+     */
+    buf = reply_buf();
+    if (!buf) return nerr_raise(NERR_NOMEM, "alloc msg buffer");
+
+    if (tcpsock->binary)
+        vsize = pack_hdf_bin(datanode, buf, MAX_PACKET_LEN);
+    else
+        vsize = pack_hdf(datanode, buf, MAX_PACKET_LEN);
+    if (vsize <= 0) return nerr_raise(NERR_ASSERT, "packet error");
 
-    base_msg_free(buf);
+    if (!tcp_socket_push(tcpsock, MSG_REPLY, buf, vsize))
+        return nerr_raise(NERR_IO, "send to %d failure", tcpsock->fd);
 
     return STATUS_OK;
 }
@@ -1,74 +1,528 @@
 /* Generic cache layer.
- * It's a hash table with cache-style properties, keeping a (non-precise) size
- * and using a natural, per-chain LRU to do cleanups.
+ * It's a hash table with cache-style properties, keeping a memory budget
+ * (or an object count, without one) and using a global CLOCK to do cleanups.
  * Cleanups are performed in place, when cache_set() gets called.
+ *
+ * The table grows and shrinks with the number of objects. It's rehashed
+ * incrementally, a bucket on every operation, so no one pays for the whole
+ * table.
+ *
+ * CLOCK: all entries are on a ring, with a reference bit set when used.
+ * To evict, the hand goes round, clearing the bits it meets, and takes the
+ * first entry with none (or expired). New entries go right behind the hand.
+ *
+ * Expired entries nobody asks for again are reclaimed by cache_expire(),
+ * called by the owner on a tick: it walks a bounded part of the ring per
+ * call, from where the last one stopped.
+ *
+ * cache_empty() doesn't walk the entries either: it bumps the cache's
+ * generation, and entries of an older one are stale, dead like expired ones,
+ * met by a lookup, the CLOCK hand, or cache_expire(), which does more work
+ * while there are stale entries.
+ *
+ * Two engines index the entries: hash chains, the default, and open
+ * addressing (CACHE_F_OPEN, see cache_open.c), whose entries are slab blocks
+ * with small keys and values inline. Everything else is the same.
+ *
+ * Entries may be indexed by key prefix, or tag, to delete them all at once,
+ * see cache_tag.c.
  */
 #include "mheads.h"
 #include "lheads.h"
 
-struct cache *cache_create(size_t numobjs, unsigned int flags)
+#define OPEN(cd)    ((cd)->flags & CACHE_F_OPEN)
+#define EXPIRED(e)  ((e)->expire > 0 && (e)->expire < g_ctime)
+#define DEAD(cd, e) (EXPIRED(e) || CACHE_STALE(cd, e))
+
+static size_t pow2_above(size_t n)
+{
+    size_t len = CACHE_MIN_HASHLEN;
+
+    while (len < n)
+        len <<= 1;
+    return len;
+}
+
+
+/*
+ * values
+ * A value not inline is a struct cache_val, refcounted: the entry holds one
+ * reference, and a reply sending it from the cache holds another, taken by
+ * cache_get_ref(), so the value outlives a replace or an eviction till it's
+ * sent. References may be dropped by other threads, for shared caches.
+ */
+
+static struct cache_val *val_new(size_t vsize)
+{
+    struct cache_val *v;
+
+    v = malloc(sizeof(struct cache_val) + vsize);
+    if (v == NULL)
+        return NULL;
+    v->ref = 1;
+    v->size = vsize;
+
+    return v;
+}
+
+void cache_val_put(struct cache_val *v)
+{
+    if (v != NULL && __sync_sub_and_fetch(&v->ref, 1) == 0)
+        free(v);
+}
+
+/* can the value of e be changed in place, nobody else sees it */
+static bool val_owned(struct cache_entry *e)
+{
+    return (e->eflags & CACHE_E_VINL) ||
+        __atomic_load_n(&CACHE_VAL(e->val)->ref, __ATOMIC_ACQUIRE) == 1;
+}
+
+
+/*
+ * entries
+ */
+
+/* the memory an entry costs against the budget */
+static size_t entry_bytes(struct cache_entry *e)
+{
+    size_t n;
+
+    n = (e->eflags & CACHE_E_SLAB) ? CACHE_SLAB_BLOCK :
+        sizeof(struct cache_entry);
+    if (!(e->eflags & CACHE_E_KINL)) n += e->ksize;
+    if (!(e->eflags & CACHE_E_VINL))
+        n += sizeof(struct cache_val) + e->vsize;
+
+    return n;
+}
+
+/* Replace the value of e, inline if it fits, in place if it's the same
+ * size and not being sent. Returns 0 on memory error, e is unchanged then. */
+static int entry_set_val(struct cache *cd, struct cache_entry *e,
+                         const unsigned char *val, size_t vsize)
+{
+    unsigned char *v, *inl = NULL;
+    size_t room = 0;
+
+    if (vsize == e->vsize && e->val != NULL && val_owned(e)) {
+        memmove(e->val, val, vsize);
+        e->eflags &= ~CACHE_E_INT;
+        return 1;
+    }
+
+    if (e->eflags & CACHE_E_SLAB) {
+        inl = e->inl;
+        room = CACHE_INLINE_LEN;
+        if (e->eflags & CACHE_E_KINL) {
+            inl += e->ksize;
+            room -= e->ksize;
+        }
+    }
+
+    if (vsize <= room) {
+        v = inl;
+        memmove(v, val, vsize);
+    } else {
+        struct cache_val *cv = val_new(vsize);
+        if (cv == NULL)
+            return 0;
+        v = cv->data;
+        memcpy(v, val, vsize);
+    }
+
+    cd->bytes -= entry_bytes(e);
+    if (!(e->eflags & CACHE_E_VINL))
+        cache_val_put(CACHE_VAL(e->val));
+    if (v == inl) e->eflags |= CACHE_E_VINL;
+    else e->eflags &= ~CACHE_E_VINL;
+    e->val = v;
+    e->vsize = vsize;
+    e->eflags &= ~CACHE_E_INT;
+    cd->bytes += entry_bytes(e);
+
+    return 1;
+}
+
+static struct cache_entry *entry_new(struct cache *cd,
+        const unsigned char *key, size_t ksize,
+        const unsigned char *val, size_t vsize, uint32_t hv)
+{
+    struct cache_entry *e;
+
+    if (OPEN(cd)) {
+        e = cslab_get(&cd->slab);
+        if (e == NULL)
+            return NULL;
+        e->eflags = CACHE_E_SLAB;
+    } else {
+        e = malloc(sizeof(struct cache_entry));
+        if (e == NULL)
+            return NULL;
+        e->eflags = 0;
+    }
+
+    if ((e->eflags & CACHE_E_SLAB) && ksize <= CACHE_INLINE_LEN) {
+        e->key = e->inl;
+        e->eflags |= CACHE_E_KINL;
+    } else {
+        e->key = malloc(ksize);
+        if (e->key == NULL)
+            goto error;
+    }
+    memcpy(e->key, key, ksize);
+
+    e->ksize = ksize;
+    e->val = NULL;
+    e->vsize = 0;
+    e->eflags |= CACHE_E_VINL;
+    e->hv = hv;
+    e->gen = cd->gen;
+
+    cd->bytes += entry_bytes(e);
+    if (!entry_set_val(cd, e, val, vsize)) {
+        cd->bytes -= entry_bytes(e);
+        if (!(e->eflags & CACHE_E_KINL))
+            free(e->key);
+        goto error;
+    }
+
+    return e;
+
+error:
+    if (e->eflags & CACHE_E_SLAB) cslab_put(&cd->slab, e);
+    else free(e);
+    return NULL;
+}
+
+static void entry_free(struct cache *cd, struct cache_entry *e)
+{
+    if (!(e->eflags & CACHE_E_KINL))
+        free(e->key);
+    if (!(e->eflags & CACHE_E_VINL))
+        cache_val_put(CACHE_VAL(e->val));
+
+    if (e->eflags & CACHE_E_SLAB) cslab_put(&cd->slab, e);
+    else free(e);
+}
+
+
+/*
+ * hash index
+ */
+
+static int table_alloc(struct cache *cd, int t, size_t len)
+{
+    struct cache_table *tb = &cd->table[t];
+
+    if (OPEN(cd))
+        return copen_alloc(tb, len);
+
+    tb->chain = calloc(len, sizeof(struct cache_entry *));
+    if (tb->chain == NULL)
+        return 0;
+    tb->len = len;
+    tb->used = 0;
+    tb->tag = NULL;
+    tb->slot = NULL;
+    return 1;
+}
+
+static void table_free(struct cache *cd, int t)
+{
+    struct cache_table *tb = &cd->table[t];
+
+    if (OPEN(cd)) {
+        copen_free(tb);
+        return;
+    }
+
+    free(tb->chain);
+    tb->chain = NULL;
+    tb->len = 0;
+}
+
+static void table_clear(struct cache *cd, int t)
+{
+    struct cache_table *tb = &cd->table[t];
+
+    if (OPEN(cd)) copen_clear(tb);
+    else memset(tb->chain, 0, tb->len * sizeof(struct cache_entry *));
+}
+
+/* buckets rehash moves one at a time: chains, or groups */
+static size_t table_buckets(struct cache *cd, int t)
+{
+    return OPEN(cd) ? cd->table[t].len / CACHE_GROUP : cd->table[t].len;
+}
+
+/* The chain of table t the hash value goes to, NULL if t isn't in use or
+ * the chain was moved already. */
+static struct cache_entry **chain(struct cache *cd, int t, uint32_t hv)
 {
     size_t i;
+
+    if (cd->table[t].len == 0)
+        return NULL;
+
+    i = hv & (cd->table[t].len - 1);
+    if (t == 0 && cd->rehashidx >= 0 && i < (size_t)cd->rehashidx)
+        return NULL;
+
+    return &cd->table[t].chain[i];
+}
+
+static struct cache_entry *table_find(struct cache *cd, int t,
+        const unsigned char *key, size_t ksize, uint32_t hv)
+{
+    struct cache_entry **b, *e;
+
+    if (OPEN(cd)) {
+        if (cd->table[t].len == 0)
+            return NULL;
+        return copen_find(&cd->table[t], key, ksize, hv);
+    }
+
+    b = chain(cd, t, hv);
+    if (b == NULL)
+        return NULL;
+
+    for (e = *b; e != NULL; e = e->hnext) {
+        if (e->hv == hv && e->ksize == ksize &&
+            memcmp(key, e->key, ksize) == 0)
+            return e;
+    }
+
+    return NULL;
+}
+
+static int table_insert(struct cache *cd, int t, struct cache_entry *e)
+{
+    struct cache_entry **b;
+
+    if (OPEN(cd))
+        return copen_insert(&cd->table[t], e);
+
+    b = &cd->table[t].chain[e->hv & (cd->table[t].len - 1)];
+    e->hnext = *b;
+    *b = e;
+    return 1;
+}
+
+static int table_remove(struct cache *cd, int t, struct cache_entry *e)
+{
+    struct cache_entry **b, **p;
+
+    if (OPEN(cd)) {
+        if (cd->table[t].len == 0)
+            return 0;
+        return copen_remove(&cd->table[t], e);
+    }
+
+    b = chain(cd, t, e->hv);
+    if (b == NULL)
+        return 0;
+
+    for (p = b; *p != NULL; p = &(*p)->hnext) {
+        if (*p == e) {
+            *p = e->hnext;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Move bucket i of table 0 to table 1. */
+static int table_move(struct cache *cd, size_t i)
+{
+    struct cache_entry *e, *n;
+
+    if (OPEN(cd))
+        return copen_move_group(&cd->table[0], i, &cd->table[1]);
+
+    for (e = cd->table[0].chain[i]; e != NULL; e = n) {
+        n = e->hnext;
+        table_insert(cd, 1, e);
+    }
+    cd->table[0].chain[i] = NULL;
+    return 1;
+}
+
+
+struct cache *cache_create(size_t numobjs, size_t maxbytes, unsigned int flags)
+{
     struct cache *cd;
-    struct cache_chain *c;
 
-    cd = (struct cache *) malloc(sizeof(struct cache));
+    cd = (struct cache *) calloc(1, sizeof(struct cache));
     if (cd == NULL)
         return NULL;
 
     cd->flags = flags;
-
-    /* We calculate the hash size so we have 4 objects per bucket; 4 being
-     * an arbitrary number. It's long enough to make LRU useful, and small
-     * enough to make lookups fast. */
-    cd->chainlen = 4;
     cd->numobjs = numobjs;
-    cd->hashlen = numobjs / cd->chainlen;
-
-    cd->table = (struct cache_chain *)
-            malloc(sizeof(struct cache_chain) * cd->hashlen);
-    if (cd->table == NULL) {
+    cd->maxbytes = maxbytes;
+    cd->count = 0;
+    cd->bytes = 0;
+    cd->hand = NULL;
+    cd->sweep = NULL;
+    cd->rehashidx = -1;
+    cd->flease = 5;
+    cd->tdelim = '_';
+
+    /* about one object per slot, the table grows from there */
+    cd->minlen = pow2_above(numobjs);
+    if (!table_alloc(cd, 0, cd->minlen)) {
         free(cd);
         return NULL;
     }
 
-    for (i = 0; i < cd->hashlen; i++) {
-        c = cd->table + i;
-        c->len = 0;
-        c->first = NULL;
-        c->last = NULL;
+    return cd;
+}
+
+void cache_config(const char *path, size_t *numobjs, size_t *maxbytes,
+                  unsigned int *flags)
+{
+    char key[256];
+    char *engine;
+
+    snprintf(key, sizeof(key), "%s.numobjs", path);
+    *numobjs = hdf_get_int_value(g_cfg, key, 1024);
+    snprintf(key, sizeof(key), "%s.cache_bytes", path);
+    *maxbytes = hdf_get_int_value(g_cfg, key, 0);
+    snprintf(key, sizeof(key), "%s.cache_engine", path);
+    engine = hdf_get_value(g_cfg, key, "chain");
+
+    *flags = 0;
+    if (!strcmp(engine, "open")) *flags |= CACHE_F_OPEN;
+    else if (strcmp(engine, "chain"))
+        mtc_warn("%s unknown cache engine %s, use chain", path, engine);
+}
+
+struct cache *cache_create_config(const char *path)
+{
+    char key[256];
+    struct cache *cd;
+    size_t numobjs, maxbytes;
+    unsigned int flags;
+    char *file;
+    int interval;
+    HDF *node;
+
+    cache_config(path, &numobjs, &maxbytes, &flags);
+
+    cd = cache_create(numobjs, maxbytes, flags);
+    if (cd == NULL)
+        return NULL;
+
+    /* before the snapshot, it's entries are indexed too */
+    snprintf(key, sizeof(key), "%s.index_delim", path);
+    file = hdf_get_value(g_cfg, key, "_");
+    if (*file != '\0') cd->tdelim = *file;
+    snprintf(key, sizeof(key), "%s.index_prefix", path);
+    node = hdf_get_child(g_cfg, key);
+    for (; node != NULL; node = hdf_obj_next(node)) {
+        file = hdf_obj_value(node);
+        if (file != NULL && !cache_tag_prefix(cd, file))
+            mtc_err("%s index prefix %s failure", path, file);
+    }
+
+    /* warm start from the last snapshot, see cache_snap.c */
+    snprintf(key, sizeof(key), "%s.snapshot", path);
+    file = hdf_get_value(g_cfg, key, NULL);
+    if (file != NULL) {
+        snprintf(key, sizeof(key), "%s.snapshot_interval", path);
+        interval = hdf_get_int_value(g_cfg, key, 300);
+        if (cache_snap_init(cd, file, interval))
+            cache_snap_load(cd, file);
+        else
+            mtc_err("%s snapshot %s failure", path, file);
+    }
+
+    snprintf(key, sizeof(key), "%s.flight_lease", path);
+    cd->flease = hdf_get_int_value(g_cfg, key, 5);
+    snprintf(key, sizeof(key), "%s.single_flight", path);
+    node = hdf_get_child(g_cfg, key);
+    for (; node != NULL; node = hdf_obj_next(node)) {
+        file = hdf_obj_value(node);
+        if (file != NULL && !cache_flight_prefix(cd, file))
+            mtc_err("%s single flight %s failure", path, file);
     }
 
     return cd;
 }
 
 
-int cache_free(struct cache *cd)
+static void free_entries(struct cache *cd)
 {
-    size_t i;
-    struct cache_chain *c;
     struct cache_entry *e, *n;
 
-    for (i = 0; i < cd->hashlen; i++) {
-        c = cd->table + i;
-        if (c->first == NULL)
-            continue;
-
-        e = c->first;
-        while (e != NULL) {
-            n = e->next;
-            free(e->key);
-            free(e->val);
-            free(e);
-            e = n;
-        }
+    e = cd->hand;
+    while (e != NULL) {
+        n = e->next;
+        entry_free(cd, e);
+        e = (n == cd->hand) ? NULL : n;
     }
+    cd->hand = NULL;
+    cd->sweep = NULL;
+    cd->count = 0;
+    cd->stale = 0;
+    cache_tag_free(cd);
+    cd->bytes = 0;
+
+    /* the snapshot in progress ends here */
+    if (cd->snap) {
+        cd->snap->cur = NULL;
+        cd->snap->left = 0;
+    }
+}
 
-    free(cd->table);
+int cache_free(struct cache *cd)
+{
+    free_entries(cd);
+
+    cache_snap_free(cd);
+    cache_flight_free(cd);
+    free(cd->flights);
+    while (cd->nfprefix > 0)
+        free(cd->fprefix[--cd->nfprefix]);
+    free(cd->fprefix);
+    free(cd->tags);
+    free(cd->links);
+    while (cd->ntprefix > 0)
+        free(cd->tprefix[--cd->ntprefix]);
+    free(cd->tprefix);
+    table_free(cd, 0);
+    table_free(cd, 1);
+    cslab_free(&cd->slab);
     free(cd);
     return 1;
 }
 
+/* Drop all entries, at once: they're stale from now on, and reclaimed
+ * later, see the top of the file. */
+void cache_empty(struct cache *cd)
+{
+    cache_flight_free(cd);
+
+    cd->gen++;
+    if (cd->gen != 0) {
+        cd->stale = cd->count;
+        return;
+    }
+
+    /* wrapped, entries that old would be alive again, free them now. the
+     * table keeps it's size. */
+    free_entries(cd);
+
+    if (cd->rehashidx >= 0) {
+        table_free(cd, 0);
+        cd->table[0] = cd->table[1];
+        memset(&cd->table[1], 0, sizeof(struct cache_table));
+        cd->rehashidx = -1;
+    }
+    table_clear(cd, 0);
+}
+
 
 /*
  * The hash function used is the "One at a time" function, which seems simple,
@@ -98,219 +552,472 @@ static uint32_t hash(const unsigned char *key, const size_t ksize)
     return h;
 }
 
+uint32_t cache_hash(const unsigned char *key, size_t ksize)
+{
+    return hash(key, ksize);
+}
+
+
+/*
+ * Incremental rehashing
+ */
+
+static void rehash_start(struct cache *cd, size_t len)
+{
+    if (cd->rehashidx >= 0)
+        return;
+
+    /* open tables are rebuilt at the same size to drop deleted slots */
+    if (len == cd->table[0].len && !OPEN(cd))
+        return;
+
+    if (!table_alloc(cd, 1, len)) {
+        /* keep going with the longer chains */
+        mtc_warn("cache rehash to %zu failure", len);
+        return;
+    }
+
+    cd->rehashidx = 0;
+}
+
+static void rehash_check(struct cache *cd);
 
-/* Looks up the given key in the chain. Returns NULL if not found, or a
- * pointer to the cache entry if it is. The chain can be empty. */
-static struct cache_entry *find_in_chain(struct cache_chain *c,
-        const unsigned char *key, size_t ksize)
+/* Move the entries of one non empty bucket to the new table, false when
+ * it can't go on. */
+static bool rehash_step(struct cache *cd)
 {
-    struct cache_entry *e;
+    size_t buckets;
+    int empty = 10;
 
-    for (e = c->first; e != NULL; e = e->next) {
-        if (ksize != e->ksize) {
-            continue;
+    if (cd->rehashidx < 0)
+        return true;
+
+    buckets = table_buckets(cd, 0);
+
+    /* don't walk a long run of empty buckets on one operation */
+    while (!OPEN(cd) && (size_t)cd->rehashidx < buckets &&
+           cd->table[0].chain[cd->rehashidx] == NULL) {
+        cd->rehashidx++;
+        if (--empty == 0) return true;
+    }
+
+    if ((size_t)cd->rehashidx < buckets) {
+        if (!table_move(cd, cd->rehashidx)) {
+            /* can't be, table[1] is sized for all we have */
+            mtc_err("cache rehash overflow");
+            return false;
         }
-        if (memcmp(key, e->key, ksize) == 0) {
-            break;
+        cd->rehashidx++;
+    }
+
+    if ((size_t)cd->rehashidx == buckets) {
+        table_free(cd, 0);
+        cd->table[0] = cd->table[1];
+        memset(&cd->table[1], 0, sizeof(struct cache_table));
+        cd->rehashidx = -1;
+
+        /* the load may have changed a lot meanwhile */
+        rehash_check(cd);
+    }
+
+    return true;
+}
+
+/* Start growing or shrinking, if the load asks for it. */
+static void rehash_check(struct cache *cd)
+{
+    struct cache_table *t = &cd->table[0];
+
+    if (cd->rehashidx >= 0) {
+        /* open tables can't overflow, finish it at once if it comes near */
+        if (OPEN(cd) && cd->table[1].used * 8 > cd->table[1].len * 7) {
+            while (cd->rehashidx >= 0) {
+                if (!rehash_step(cd)) break;
+            }
         }
+        return;
     }
 
-    /* e will be either the found chain or NULL */
-    return e;
+    if (OPEN(cd)) {
+        /* deleted slots count, they lengthen the probes too */
+        if (t->used * 8 > t->len * 7)
+            rehash_start(cd, pow2_above(cd->count * 2));
+        else if (t->len > cd->minlen && cd->count < t->len / 16)
+            rehash_start(cd, t->len / 2);
+        return;
+    }
+
+    if (cd->count > t->len)
+        rehash_start(cd, t->len * 2);
+    else if (t->len > cd->minlen && cd->count < t->len / 8)
+        rehash_start(cd, t->len / 2);
 }
 
 
 /* Looks up the given key in the cache. Returns NULL if not found, or a
- * pointer to the cache entry if it is. Useful to avoid doing the calculation
- * in the open when the cache chain will not be needed. */
+ * pointer to the cache entry if it is. */
 static struct cache_entry *find_in_cache(struct cache *cd,
-        const unsigned char *key, size_t ksize)
+        const unsigned char *key, size_t ksize, uint32_t hv)
+{
+    struct cache_entry *e;
+
+    e = table_find(cd, 0, key, ksize, hv);
+    if (e == NULL && cd->rehashidx >= 0)
+        e = table_find(cd, 1, key, ksize, hv);
+
+    return e;
+}
+
+
+/*
+ * CLOCK ring
+ */
+
+static void ring_insert(struct cache *cd, struct cache_entry *e)
+{
+    if (cd->hand == NULL) {
+        e->prev = e->next = e;
+        cd->hand = e;
+        return;
+    }
+
+    /* behind the hand, the last one it will visit */
+    e->next = cd->hand;
+    e->prev = cd->hand->prev;
+    e->prev->next = e;
+    cd->hand->prev = e;
+}
+
+static void ring_remove(struct cache *cd, struct cache_entry *e)
+{
+    if (e->next == e) {
+        cd->hand = NULL;
+        cd->sweep = NULL;
+        if (cd->snap) cd->snap->cur = NULL;
+        return;
+    }
+
+    if (cd->hand == e)
+        cd->hand = e->next;
+    if (cd->sweep == e)
+        cd->sweep = e->next;
+    if (cd->snap && cd->snap->cur == e)
+        cd->snap->cur = e->next;
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+
+/* Unlink e from the index and the ring, and free it. */
+static void remove_entry(struct cache *cd, struct cache_entry *e)
 {
-    uint32_t h;
-    struct cache_chain *c;
+    if (!table_remove(cd, 0, e) && cd->rehashidx >= 0)
+        table_remove(cd, 1, e);
+
+    ring_remove(cd, e);
+
+    if (CACHE_STALE(cd, e)) cd->stale--;
+    cd->count--;
+    cd->bytes -= entry_bytes(e);
 
-    h = hash(key, ksize) % cd->hashlen;
-    c = cd->table + h;
+    if (e->eflags & CACHE_E_TAGGED)
+        cache_tag_unlink(cd, e);
+
+    entry_free(cd, e);
+}
+
+/* Remove a dead entry, counted as what killed it. */
+static void reclaim(struct cache *cd, struct cache_entry *e)
+{
+    if (CACHE_STALE(cd, e)) cd->flushed++;
+    else cd->expired++;
 
-    return find_in_chain(c, key, ksize);
+    remove_entry(cd, e);
+}
+
+/* The live entry of key, a dead one is removed. */
+static struct cache_entry *find_live(struct cache *cd,
+        const unsigned char *key, size_t ksize, uint32_t hv)
+{
+    struct cache_entry *e;
+
+    e = find_in_cache(cd, key, ksize, hv);
+    if (e != NULL && DEAD(cd, e)) {
+        reclaim(cd, e);
+        rehash_check(cd);
+        e = NULL;
+    }
+
+    return e;
+}
+
+static bool over_budget(struct cache *cd)
+{
+    if (cd->maxbytes > 0)
+        return cd->bytes > cd->maxbytes;
+
+    return cd->numobjs > 0 && cd->count > cd->numobjs;
+}
+
+/* Evict entries with the CLOCK until we're in the budget. keep is never
+ * evicted, even when it's larger than the budget itself. */
+static void evict(struct cache *cd, struct cache_entry *keep)
+{
+    struct cache_entry *e;
+
+    while (over_budget(cd) && cd->count > 1) {
+        e = cd->hand;
+        cd->hand = e->next;
+
+        if (e == keep)
+            continue;
+
+        if (DEAD(cd, e)) {
+            reclaim(cd, e);
+            continue;
+        } else if (e->ref) {
+            e->ref = 0;
+            continue;
+        } else {
+            cd->evicted++;
+        }
+
+        remove_entry(cd, e);
+    }
+}
+
+
+/* Remove the dead entries among the next max ones of the ring, at least
+ * CACHE_FLUSH_WORK while there are stale ones. Returns how many were
+ * removed. */
+size_t cache_expire(struct cache *cd, size_t max)
+{
+    struct cache_entry *e;
+    size_t n = 0;
+
+    /* an idle cache finishes it's rehash here */
+    rehash_step(cd);
+
+    if (cd->stale > 0 && max < CACHE_FLUSH_WORK)
+        max = CACHE_FLUSH_WORK;
+    if (max > cd->count)
+        max = cd->count;
+
+    if (cd->sweep == NULL)
+        cd->sweep = cd->hand;
+
+    while (max-- > 0 && cd->sweep != NULL) {
+        e = cd->sweep;
+        cd->sweep = e->next;
+
+        if (DEAD(cd, e)) {
+            reclaim(cd, e);
+            n++;
+        }
+    }
+
+    if (n > 0)
+        rehash_check(cd);
+
+    cache_flight_expire(cd);
+
+    return n;
 }
 
 
 /* Gets the matching value for the given key.  Returns 0 if no match was
- * found, or 1 otherwise. */
+ * found, CACHE_VAL_BYTES, or CACHE_VAL_INT if it's a counter, *val points
+ * to it's int64_t then (not aligned, memcpy() it). */
 int cache_get(struct cache *cd, const unsigned char *key, size_t ksize,
         unsigned char **val, size_t *vsize)
 {
     struct cache_entry *e;
 
-    e = find_in_cache(cd, key, ksize);
+    rehash_step(cd);
 
-    if (e == NULL) {
-        *val = NULL;
-        *vsize = 0;
-        return 0;
-    }
+    e = find_live(cd, key, ksize, hash(key, ksize));
 
-    if (e->expire > 0 && e->expire < g_ctime) {
-        cache_del(cd, (unsigned char*)key, (size_t)ksize);
+    if (e == NULL) {
         *val = NULL;
         *vsize = 0;
         return 0;
     }
 
+    e->ref = 1;
     *val = e->val;
     *vsize = e->vsize;
 
-    return 1;
+    return (e->eflags & CACHE_E_INT) ? CACHE_VAL_INT : CACHE_VAL_BYTES;
 }
 
-
-int cache_set(struct cache *cd, const unsigned char *key, size_t ksize,
-        const unsigned char *val, size_t vsize, int timeout)
+/* Like cache_get(), but the value is held in *ref till cache_val_put(),
+ * whatever happens to the entry, to be sent from there. A value inline is
+ * copied into a new one. */
+int cache_get_ref(struct cache *cd, const unsigned char *key, size_t ksize,
+                  struct cache_val **ref)
 {
-    int rv = 1;
-    uint32_t h = 0;
-    struct cache_chain *c;
-    struct cache_entry *e, *new;
-    unsigned char *v;
+    struct cache_entry *e;
 
-    h = hash(key, ksize) % cd->hashlen;
-    c = cd->table + h;
+    rehash_step(cd);
 
-    e = find_in_chain(c, key, ksize);
+    *ref = NULL;
 
-    if (e == NULL) {
-        /* not found, create a new cache entry */
-        new = malloc(sizeof(struct cache_entry));
-        if (new == NULL) {
-            rv = 0;
-            goto exit;
-        }
+    e = find_live(cd, key, ksize, hash(key, ksize));
+    if (e == NULL)
+        return 0;
 
-        new->ksize = ksize;
-        new->vsize = vsize;
-        if (timeout == 0) {
-            new->expire = 0;
-        } else {
-            new->expire = g_ctime + timeout;
-        }
+    if (e->eflags & CACHE_E_VINL) {
+        *ref = val_new(e->vsize);
+        if (*ref == NULL)
+            return 0;
+        memcpy((*ref)->data, e->val, e->vsize);
+    } else {
+        *ref = CACHE_VAL(e->val);
+        __sync_fetch_and_add(&(*ref)->ref, 1);
+    }
+    e->ref = 1;
 
-        new->key = malloc(ksize);
-        if (new->key == NULL) {
-            free(new);
-            rv = 0;
-            goto exit;
-        }
-        memcpy(new->key, key, ksize);
-
-        new->val = malloc(vsize);
-        if (new->val == NULL) {
-            free(new->key);
-            free(new);
-            rv = 0;
-            goto exit;
-        }
-        memcpy(new->val, val, vsize);
-        new->prev = NULL;
-        new->next = NULL;
-
-        /* and put it in */
-        if (c->len == 0) {
-            /* line is empty, just put it there */
-            c->first = new;
-            c->last = new;
-            c->len = 1;
-        } else if (c->len <= cd->chainlen) {
-            /* slots are still available, put the entry first */
-            new->next = c->first;
-            c->first->prev = new;
-            c->first = new;
-            c->len += 1;
-        } else {
-            /* chain is full, we need to evict the last one */
-            e = c->last;
-            c->last = e->prev;
-            c->last->next = NULL;
-            free(e->key);
-            free(e->val);
-            free(e);
+    return (e->eflags & CACHE_E_INT) ? CACHE_VAL_INT : CACHE_VAL_BYTES;
+}
+
+
+/* Set key to val, found or not. Returns the entry, NULL on memory error. */
+static struct cache_entry *put(struct cache *cd, const unsigned char *key,
+        size_t ksize, uint32_t hv, const unsigned char *val, size_t vsize,
+        int timeout)
+{
+    struct cache_entry *e;
+
+    /* a dead entry is reclaimed rather than reused, so it's tags and
+     * counters don't leak into the new value */
+    e = find_live(cd, key, ksize, hv);
 
-            new->next = c->first;
-            c->first->prev = new;
-            c->first = new;
+    if (e == NULL) {
+        /* not found, create a new cache entry */
+        e = entry_new(cd, key, ksize, val, vsize, hv);
+        if (e == NULL)
+            return NULL;
+
+        /* and put it in, the new table while rehashing */
+        if (!table_insert(cd, cd->rehashidx >= 0 ? 1 : 0, e)) {
+            cd->bytes -= entry_bytes(e);
+            entry_free(cd, e);
+            return NULL;
         }
+        ring_insert(cd, e);
+        cd->count++;
+
+        if (cd->ntprefix > 0)
+            cache_tag_index(cd, e);
     } else {
         /* we've got a match, just replace the value in place */
-        v = malloc(vsize);
-        if (v == NULL) {
-            rv = 0;
-            goto exit;
-        }
-        free(e->val);
-        e->val = v;
-        e->vsize = vsize;
-        memcpy(e->val, val, vsize);
-
-        /* promote the entry to the top of the list if necessary */
-        if (c->first != e) {
-            if (c->last == e)
-                c->last = e->prev;
-
-            e->prev->next = e->next;
-            if (e->next != NULL)
-                e->next->prev = e->prev;
-            e->prev = NULL;
-            e->next = c->first;
-            c->first->prev = e;
-            c->first = e;
-        }
+        if (!entry_set_val(cd, e, val, vsize))
+            return NULL;
     }
 
-exit:
-    return rv;
+    e->ref = 1;
+    if (timeout == 0) {
+        e->expire = 0;
+    } else {
+        e->expire = g_ctime + timeout;
+    }
+
+    evict(cd, e);
+    rehash_check(cd);
+
+    return e;
+}
+
+int cache_set(struct cache *cd, const unsigned char *key, size_t ksize,
+        const unsigned char *val, size_t vsize, int timeout)
+{
+    uint32_t hv;
+    struct cache_entry *e;
+
+    rehash_step(cd);
+
+    hv = hash(key, ksize);
+    e = put(cd, key, ksize, hv, val, vsize, timeout);
+    if (e == NULL)
+        return 0;
+
+    /* the misses waiting for it */
+    if (cd->nflights > 0)
+        cache_flight_land(cd, key, ksize, hv, e->val, e->vsize);
+
+    return 1;
 }
 
 
 int cache_del(struct cache *cd, const unsigned char *key, size_t ksize)
 {
+    struct cache_entry *e;
 
-    int rv = 1;
-    uint32_t h = 0;
-    struct cache_chain *c;
+    rehash_step(cd);
+
+    e = find_live(cd, key, ksize, hash(key, ksize));
+    if (e == NULL)
+        return 0;
+
+    remove_entry(cd, e);
+    rehash_check(cd);
+
+    return 1;
+}
+
+
+/* Put key in tag. Returns 1, 0 if key isn't in the cache, -3 on memory
+ * error. */
+int cache_tag(struct cache *cd, const unsigned char *key, size_t ksize,
+              const unsigned char *tag, size_t tsize)
+{
     struct cache_entry *e;
 
-    h = hash(key, ksize) % cd->hashlen;
-    c = cd->table + h;
+    e = find_live(cd, key, ksize, hash(key, ksize));
+    if (e == NULL)
+        return 0;
 
-    e = find_in_chain(c, key, ksize);
+    if (!cache_tag_link(cd, e, CACHE_TAG_NAME, tag, tsize))
+        return -3;
 
-    if (e == NULL) {
-        rv = 0;
-        goto exit;
-    }
+    return 1;
+}
 
-    if (c->first == e) {
-        c->first = e->next;
-        if (e->next != NULL)
-            e->next->prev = NULL;
-    } else {
-        e->prev->next = e->next;
-        if (e->next != NULL)
-            e->next->prev = e->prev;
-    }
+/* Delete all members of a tag, returns how many were alive. */
+static int del_members(struct cache *cd, int kind,
+                       const unsigned char *name, size_t nsize)
+{
+    struct cache_tag *t;
+    struct cache_entry *e;
+    int n = 0;
 
-    if (c->last == e) {
-        c->last = e->prev;
+    /* the tag goes with it's last member */
+    while ((t = cache_tag_find(cd, kind, name, nsize)) != NULL) {
+        e = t->members->e;
+        if (!DEAD(cd, e)) n++;
+        remove_entry(cd, e);
     }
+    rehash_check(cd);
 
-    free(e->key);
-    free(e->val);
-    free(e);
+    return n;
+}
 
-    c->len -= 1;
+int cache_del_tag(struct cache *cd, const unsigned char *tag, size_t tsize)
+{
+    rehash_step(cd);
 
-exit:
-    return rv;
+    return del_members(cd, CACHE_TAG_NAME, tag, tsize);
+}
+
+int cache_del_prefix(struct cache *cd, const unsigned char *prefix,
+                     size_t psize)
+{
+    rehash_step(cd);
+
+    if (!cache_tag_indexed(cd, prefix, psize))
+        return -1;
+
+    return del_members(cd, CACHE_TAG_PREFIX, prefix, psize);
 }
 
 
@@ -323,9 +1030,8 @@ int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
 {
     int rv = 1;
     struct cache_entry *e;
-    unsigned char *buf;
 
-    e = find_in_cache(cd, key, ksize);
+    e = find_live(cd, key, ksize, hash(key, ksize));
 
     if (e == NULL) {
         rv = -1;
@@ -342,29 +1048,80 @@ int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
         goto exit;
     }
 
-    buf = malloc(nvsize);
-    if (buf == NULL) {
+    if (!entry_set_val(cd, e, newval, nvsize)) {
         rv = -2;
         goto exit;
     }
-
-    memcpy(buf, newval, nvsize);
-    free(e->val);
-    e->val = buf;
-    e->vsize = nvsize;
+    e->ref = 1;
 
 exit:
     return rv;
 }
 
 
+/*
+ * counters
+ * An int64_t value, CACHE_E_INT, kept binary: 8 bytes, inline in a slab
+ * entry, and updated in place, with no allocation nor parsing. It's text
+ * only on the wire, see sys_cmd_cache_get().
+ */
+
+static inline int64_t entry_int(struct cache_entry *e)
+{
+    int64_t n;
+
+    memcpy(&n, e->val, sizeof(n));
+    return n;
+}
+
+/* Make e the counter n. Returns 0 on memory error. */
+static int entry_set_int(struct cache *cd, struct cache_entry *e, int64_t n)
+{
+    if (!entry_set_val(cd, e, (unsigned char*)&n, sizeof(n)))
+        return 0;
+    e->eflags |= CACHE_E_INT;
+
+    return 1;
+}
+
+/* The number in e, a counter or, as cache_incr() used to keep them, a NULL
+ * terminated decimal. Returns 0 if it's neither. */
+static int entry_num(struct cache_entry *e, int64_t *n)
+{
+    if (e->eflags & CACHE_E_INT) {
+        *n = entry_int(e);
+        return 1;
+    }
+
+    /* the value must be a NULL terminated string, otherwise strtoll might
+     * cause a segmentation fault */
+    if (e->vsize == 0 || e->val[e->vsize - 1] != '\0')
+        return 0;
+
+    *n = strtoll((char *) e->val, NULL, 10);
+    return 1;
+}
+
+/* Misses waiting for a counter get it as text, like over the wire. */
+static void land_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                     uint32_t hv, int64_t n)
+{
+    char buf[24];
+    int len;
+
+    if (cd->nflights == 0) return;
+
+    len = snprintf(buf, sizeof(buf), "%lld", (long long int)n);
+    cache_flight_land(cd, key, ksize, hv, (unsigned char*)buf, len + 1);
+}
+
 /* Increment the value associated with the given key by the given increment.
- * The increment is a signed 64 bit value, and the value size must be >= 8
- * bytes.
+ * The increment is a signed 64 bit value. The value is made a counter, if
+ * it was a decimal string.
  * Returns:
  *    1 if the increment succeeded.
  *   -1 if the value was not in the cache.
- *   -2 if the value was not null terminated.
+ *   -2 if the value was not a number.
  *   -3 if there was a memory error.
  *
  * The new value will be set in the newval parameter if the increment was
@@ -373,45 +1130,126 @@ exit:
 int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
         int64_t increment, int64_t *newval)
 {
-    unsigned char *val;
-    int64_t intval;
-    size_t vsize;
     struct cache_entry *e;
+    int64_t n;
 
-    e = find_in_cache(cd, key, ksize);
-
+    e = find_live(cd, key, ksize, hash(key, ksize));
     if (e == NULL)
         return -1;
 
-    val = e->val;
-    vsize = e->vsize;
-
-    /* the value must be a NULL terminated string, otherwise strtoll might
-     * cause a segmentation fault */
-    if (val && val[vsize - 1] != '\0')
+    if (!entry_num(e, &n))
         return -2;
+    n += increment;
 
-    intval = strtoll((char *) val, NULL, 10);
-    intval = intval + increment;
+    if ((e->eflags & CACHE_E_INT) && val_owned(e))
+        memcpy(e->val, &n, sizeof(n));
+    else if (!entry_set_int(cd, e, n))
+        return -3;
+    e->ref = 1;
 
-    /* The max value for an unsigned long long is 18446744073709551615,
-     * and strlen('18446744073709551615') = 20, so if the value is smaller
-     * than 24 (just in case) we create a new buffer. */
-    if (vsize < 24) {
-        unsigned char *nv = malloc(24);
-        if (nv == NULL)
-            return -3;
-        free(val);
-        e->val = val = nv;
-        e->vsize = vsize = 24;
-    }
+    *newval = n;
+
+    return 1;
+}
+
+/* Like cache_incr(), but a missing key is created, at 0, with the given
+ * timeout (0 for none). A live counter keeps it's expiry. Decrement with a
+ * negative increment.
+ * Returns 1, -2 if the value was not a number, or -3 on memory error. */
+int cache_counter(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t increment, int timeout, int64_t *newval)
+{
+    struct cache_entry *e;
+    uint32_t hv;
+    int rv;
+
+    rehash_step(cd);
+
+    hv = hash(key, ksize);
+    rv = cache_incr(cd, key, ksize, increment, newval);
+    if (rv != -1)
+        return rv;
+
+    e = put(cd, key, ksize, hv, (unsigned char*)&increment,
+            sizeof(increment), timeout);
+    if (e == NULL)
+        return -3;
+    e->eflags |= CACHE_E_INT;
 
-    snprintf((char *) val, vsize, "%23lld", (long long int) intval);
-    *newval = intval;
+    *newval = increment;
+    land_int(cd, key, ksize, hv, increment);
 
     return 1;
 }
 
+int cache_set_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t num, int timeout)
+{
+    struct cache_entry *e;
+    uint32_t hv;
+
+    rehash_step(cd);
+
+    hv = hash(key, ksize);
+    e = put(cd, key, ksize, hv, (unsigned char*)&num, sizeof(num), timeout);
+    if (e == NULL)
+        return 0;
+    e->eflags |= CACHE_E_INT;
+
+    land_int(cd, key, ksize, hv, num);
+
+    return 1;
+}
+
+/* Returns 1 if key is a number, in *num, 0 if it's not in the cache, -2 if
+ * it's not a number. */
+int cache_get_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t *num)
+{
+    struct cache_entry *e;
+
+    rehash_step(cd);
+
+    *num = 0;
+
+    e = find_live(cd, key, ksize, hash(key, ksize));
+    if (e == NULL)
+        return 0;
+
+    if (!entry_num(e, num))
+        return -2;
+    e->ref = 1;
+
+    return 1;
+}
+
+/* Set key to the counter num, returning the value it had in *old (0 if
+ * none). Returns 1 if it had a number, 0 if not, -3 on memory error. */
+int cache_getset_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                     int64_t num, int timeout, int64_t *old)
+{
+    struct cache_entry *e;
+    uint32_t hv;
+    int rv;
+
+    rehash_step(cd);
+
+    hv = hash(key, ksize);
+    *old = 0;
+
+    e = find_live(cd, key, ksize, hv);
+    rv = e != NULL && entry_num(e, old);
+
+    e = put(cd, key, ksize, hv, (unsigned char*)&num, sizeof(num), timeout);
+    if (e == NULL)
+        return -3;
+    e->eflags |= CACHE_E_INT;
+
+    land_int(cd, key, ksize, hv, num);
+
+    return rv;
+}
+
 int cache_getf(struct cache *cd, unsigned char **val, size_t *vsize,
                const char *keyfmt, ...)
 {
@@ -466,3 +1304,45 @@ int cache_incrf(struct cache *cd, int64_t increment, int64_t *newval,
 
     return cache_incr(cd, (unsigned char*)key, (size_t)r, increment, newval);
 }
+
+int cache_counterf(struct cache *cd, int64_t increment, int timeout,
+                   int64_t *newval, const char *keyfmt, ...)
+{
+    char key[MAX_CACHEKEY_LEN];
+    va_list ap;
+    int r;
+
+    va_start(ap, keyfmt);
+    r = vsnprintf(key, MAX_CACHEKEY_LEN, keyfmt, ap);
+    va_end(ap);
+
+    return cache_counter(cd, (unsigned char*)key, (size_t)r, increment,
+                         timeout, newval);
+}
+
+int cache_set_intf(struct cache *cd, int64_t num, int timeout,
+                   const char *keyfmt, ...)
+{
+    char key[MAX_CACHEKEY_LEN];
+    va_list ap;
+    int r;
+
+    va_start(ap, keyfmt);
+    r = vsnprintf(key, MAX_CACHEKEY_LEN, keyfmt, ap);
+    va_end(ap);
+
+    return cache_set_int(cd, (unsigned char*)key, (size_t)r, num, timeout);
+}
+
+int cache_get_intf(struct cache *cd, int64_t *num, const char *keyfmt, ...)
+{
+    char key[MAX_CACHEKEY_LEN];
+    va_list ap;
+    int r;
+
+    va_start(ap, keyfmt);
+    r = vsnprintf(key, MAX_CACHEKEY_LEN, keyfmt, ap);
+    va_end(ap);
+
+    return cache_get_int(cd, (unsigned char*)key, (size_t)r, num);
+}
@@ -5,53 +5,204 @@
 #define _CACHE_H
 
 #define MAX_CACHEKEY_LEN    1024
+#define CACHE_MIN_HASHLEN   16
+/* cache_expire() work, at least, while there are stale entries */
+#define CACHE_FLUSH_WORK    8192
+
+/* cache_create() flags */
+#define CACHE_F_OPEN        0x01    /* open addressing engine, cache_open.c */
+
+/*
+ * one hash index, of len slots:
+ * chained, a list per slot, or
+ * open addressed (CACHE_F_OPEN), a tag and an entry per slot, in groups of
+ * CACHE_GROUP slots
+ */
+struct cache_table {
+    size_t len;
+    size_t used;                    /* open: non empty slots, deleted too */
+
+    struct cache_entry **chain;
+
+    unsigned char *tag;
+    struct cache_entry **slot;
+};
+
+/* free blocks for entries with their key and value inline, CACHE_F_OPEN */
+struct cache_slab {
+    void *chunks;
+    struct cache_entry *free;
+};
 
 struct cache {
     /* set directly by initialization */
-    size_t numobjs;
+    size_t numobjs;         /* max objects, if maxbytes is 0 */
+    size_t maxbytes;        /* memory budget, keys, values and entries */
     unsigned int flags;
 
     /* calculated */
-    size_t hashlen;
-    size_t chainlen;
+    size_t minlen;          /* the table don't shrink below it */
+    size_t count;
+    size_t bytes;
+
+    /*
+     * the cache data itself
+     * while rehashing, entries move from table[0] to table[1] a few buckets
+     * per operation, rehashidx is the next bucket to move, -1 if none.
+     */
+    struct cache_table table[2];
+    long rehashidx;
+
+    /* CLOCK hand, on the ring of all entries */
+    struct cache_entry *hand;
+    /* where cache_expire() goes on */
+    struct cache_entry *sweep;
+
+    /* entries removed since created */
+    size_t expired;
+    size_t evicted;         /* to keep in the budget, not expired yet */
+    size_t flushed;         /* stale ones, see gen */
+
+    /* bumped by cache_empty(), older entries are stale */
+    uint16_t gen;
+    size_t stale;           /* of them in count, not reclaimed yet */
+
+    struct cache_slab slab;
+
+    /* to disk, NULL if not configured, see cache_snap.c */
+    struct cache_snap *snap;
+
+    /* single flight misses, see cache_flight.c */
+    struct cache_flight **flights;
+    size_t nflights;
+    char **fprefix;         /* of keys opted in */
+    int nfprefix;
+    int flease;             /* seconds a flight waits for it's set */
+    size_t coalesced;       /* misses parked on a flight */
 
-    /* the cache data itself */
-    struct cache_chain *table;
+    /* prefix and tag index, see cache_tag.c */
+    struct cache_tag **tags;
+    size_t tagslen;
+    size_t ntags;
+    struct cache_link **links;
+    size_t linkslen;
+    size_t nlinks;
+    char **tprefix;         /* index_prefix */
+    int ntprefix;
+    char tdelim;            /* ends a group under a prefix */
 };
 
 typedef struct cache Cache;
 
-struct cache_chain {
-    size_t len;
-    struct cache_entry *first;
-    struct cache_entry *last;
+/* e was set before the last cache_empty(), and is as good as gone */
+#define CACHE_STALE(cd, e)  ((e)->gen != (cd)->gen)
+
+/* cache_entry eflags */
+#define CACHE_E_SLAB        0x01    /* the entry is a slab block */
+#define CACHE_E_KINL        0x02    /* key in inl[] */
+#define CACHE_E_VINL        0x04    /* value in inl[] */
+#define CACHE_E_INT         0x08    /* value is an int64_t counter */
+#define CACHE_E_TAGGED      0x10    /* in a tag, see cache_tag.c */
+
+/* cache_get() returns, when found */
+#define CACHE_VAL_BYTES     1
+#define CACHE_VAL_INT       2       /* a counter, *val is it's int64_t */
+
+/* a value not inline, refcounted, see cache.c */
+struct cache_val {
+    uint32_t ref;
+    uint32_t size;
+    unsigned char data[];
 };
 
+#define CACHE_VAL(p)    ((struct cache_val*)((unsigned char*)(p) - \
+                                             offsetof(struct cache_val, data)))
+
 struct cache_entry {
     unsigned char *key;
     unsigned char *val;
     size_t ksize;
     size_t vsize;
     time_t expire;
+    uint32_t hv;
+    unsigned char ref;          /* CLOCK reference bit, set on access */
+    unsigned char eflags;
+    uint16_t gen;               /* of the cache, when set */
 
-    struct cache_entry *prev;
+    struct cache_entry *hnext;  /* in the hash chain */
+    struct cache_entry *prev;   /* in the CLOCK ring */
     struct cache_entry *next;
+
+    /* small keys and values, for CACHE_E_SLAB entries only */
+    unsigned char inl[];
 };
 
 
-struct cache *cache_create(size_t numobjs, unsigned int flags);
+/*
+ * numobjs: initial size, and the max number of objects without a budget
+ * maxbytes: memory budget, 0 for none
+ * flags: CACHE_F_*
+ */
+struct cache *cache_create(size_t numobjs, size_t maxbytes, unsigned int flags);
+/*
+ * the cache configured under path, in g_cfg:
+ *   numobjs, cache_bytes, and cache_engine (chain, the default, or open)
+ *   index_prefix: a list of key prefixes cache_del_prefix() can delete
+ *   index_delim: the character ending a group under a prefix, '_' by default
+ *   snapshot: a file to save it to, and reload it from here
+ *   snapshot_interval: seconds between snapshots, 300 by default
+ *   single_flight: a list of key prefixes with single flight misses
+ *   flight_lease: seconds a flight waits for the key, 5 by default
+ */
+struct cache *cache_create_config(const char *path);
+/* the settings cache_create_config() would use */
+void cache_config(const char *path, size_t *numobjs, size_t *maxbytes,
+                  unsigned int *flags);
 int cache_free(struct cache *cd);
+/* O(1), the entries are reclaimed later, see cache.c */
+void cache_empty(struct cache *cd);
 int cache_get(struct cache *cd, const unsigned char *key, size_t ksize,
               unsigned char **val, size_t *vsize);
+/* the value is held till cache_val_put(), to send it with no copy */
+int cache_get_ref(struct cache *cd, const unsigned char *key, size_t ksize,
+                  struct cache_val **ref);
+void cache_val_put(struct cache_val *v);
 int cache_set(struct cache *cd, const unsigned char *k, size_t ksize,
               const unsigned char *v, size_t vsize, int timeout);
 int cache_del(struct cache *cd, const unsigned char *key, size_t ksize);
+/*
+ * delete all entries in tag, or with the indexed prefix, see cache_tag.c.
+ * return the number deleted, del_prefix returns -1 if prefix isn't indexed
+ */
+int cache_tag(struct cache *cd, const unsigned char *key, size_t ksize,
+              const unsigned char *tag, size_t tsize);
+int cache_del_tag(struct cache *cd, const unsigned char *tag, size_t tsize);
+int cache_del_prefix(struct cache *cd, const unsigned char *prefix,
+                     size_t psize);
+/* remove expired entries among the next max of the cache, see cache.c */
+size_t cache_expire(struct cache *cd, size_t max);
 int cache_cas(struct cache *cd, const unsigned char *key, size_t ksize,
               const unsigned char *oldval, size_t ovsize,
               const unsigned char *newval, size_t nvsize);
 int cache_incr(struct cache *cd, const unsigned char *key, size_t ksize,
                int64_t increment, int64_t *newval);
 
+/*
+ * counters, int64_t values updated in place, see cache.c
+ * counter: incr (decr with increment < 0), created with timeout if missing
+ */
+int cache_counter(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t increment, int timeout, int64_t *newval);
+int cache_set_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t num, int timeout);
+int cache_get_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                  int64_t *num);
+int cache_getset_int(struct cache *cd, const unsigned char *key, size_t ksize,
+                     int64_t num, int timeout, int64_t *old);
+
+/* the hash the index uses */
+uint32_t cache_hash(const unsigned char *key, size_t ksize);
+
 int cache_getf(struct cache *cd, unsigned char **val, size_t *vsize,
                const char *keyfmt, ...);
 int cache_setf(struct cache *cd, const unsigned char *v, size_t vsize,
@@ -59,6 +210,10 @@ int cache_setf(struct cache *cd, const unsigned char *v, size_t vsize,
 int cache_delf(struct cache *cd, const char *keyfmt, ...);
 int cache_incrf(struct cache *cd, int64_t increment, int64_t *newval,
                 const char *keyfmt, ...);
+int cache_counterf(struct cache *cd, int64_t increment, int timeout,
+                   int64_t *newval, const char *keyfmt, ...);
+int cache_set_intf(struct cache *cd, int64_t num, int timeout,
+                   const char *keyfmt, ...);
+int cache_get_intf(struct cache *cd, int64_t *num, const char *keyfmt, ...);
 
 #endif
-
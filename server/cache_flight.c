@@ -0,0 +1,184 @@
+/* Single flight for cache misses.
+ * When a popular key expires, all requests for it miss at once, and all of
+ * them go and compute it again. For keys opted in by prefix, the first miss
+ * starts a flight on the key instead, and is told to compute it
+ * (CACHE_FLIGHT_LEAD). Misses while it's in flight are parked on it, and
+ * answered with the value by the cache_set() of the key. A flight that isn't
+ * set in it's lease (the leader gave up, or died) answers it's waiters with
+ * a miss, from the cache_expire() tick.
+ *
+ * Flights are on the cache owner's thread, like the cache itself. They're in
+ * a small hash table, allocated on the first one.
+ */
+#include "mheads.h"
+#include "lheads.h"
+
+int cache_flight_prefix(struct cache *cd, const char *prefix)
+{
+    char **p;
+
+    p = realloc(cd->fprefix, (cd->nfprefix + 1) * sizeof(char*));
+    if (p == NULL)
+        return 0;
+    cd->fprefix = p;
+
+    p[cd->nfprefix] = strdup(prefix);
+    if (p[cd->nfprefix] == NULL)
+        return 0;
+    cd->nfprefix++;
+
+    return 1;
+}
+
+static bool opted_in(struct cache *cd, const unsigned char *key, size_t ksize)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < cd->nfprefix; i++) {
+        len = strlen(cd->fprefix[i]);
+        if (len <= ksize && !memcmp(key, cd->fprefix[i], len))
+            return true;
+    }
+
+    return false;
+}
+
+static struct cache_flight **find_flight(struct cache *cd,
+        const unsigned char *key, size_t ksize, uint32_t hv)
+{
+    struct cache_flight **p;
+
+    p = &cd->flights[hv % CACHE_FLIGHT_LEN];
+    for (; *p != NULL; p = &(*p)->next) {
+        if ((*p)->hv == hv && (*p)->ksize == ksize &&
+            !memcmp((*p)->key, key, ksize))
+            break;
+    }
+
+    return p;
+}
+
+/* Answer all waiters of a detached flight, and free it. */
+static void land(struct cache_flight *f, const unsigned char *val,
+                 size_t vsize)
+{
+    int i;
+
+    for (i = 0; i < f->num; i++)
+        f->land(f->waiters[i], val, vsize);
+
+    free(f->waiters);
+    free(f->key);
+    free(f);
+}
+
+int cache_flight_join(struct cache *cd, const unsigned char *key,
+                      size_t ksize, void *waiter, cache_land_fn landfn)
+{
+    struct cache_flight **p, *f;
+    uint32_t hv;
+    void **w;
+
+    if (cd->nfprefix == 0 || !opted_in(cd, key, ksize))
+        return CACHE_FLIGHT_NONE;
+
+    if (cd->flights == NULL) {
+        cd->flights = calloc(CACHE_FLIGHT_LEN, sizeof(struct cache_flight*));
+        if (cd->flights == NULL)
+            return CACHE_FLIGHT_NONE;
+    }
+
+    hv = cache_hash(key, ksize);
+    p = find_flight(cd, key, ksize, hv);
+    f = *p;
+
+    if (f == NULL) {
+        f = calloc(1, sizeof(struct cache_flight));
+        if (f == NULL)
+            return CACHE_FLIGHT_NONE;
+        f->key = malloc(ksize);
+        if (f->key == NULL) {
+            free(f);
+            return CACHE_FLIGHT_NONE;
+        }
+        memcpy(f->key, key, ksize);
+        f->ksize = ksize;
+        f->hv = hv;
+        f->deadline = g_ctime + cd->flease;
+        f->land = landfn;
+
+        *p = f;
+        cd->nflights++;
+        return CACHE_FLIGHT_LEAD;
+    }
+
+    if (f->num == f->max) {
+        w = realloc(f->waiters, (f->max ? f->max * 2 : 8) * sizeof(void*));
+        if (w == NULL)
+            return CACHE_FLIGHT_NONE;
+        f->waiters = w;
+        f->max = f->max ? f->max * 2 : 8;
+    }
+    f->waiters[f->num++] = waiter;
+    cd->coalesced++;
+
+    return CACHE_FLIGHT_PARKED;
+}
+
+void cache_flight_land(struct cache *cd, const unsigned char *key,
+                       size_t ksize, uint32_t hv,
+                       const unsigned char *val, size_t vsize)
+{
+    struct cache_flight **p, *f;
+
+    if (cd->flights == NULL) return;
+
+    p = find_flight(cd, key, ksize, hv);
+    f = *p;
+    if (f == NULL) return;
+
+    *p = f->next;
+    cd->nflights--;
+
+    land(f, val, vsize);
+}
+
+void cache_flight_expire(struct cache *cd)
+{
+    struct cache_flight **p, *f;
+    size_t i;
+
+    if (cd->nflights == 0) return;
+
+    for (i = 0; i < CACHE_FLIGHT_LEN; i++) {
+        p = &cd->flights[i];
+        while (*p != NULL) {
+            f = *p;
+            if (f->deadline > g_ctime) {
+                p = &f->next;
+                continue;
+            }
+
+            *p = f->next;
+            cd->nflights--;
+            land(f, NULL, 0);
+        }
+    }
+}
+
+void cache_flight_free(struct cache *cd)
+{
+    struct cache_flight *f;
+    size_t i;
+
+    if (cd->flights == NULL) return;
+
+    for (i = 0; i < CACHE_FLIGHT_LEN; i++) {
+        while ((f = cd->flights[i]) != NULL) {
+            cd->flights[i] = f->next;
+            land(f, NULL, 0);
+        }
+    }
+    cd->nflights = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Single flight for cache misses. See cache_flight.c for more information.
+ */
+#ifndef _CACHE_FLIGHT_H
+#define _CACHE_FLIGHT_H
+
+#define CACHE_FLIGHT_LEN    256     /* buckets of the flight table */
+
+/* cache_flight_join() returns */
+#define CACHE_FLIGHT_NONE   0       /* not opted in, a plain miss */
+#define CACHE_FLIGHT_LEAD   1       /* the first miss, go and set the key */
+#define CACHE_FLIGHT_PARKED 2       /* waiter parked till the key is set */
+
+/* answer a parked waiter, val is NULL if the flight timed out */
+typedef void (*cache_land_fn)(void *waiter, const unsigned char *val,
+                              size_t vsize);
+
+struct cache_flight {
+    uint32_t hv;
+    unsigned char *key;
+    size_t ksize;
+    time_t deadline;
+
+    cache_land_fn land;
+    void **waiters;
+    int num;
+    int max;
+
+    struct cache_flight *next;
+};
+
+/* keys starting with prefix have single flight misses, return 0 on failure */
+int  cache_flight_prefix(struct cache *cd, const char *prefix);
+/*
+ * on a miss of key, start a flight, or park waiter on the one in progress.
+ * land answers it later, on the op thread setting the key.
+ */
+int  cache_flight_join(struct cache *cd, const unsigned char *key,
+                       size_t ksize, void *waiter, cache_land_fn land);
+/* called by cache_set(), answers the waiters of key's flight with val */
+void cache_flight_land(struct cache *cd, const unsigned char *key,
+                       size_t ksize, uint32_t hv,
+                       const unsigned char *val, size_t vsize);
+/* answers the waiters of flights past their lease with a miss */
+void cache_flight_expire(struct cache *cd);
+/* all flights, on cache_free() and cache_empty() */
+void cache_flight_free(struct cache *cd);
+
+#endif
@@ -0,0 +1,269 @@
+/* Open addressing index of the cache, for CACHE_F_OPEN caches.
+ *
+ * The chained index costs a dereference and a key compare, in another heap
+ * block, per candidate. Here slots are in groups of CACHE_GROUP, with a one
+ * byte tag per slot: 7 bits of the hash for used slots, TAG_EMPTY or
+ * TAG_DELETED for others. A group's tags are compared at once (with SSE2
+ * where we have it), and only the entries whose tag matches are looked at,
+ * so a lookup mostly touches one tag group and one entry.
+ *
+ * Groups are probed triangularly from the hash's home group, a probe stops at
+ * the first group with an empty slot. Removed slots become TAG_DELETED, unless
+ * their group has an empty slot, which no probe goes past.
+ *
+ * Entries of such caches are blocks of a slab, with small keys and values
+ * inline, see cache.c.
+ */
+#include "mheads.h"
+#include "lheads.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define TAG_EMPTY       0x00
+#define TAG_DELETED     0x01
+#define TAG(hv)         (0x80 | ((hv) >> 25))
+#define SLAB_CHUNK      512     /* blocks per chunk */
+
+/* bits of the slots of group g tagged tag, and of the free (not used) ones */
+static inline unsigned int group_match(const unsigned char *tags,
+                                       unsigned char tag,
+                                       unsigned int *freeslots)
+{
+#ifdef __SSE2__
+    __m128i grp = _mm_loadu_si128((const __m128i*)tags);
+
+    /* used tags have the high bit set */
+    *freeslots = ~_mm_movemask_epi8(grp) & 0xFFFF;
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_set1_epi8(tag)));
+#else
+    unsigned int match = 0, fs = 0;
+    int i;
+
+    for (i = 0; i < CACHE_GROUP; i++) {
+        if (tags[i] == tag) match |= 1 << i;
+        if (!(tags[i] & 0x80)) fs |= 1 << i;
+    }
+    *freeslots = fs;
+    return match;
+#endif
+}
+
+static inline unsigned int group_empty(const unsigned char *tags)
+{
+#ifdef __SSE2__
+    __m128i grp = _mm_loadu_si128((const __m128i*)tags);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(grp, _mm_setzero_si128()));
+#else
+    unsigned int empty = 0;
+    int i;
+
+    for (i = 0; i < CACHE_GROUP; i++)
+        if (tags[i] == TAG_EMPTY) empty |= 1 << i;
+    return empty;
+#endif
+}
+
+int copen_alloc(struct cache_table *t, size_t len)
+{
+    t->tag = calloc(len, 1);
+    t->slot = malloc(len * sizeof(struct cache_entry *));
+    if (t->tag == NULL || t->slot == NULL) {
+        free(t->tag);
+        free(t->slot);
+        t->tag = NULL;
+        t->slot = NULL;
+        return 0;
+    }
+
+    t->len = len;
+    t->used = 0;
+    t->chain = NULL;
+    return 1;
+}
+
+void copen_free(struct cache_table *t)
+{
+    free(t->tag);
+    free(t->slot);
+    t->tag = NULL;
+    t->slot = NULL;
+    t->len = 0;
+    t->used = 0;
+}
+
+void copen_clear(struct cache_table *t)
+{
+    memset(t->tag, TAG_EMPTY, t->len);
+    t->used = 0;
+}
+
+struct cache_entry* copen_find(struct cache_table *t, const unsigned char *key,
+                               size_t ksize, uint32_t hv)
+{
+    size_t ngroups = t->len / CACHE_GROUP;
+    size_t g = hv & (ngroups - 1), i;
+    unsigned int match, freeslots;
+    unsigned char tag = TAG(hv);
+    struct cache_entry *e;
+    int bit;
+
+    for (i = 1; i <= ngroups; i++) {
+        match = group_match(t->tag + g * CACHE_GROUP, tag, &freeslots);
+        while (match) {
+            bit = __builtin_ctz(match);
+            match &= match - 1;
+
+            e = t->slot[g * CACHE_GROUP + bit];
+            if (e->hv == hv && e->ksize == ksize &&
+                memcmp(key, e->key, ksize) == 0)
+                return e;
+        }
+
+        if (group_empty(t->tag + g * CACHE_GROUP))
+            return NULL;
+
+        g = (g + i) & (ngroups - 1);
+    }
+
+    return NULL;
+}
+
+int copen_insert(struct cache_table *t, struct cache_entry *e)
+{
+    size_t ngroups = t->len / CACHE_GROUP;
+    size_t g = e->hv & (ngroups - 1), i, s;
+    unsigned int freeslots;
+
+    for (i = 1; i <= ngroups; i++) {
+        group_match(t->tag + g * CACHE_GROUP, TAG_EMPTY, &freeslots);
+        if (freeslots) {
+            s = g * CACHE_GROUP + __builtin_ctz(freeslots);
+            if (t->tag[s] == TAG_EMPTY) t->used++;
+            t->tag[s] = TAG(e->hv);
+            t->slot[s] = e;
+            return 1;
+        }
+
+        g = (g + i) & (ngroups - 1);
+    }
+
+    return 0;
+}
+
+int copen_remove(struct cache_table *t, struct cache_entry *e)
+{
+    size_t ngroups = t->len / CACHE_GROUP;
+    size_t g = e->hv & (ngroups - 1), i, s;
+    unsigned int match, freeslots;
+    unsigned char *tags;
+    int bit;
+
+    for (i = 1; i <= ngroups; i++) {
+        tags = t->tag + g * CACHE_GROUP;
+        match = group_match(tags, TAG(e->hv), &freeslots);
+        while (match) {
+            bit = __builtin_ctz(match);
+            match &= match - 1;
+
+            s = g * CACHE_GROUP + bit;
+            if (t->slot[s] != e)
+                continue;
+
+            /* no probe goes past a group with an empty slot */
+            if (group_empty(tags)) {
+                t->tag[s] = TAG_EMPTY;
+                t->used--;
+            } else {
+                t->tag[s] = TAG_DELETED;
+            }
+            return 1;
+        }
+
+        if (group_empty(tags))
+            return 0;
+
+        g = (g + i) & (ngroups - 1);
+    }
+
+    return 0;
+}
+
+int copen_move_group(struct cache_table *from, size_t g,
+                     struct cache_table *to)
+{
+    unsigned int match, freeslots;
+    size_t s;
+    int bit;
+
+    /* every used slot */
+    group_match(from->tag + g * CACHE_GROUP, TAG_EMPTY, &freeslots);
+    match = ~freeslots & 0xFFFF;
+
+    while (match) {
+        bit = __builtin_ctz(match);
+        match &= match - 1;
+
+        s = g * CACHE_GROUP + bit;
+        if (!copen_insert(to, from->slot[s]))
+            return 0;
+
+        /* still a probe may go through it, for the ones not moved yet */
+        from->tag[s] = TAG_DELETED;
+    }
+
+    return 1;
+}
+
+
+/*
+ * slab of CACHE_SLAB_BLOCK entries, never given back to the system but by
+ * cslab_free()
+ */
+
+struct cache_entry* cslab_get(struct cache_slab *s)
+{
+    struct cache_entry *e;
+    unsigned char *chunk;
+    int i;
+
+    if (s->free == NULL) {
+        /* the first block links the chunks */
+        chunk = malloc(SLAB_CHUNK * CACHE_SLAB_BLOCK);
+        if (chunk == NULL)
+            return NULL;
+        *(void**)chunk = s->chunks;
+        s->chunks = chunk;
+
+        for (i = SLAB_CHUNK - 1; i > 0; i--) {
+            e = (struct cache_entry*)(chunk + i * CACHE_SLAB_BLOCK);
+            e->next = s->free;
+            s->free = e;
+        }
+    }
+
+    e = s->free;
+    s->free = e->next;
+
+    return e;
+}
+
+void cslab_put(struct cache_slab *s, struct cache_entry *e)
+{
+    e->next = s->free;
+    s->free = e;
+}
+
+void cslab_free(struct cache_slab *s)
+{
+    void *c, *n;
+
+    for (c = s->chunks; c != NULL; c = n) {
+        n = *(void**)c;
+        free(c);
+    }
+    s->chunks = NULL;
+    s->free = NULL;
+}
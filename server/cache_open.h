@@ -0,0 +1,29 @@
+/*
+ * Open addressing index of the cache. See cache_open.c for more information.
+ */
+#ifndef _CACHE_OPEN_H
+#define _CACHE_OPEN_H
+
+#define CACHE_GROUP         16
+#define CACHE_SLAB_BLOCK    128     /* entry and it's inline key/value */
+#define CACHE_INLINE_LEN    (CACHE_SLAB_BLOCK - sizeof(struct cache_entry))
+
+int  copen_alloc(struct cache_table *t, size_t len);
+void copen_free(struct cache_table *t);
+void copen_clear(struct cache_table *t);
+
+struct cache_entry* copen_find(struct cache_table *t, const unsigned char *key,
+                               size_t ksize, uint32_t hv);
+/* e must not be in t, return 0 if t is full */
+int  copen_insert(struct cache_table *t, struct cache_entry *e);
+/* return 0 if e is not in t */
+int  copen_remove(struct cache_table *t, struct cache_entry *e);
+/* move the entries of group g of from into to, return 0 if to is full */
+int  copen_move_group(struct cache_table *from, size_t g,
+                      struct cache_table *to);
+
+struct cache_entry* cslab_get(struct cache_slab *s);
+void cslab_put(struct cache_slab *s, struct cache_entry *e);
+void cslab_free(struct cache_slab *s);
+
+#endif
@@ -0,0 +1,395 @@
+/* Cache snapshot to disk, and reload.
+ * So a restarted server doesn't start with all caches cold. A snapshot is
+ * written to <path>.tmp a few thousand entries per tick of the cache owner,
+ * by walking the CLOCK ring, and renamed to path once complete, so path is
+ * always a whole one. Entries changed while it's written may or may not be
+ * in it, it's a warm start, not a backup.
+ *
+ * The entries of a tick are copied in memory first, then written, so a
+ * shared cache is only locked for the copy, see cache_snap_fill().
+ *
+ * The file is the header, magic and creation time, then a record per entry:
+ * ksize, vsize (uint32_t), expire (int64_t, 0 for none), the key, the value,
+ * padded to 8 bytes, till a record with ksize 0xFFFFFFFF. vsize has
+ * SNAP_INT set for a counter. It's in host byte order, and read back with
+ * mmap().
+ */
+#include "mheads.h"
+#include "lheads.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAP_ALIGN(n)   (((n) + 7) & ~(size_t)7)
+#define SNAP_END        0xFFFFFFFF
+#define SNAP_INT        0x80000000
+
+struct snap_head {
+    char magic[8];
+    int64_t created;
+};
+
+struct snap_rec {
+    uint32_t ksize;
+    uint32_t vsize;
+    int64_t expire;
+};
+
+int cache_snap_init(struct cache *cd, const char *path, int interval)
+{
+    struct cache_snap *s;
+
+    if (cd->snap != NULL)
+        cache_snap_free(cd);
+
+    s = calloc(1, sizeof(struct cache_snap));
+    if (s == NULL)
+        return 0;
+
+    s->path = strdup(path);
+    if (s->path == NULL) {
+        free(s);
+        return 0;
+    }
+    s->interval = interval;
+    s->last = g_ctime;
+
+    cd->snap = s;
+    return 1;
+}
+
+/* Give the one in progress up, the partial file goes. Out of the owner's
+ * lock, cur is left to the next cache_snap_fill(). */
+static void snap_abort(struct cache_snap *s)
+{
+    char tmp[PATH_MAX];
+
+    fclose(s->fp);
+    s->fp = NULL;
+    s->blen = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->path);
+    unlink(tmp);
+}
+
+void cache_snap_free(struct cache *cd)
+{
+    struct cache_snap *s = cd->snap;
+
+    if (s == NULL) return;
+
+    if (s->fp != NULL) snap_abort(s);
+    free(s->buf);
+    free(s->path);
+    free(s);
+    cd->snap = NULL;
+}
+
+static int snap_open(struct cache_snap *s)
+{
+    struct snap_head head;
+    char tmp[PATH_MAX];
+
+    /* a failure waits for the next interval too */
+    s->last = g_ctime;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->path);
+    s->fp = fopen(tmp, "w");
+    if (s->fp == NULL) {
+        mtc_err("open snapshot %s failure %s", tmp, strerror(errno));
+        return 0;
+    }
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, CACHE_SNAP_MAGIC, sizeof(head.magic));
+    head.created = g_ctime;
+    if (fwrite(&head, sizeof(head), 1, s->fp) != 1) {
+        mtc_err("write snapshot %s failure %s", tmp, strerror(errno));
+        snap_abort(s);
+        return 0;
+    }
+
+    s->walking = false;
+    s->filled = false;
+    s->blen = 0;
+    s->written = 0;
+    s->started = ne_timef();
+
+    return 1;
+}
+
+/* Append len bytes of p to the records not written yet. */
+static int snap_append(struct cache_snap *s, const void *p, size_t len)
+{
+    unsigned char *b;
+    size_t cap;
+
+    if (s->blen + len > s->bcap) {
+        cap = s->bcap ? s->bcap : 4096;
+        while (cap < s->blen + len) cap *= 2;
+        b = realloc(s->buf, cap);
+        if (b == NULL)
+            return 0;
+        s->buf = b;
+        s->bcap = cap;
+    }
+
+    memcpy(s->buf + s->blen, p, len);
+    s->blen += len;
+
+    return 1;
+}
+
+int cache_snap_begin(struct cache *cd)
+{
+    struct cache_snap *s = cd->snap;
+
+    if (s == NULL) return 0;
+    if (s->fp != NULL) return 1;
+
+    if (s->interval <= 0 || g_ctime - s->last < s->interval)
+        return 0;
+
+    return snap_open(s);
+}
+
+void cache_snap_fill(struct cache *cd, size_t work)
+{
+    static const unsigned char pad[8] = {0};
+    struct cache_snap *s = cd->snap;
+    struct cache_entry *e;
+    struct snap_rec rec;
+    size_t len;
+
+    if (s == NULL || s->fp == NULL || s->filled) return;
+
+    if (!s->walking) {
+        s->cur = cd->hand;
+        s->left = cd->count;
+        s->walking = true;
+    }
+
+    while (work > 0 && s->left > 0 && s->cur != NULL) {
+        e = s->cur;
+
+        if ((e->expire > 0 && e->expire < g_ctime) || CACHE_STALE(cd, e)) {
+            s->cur = e->next;
+            s->left--;
+            work--;
+            continue;
+        }
+
+        rec.ksize = e->ksize;
+        rec.vsize = e->vsize;
+        if (e->eflags & CACHE_E_INT) rec.vsize |= SNAP_INT;
+        rec.expire = e->expire;
+        len = e->ksize + e->vsize;
+
+        /* out of memory, the rest on the next tick */
+        if (!snap_append(s, &rec, sizeof(rec)))
+            return;
+        if (!snap_append(s, e->key, e->ksize) ||
+            !snap_append(s, e->val, e->vsize) ||
+            !snap_append(s, pad, SNAP_ALIGN(len) - len)) {
+            s->blen -= sizeof(rec);
+            return;
+        }
+
+        s->cur = e->next;
+        s->left--;
+        work--;
+        s->written++;
+    }
+
+    if (s->left > 0 && s->cur != NULL)
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ksize = SNAP_END;
+    if (!snap_append(s, &rec, sizeof(rec)))
+        return;
+    s->cur = NULL;
+    s->filled = true;
+}
+
+int cache_snap_flush(struct cache *cd)
+{
+    struct cache_snap *s = cd->snap;
+    char tmp[PATH_MAX];
+
+    if (s == NULL || s->fp == NULL) return -1;
+
+    if (s->blen > 0 && fwrite(s->buf, 1, s->blen, s->fp) != s->blen) {
+        mtc_err("write snapshot %s failure %s", s->path, strerror(errno));
+        snap_abort(s);
+        return -1;
+    }
+    s->blen = 0;
+
+    if (!s->filled)
+        return 0;
+
+    if (fclose(s->fp) != 0) {
+        s->fp = NULL;
+        mtc_err("close snapshot %s failure %s", s->path, strerror(errno));
+        snprintf(tmp, sizeof(tmp), "%s.tmp", s->path);
+        unlink(tmp);
+        return -1;
+    }
+    s->fp = NULL;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", s->path);
+    if (rename(tmp, s->path) != 0) {
+        mtc_err("rename snapshot %s failure %s", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    s->write_ms = (ne_timef() - s->started) * 1000;
+    mtc_dbg("snapshot %s %zu entries in %.1fms",
+            s->path, s->written, s->write_ms);
+
+    return 1;
+}
+
+void cache_snap_tick(struct cache *cd, size_t work)
+{
+    if (!cache_snap_begin(cd))
+        return;
+
+    cache_snap_fill(cd, work);
+    cache_snap_flush(cd);
+}
+
+int cache_snap_write(struct cache *cd)
+{
+    struct cache_snap *s = cd->snap;
+    size_t left;
+    int rv;
+
+    if (s == NULL) return 0;
+
+    if (s->fp == NULL && !snap_open(s))
+        return 0;
+
+    /* a bit at a time, the records aren't all in memory at once */
+    do {
+        left = s->walking ? s->left : (size_t)-1;
+        cache_snap_fill(cd, CACHE_SNAP_WORK);
+        if (!s->filled && s->left == left) {
+            mtc_err("snapshot %s out of memory", s->path);
+            snap_abort(s);
+            return 0;
+        }
+        rv = cache_snap_flush(cd);
+    } while (rv == 0);
+
+    return rv == 1;
+}
+
+
+long cache_snap_read(const char *path, cache_snap_fn fn, void *arg)
+{
+    struct snap_head head;
+    struct snap_rec rec;
+    struct stat st;
+    unsigned char *p;
+    size_t off, len, vsize;
+    int kind;
+    bool end = false;
+    long n = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(head)) {
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        mtc_err("mmap snapshot %s failure %s", path, strerror(errno));
+        return -1;
+    }
+
+    memcpy(&head, p, sizeof(head));
+    if (memcmp(head.magic, CACHE_SNAP_MAGIC, sizeof(head.magic))) {
+        mtc_warn("%s isn't a cache snapshot", path);
+        munmap(p, st.st_size);
+        return -1;
+    }
+
+    off = sizeof(head);
+    while (off + sizeof(rec) <= (size_t)st.st_size) {
+        memcpy(&rec, p + off, sizeof(rec));
+        off += sizeof(rec);
+
+        if (rec.ksize == SNAP_END) {
+            end = true;
+            break;
+        }
+
+        vsize = rec.vsize & ~SNAP_INT;
+        kind = (rec.vsize & SNAP_INT) ? CACHE_VAL_INT : CACHE_VAL_BYTES;
+        if (kind == CACHE_VAL_INT && vsize != sizeof(int64_t))
+            break;
+
+        len = SNAP_ALIGN((size_t)rec.ksize + vsize);
+        if (len > (size_t)st.st_size - off)
+            break;
+
+        /* what's left of the ttl, from now */
+        if (rec.expire > 0 && rec.expire <= g_ctime) {
+            off += len;
+            continue;
+        }
+
+        if (fn(arg, p + off, rec.ksize, p + off + rec.ksize, vsize, kind,
+               rec.expire > 0 ? (int)(rec.expire - g_ctime) : 0))
+            n++;
+        off += len;
+    }
+
+    munmap(p, st.st_size);
+
+    if (!end)
+        mtc_warn("snapshot %s truncated, %ld entries read", path, n);
+
+    return n;
+}
+
+static int snap_set(void *arg, const unsigned char *key, size_t ksize,
+                    const unsigned char *val, size_t vsize, int kind,
+                    int timeout)
+{
+    int64_t n;
+
+    if (kind == CACHE_VAL_INT) {
+        memcpy(&n, val, sizeof(n));
+        return cache_set_int((struct cache*)arg, key, ksize, n, timeout);
+    }
+
+    return cache_set((struct cache*)arg, key, ksize, val, vsize, timeout);
+}
+
+long cache_snap_load(struct cache *cd, const char *path)
+{
+    double start = ne_timef();
+    long n;
+
+    n = cache_snap_read(path, snap_set, cd);
+
+    if (cd->snap != NULL) {
+        cd->snap->loaded = n > 0 ? n : 0;
+        cd->snap->load_ms = (ne_timef() - start) * 1000;
+    }
+    if (n >= 0)
+        mtc_foo("cache %s reloaded, %ld entries in %.1fms", path, n,
+                (ne_timef() - start) * 1000);
+
+    return n;
+}
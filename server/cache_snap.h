@@ -0,0 +1,66 @@
+/*
+ * Cache snapshot to disk, and reload. See cache_snap.c for more information.
+ */
+#ifndef _CACHE_SNAP_H
+#define _CACHE_SNAP_H
+
+#define CACHE_SNAP_MAGIC    "MOCCACH1"
+#define CACHE_SNAP_WORK     4096    /* entries written per cache_snap_tick() */
+
+struct cache_snap {
+    char *path;
+    int interval;               /* seconds between snapshots, 0 on stop only */
+    time_t last;                /* when the last one started */
+
+    /* the one in progress, fp is NULL if none */
+    FILE *fp;
+    bool walking;               /* cur and left are set for it */
+    bool filled;                /* the end record is in buf */
+    struct cache_entry *cur;    /* next entry to write */
+    size_t left;                /* entries still to look at */
+    size_t written;
+    double started;
+    /* records copied by cache_snap_fill(), for cache_snap_flush() */
+    unsigned char *buf;
+    size_t blen;
+    size_t bcap;
+
+    /* stats */
+    size_t loaded;              /* entries reloaded on start */
+    double load_ms;
+    double write_ms;            /* the last snapshot, start to finish */
+};
+
+/* snapshot the cache to path every interval seconds, doesn't load it */
+int  cache_snap_init(struct cache *cd, const char *path, int interval);
+/* called on the owner's tick, writes at most work entries */
+void cache_snap_tick(struct cache *cd, size_t work);
+/*
+ * cache_snap_tick() in three steps, for a cache behind a lock, so no file
+ * I/O is done under it:
+ * cache_snap_begin(), out of the lock, starts one if it's time, and returns
+ * 1 if one is in progress. cache_snap_fill(), under the lock, copies at most
+ * work entries in memory. cache_snap_flush(), out of the lock, writes them,
+ * returns 1 when the snapshot is done, 0 if there's more, -1 on failure.
+ * only one thread at a time snapshots a cache.
+ */
+int  cache_snap_begin(struct cache *cd);
+void cache_snap_fill(struct cache *cd, size_t work);
+int  cache_snap_flush(struct cache *cd);
+/* write a whole snapshot now, e.g. on stop. return 0 on failure */
+int  cache_snap_write(struct cache *cd);
+void cache_snap_free(struct cache *cd);
+
+/*
+ * read the snapshot at path, calling fn for every entry not expired yet, with
+ * it's kind (CACHE_VAL_*) and remaining timeout (0 for none).
+ * return the number of entries read, -1 if there is no usable file
+ */
+typedef int (*cache_snap_fn)(void *arg, const unsigned char *key, size_t ksize,
+                             const unsigned char *val, size_t vsize, int kind,
+                             int timeout);
+long cache_snap_read(const char *path, cache_snap_fn fn, void *arg);
+/* cache_snap_read() into cd, timed into cd's snapshot stats */
+long cache_snap_load(struct cache *cd, const char *path);
+
+#endif
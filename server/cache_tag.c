@@ -0,0 +1,301 @@
+/* Prefix and tag index of the cache.
+ * Plugins key related data alike, "user_%s_profile", "user_%s_friends"...,
+ * and when the user changes all of them must go. Deleting them one by one
+ * needs every key known, a scan of the table is too long on the op thread.
+ *
+ * So entries may be in tags, and cache_del_tag() or cache_del_prefix()
+ * delete all members of one, without looking at anything else. A tag is
+ * either named by the plugin, cache_tag(), or a key prefix: keys starting
+ * with a configured index_prefix, "user_", are in it's group, and in the
+ * group of the prefix up to the next index_delim, "user_42_".
+ *
+ * An entry's tags are found by the entry, in a table of links, so untagged
+ * entries cost nothing, and a tagged one going unlinks itself. A tag goes
+ * with it's last member.
+ */
+#include "mheads.h"
+#include "lheads.h"
+
+static inline uint32_t entry_hash(struct cache_entry *e)
+{
+    return (uint32_t)(((uintptr_t)e >> 4) * 2654435761u);
+}
+
+int cache_tag_prefix(struct cache *cd, const char *prefix)
+{
+    char **p;
+
+    if (*prefix == '\0')
+        return 0;
+
+    p = realloc(cd->tprefix, (cd->ntprefix + 1) * sizeof(char*));
+    if (p == NULL)
+        return 0;
+    cd->tprefix = p;
+
+    p[cd->ntprefix] = strdup(prefix);
+    if (p[cd->ntprefix] == NULL)
+        return 0;
+    cd->ntprefix++;
+
+    return 1;
+}
+
+/* The group of key under prefix p, it's length, 0 if there is none. */
+static size_t group_len(struct cache *cd, const unsigned char *key,
+                        size_t ksize, size_t plen)
+{
+    const unsigned char *d;
+
+    if (plen >= ksize)
+        return 0;
+
+    d = memchr(key + plen, cd->tdelim, ksize - plen);
+    if (d == NULL || d == key + plen)
+        return 0;
+
+    return d - key + 1;
+}
+
+bool cache_tag_indexed(struct cache *cd, const unsigned char *prefix,
+                       size_t psize)
+{
+    size_t len;
+    int i;
+
+    for (i = 0; i < cd->ntprefix; i++) {
+        len = strlen(cd->tprefix[i]);
+        if (len > psize || memcmp(prefix, cd->tprefix[i], len))
+            continue;
+        if (len == psize || group_len(cd, prefix, psize, len) == psize)
+            return true;
+    }
+
+    return false;
+}
+
+static struct cache_tag **find_tag(struct cache *cd, int kind,
+        const unsigned char *name, size_t nsize, uint32_t hv)
+{
+    struct cache_tag **p;
+
+    p = &cd->tags[hv & (cd->tagslen - 1)];
+    for (; *p != NULL; p = &(*p)->next) {
+        if ((*p)->hv == hv && (*p)->kind == kind && (*p)->nsize == nsize &&
+            !memcmp((*p)->name, name, nsize))
+            break;
+    }
+
+    return p;
+}
+
+struct cache_tag *cache_tag_find(struct cache *cd, int kind,
+                                 const unsigned char *name, size_t nsize)
+{
+    if (cd->tags == NULL) return NULL;
+
+    return *find_tag(cd, kind, name, nsize, cache_hash(name, nsize));
+}
+
+/* Double the tag table, when there are as many tags as it's buckets, an
+ * index_prefix makes one per group. */
+static void tags_grow(struct cache *cd)
+{
+    struct cache_tag **tags, *t, *n;
+    size_t len, i;
+
+    len = cd->tagslen ? cd->tagslen * 2 : CACHE_TAG_MINLEN;
+    tags = calloc(len, sizeof(struct cache_tag*));
+    if (tags == NULL)
+        return;
+
+    for (i = 0; i < cd->tagslen; i++) {
+        for (t = cd->tags[i]; t != NULL; t = n) {
+            n = t->next;
+            t->next = tags[t->hv & (len - 1)];
+            tags[t->hv & (len - 1)] = t;
+        }
+    }
+
+    free(cd->tags);
+    cd->tags = tags;
+    cd->tagslen = len;
+}
+
+/* Double the link table, when it's as full as the entries are, linked. */
+static void links_grow(struct cache *cd)
+{
+    struct cache_link **links, *l, *n;
+    size_t len, i;
+
+    len = cd->linkslen ? cd->linkslen * 2 : CACHE_LINK_MINLEN;
+    links = calloc(len, sizeof(struct cache_link*));
+    if (links == NULL)
+        return;
+
+    for (i = 0; i < cd->linkslen; i++) {
+        for (l = cd->links[i]; l != NULL; l = n) {
+            n = l->hnext;
+            l->hnext = links[entry_hash(l->e) & (len - 1)];
+            links[entry_hash(l->e) & (len - 1)] = l;
+        }
+    }
+
+    free(cd->links);
+    cd->links = links;
+    cd->linkslen = len;
+}
+
+static void tag_free(struct cache *cd, struct cache_tag *t)
+{
+    struct cache_tag **p;
+
+    p = find_tag(cd, t->kind, t->name, t->nsize, t->hv);
+    *p = t->next;
+    cd->ntags--;
+
+    free(t->name);
+    free(t);
+}
+
+int cache_tag_link(struct cache *cd, struct cache_entry *e, int kind,
+                   const unsigned char *name, size_t nsize)
+{
+    struct cache_tag **p, *t;
+    struct cache_link *l;
+    uint32_t hv;
+    size_t b;
+
+    if (cd->ntags >= cd->tagslen)
+        tags_grow(cd);
+    if (cd->tags == NULL)
+        return 0;
+    if (cd->nlinks >= cd->linkslen)
+        links_grow(cd);
+    if (cd->links == NULL)
+        return 0;
+
+    hv = cache_hash(name, nsize);
+    p = find_tag(cd, kind, name, nsize, hv);
+    t = *p;
+
+    if (t == NULL) {
+        t = calloc(1, sizeof(struct cache_tag));
+        if (t == NULL)
+            return 0;
+        t->name = malloc(nsize ? nsize : 1);
+        if (t->name == NULL) {
+            free(t);
+            return 0;
+        }
+        memcpy(t->name, name, nsize);
+        t->nsize = nsize;
+        t->hv = hv;
+        t->kind = kind;
+        *p = t;
+        cd->ntags++;
+    } else if (e->eflags & CACHE_E_TAGGED) {
+        /* in it already? */
+        b = entry_hash(e) & (cd->linkslen - 1);
+        for (l = cd->links[b]; l != NULL; l = l->hnext) {
+            if (l->e == e && l->tag == t)
+                return 1;
+        }
+    }
+
+    l = malloc(sizeof(struct cache_link));
+    if (l == NULL) {
+        if (t->num == 0) tag_free(cd, t);
+        return 0;
+    }
+    l->e = e;
+    l->tag = t;
+    l->prev = NULL;
+    l->next = t->members;
+    if (t->members) t->members->prev = l;
+    t->members = l;
+    t->num++;
+
+    b = entry_hash(e) & (cd->linkslen - 1);
+    l->hnext = cd->links[b];
+    cd->links[b] = l;
+    cd->nlinks++;
+
+    e->eflags |= CACHE_E_TAGGED;
+
+    return 1;
+}
+
+void cache_tag_index(struct cache *cd, struct cache_entry *e)
+{
+    size_t len, glen;
+    int i;
+
+    for (i = 0; i < cd->ntprefix; i++) {
+        len = strlen(cd->tprefix[i]);
+        if (len > e->ksize || memcmp(e->key, cd->tprefix[i], len))
+            continue;
+
+        if (!cache_tag_link(cd, e, CACHE_TAG_PREFIX, e->key, len))
+            mtc_err("index %s failure", cd->tprefix[i]);
+
+        glen = group_len(cd, e->key, e->ksize, len);
+        if (glen > 0 &&
+            !cache_tag_link(cd, e, CACHE_TAG_PREFIX, e->key, glen))
+            mtc_err("index %s group failure", cd->tprefix[i]);
+    }
+}
+
+void cache_tag_unlink(struct cache *cd, struct cache_entry *e)
+{
+    struct cache_link **p, *l;
+    struct cache_tag *t;
+
+    p = &cd->links[entry_hash(e) & (cd->linkslen - 1)];
+    while (*p != NULL) {
+        l = *p;
+        if (l->e != e) {
+            p = &l->hnext;
+            continue;
+        }
+        *p = l->hnext;
+        cd->nlinks--;
+
+        t = l->tag;
+        if (l->prev) l->prev->next = l->next;
+        else t->members = l->next;
+        if (l->next) l->next->prev = l->prev;
+        if (--t->num == 0)
+            tag_free(cd, t);
+
+        free(l);
+    }
+
+    e->eflags &= ~CACHE_E_TAGGED;
+}
+
+void cache_tag_free(struct cache *cd)
+{
+    struct cache_link *l;
+    struct cache_tag *t;
+    size_t i;
+
+    for (i = 0; i < cd->linkslen; i++) {
+        while ((l = cd->links[i]) != NULL) {
+            cd->links[i] = l->hnext;
+            free(l);
+        }
+    }
+    cd->nlinks = 0;
+
+    if (cd->tags == NULL) return;
+
+    for (i = 0; i < cd->tagslen; i++) {
+        while ((t = cd->tags[i]) != NULL) {
+            cd->tags[i] = t->next;
+            free(t->name);
+            free(t);
+        }
+    }
+    cd->ntags = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Prefix and tag index of the cache. See cache_tag.c for more information.
+ */
+#ifndef _CACHE_TAG_H
+#define _CACHE_TAG_H
+
+#define CACHE_TAG_MINLEN    256     /* buckets of the tag table, at least */
+#define CACHE_LINK_MINLEN   256     /* buckets of the link table, at least */
+
+/* struct cache_tag kinds */
+#define CACHE_TAG_NAME      0       /* given by cache_tag() */
+#define CACHE_TAG_PREFIX    1       /* an index_prefix, or a group under one */
+
+/* an entry in a tag */
+struct cache_link {
+    struct cache_entry *e;
+    struct cache_tag *tag;
+    struct cache_link *prev;    /* members of tag */
+    struct cache_link *next;
+    struct cache_link *hnext;   /* in the link table, by entry */
+};
+
+struct cache_tag {
+    unsigned char *name;
+    size_t nsize;
+    uint32_t hv;
+    int kind;
+
+    struct cache_link *members;
+    size_t num;
+
+    struct cache_tag *next;
+};
+
+/* keys starting with prefix are indexed, return 0 on failure */
+int  cache_tag_prefix(struct cache *cd, const char *prefix);
+/* is prefix one cache_del_prefix() can find, a configured one or a group */
+bool cache_tag_indexed(struct cache *cd, const unsigned char *prefix,
+                       size_t psize);
+/* put a new entry in the prefix groups of it's key */
+void cache_tag_index(struct cache *cd, struct cache_entry *e);
+/* put e in the tag, return 0 on memory error */
+int  cache_tag_link(struct cache *cd, struct cache_entry *e, int kind,
+                    const unsigned char *name, size_t nsize);
+/* take e, a CACHE_E_TAGGED entry about to go, out of all it's tags */
+void cache_tag_unlink(struct cache *cd, struct cache_entry *e);
+/* the tag, NULL if it has no member */
+struct cache_tag *cache_tag_find(struct cache *cd, int kind,
+                                 const unsigned char *name, size_t nsize);
+/* all tags and links, the entries are going too */
+void cache_tag_free(struct cache *cd);
+
+#endif
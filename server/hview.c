@@ -0,0 +1,343 @@
+/*
+ * Read only hdf view.
+ *
+ * Plugins mostly read a handful of params of the request. Instead of
+ * building a HDF, with a malloc() for every node, name and value, the
+ * received buffer is indexed in place: names and values are '\0' terminated
+ * inside it, and nodes live in one array, inline in the view for small
+ * requests.
+ *
+ * Only the hdf written by hdf_write_string() and pack_hdf_bin() (name = value
+ * and name { } blocks) is known; anything else is left to hdf_read_string().
+ * hview_to_hdf() makes a real HDF when one wants to change it.
+ */
+
+#include <ctype.h>
+
+#include "mheads.h"
+#include "lheads.h"
+
+#define HVIEW_MAX_DEPTH     PACK_MAX_DEPTH
+
+void hview_init(struct hview *v)
+{
+    v->nodes = v->inl;
+    v->maxnodes = HVIEW_INLINE_NODES;
+    v->numnodes = 1;
+    memset(&v->nodes[0], 0, sizeof(struct hview_node));
+}
+
+void hview_clear(struct hview *v)
+{
+    if (v->nodes != v->inl) free(v->nodes);
+    hview_init(v);
+}
+
+/* Return the child of parent named name, added if not exists, as hdf does.
+ * The name will be moved to dst. Return 0 on memory error. */
+static int node_child(struct hview *v, int parent,
+                      char *name, size_t nlen, char *dst)
+{
+    struct hview_node *n, *nodes;
+    int i, last = 0;
+
+    for (i = v->nodes[parent].child; i; i = v->nodes[i].next) {
+        n = &v->nodes[i];
+        if (n->nlen == nlen && !memcmp(n->nsrc, name, nlen)) return i;
+        last = i;
+    }
+
+    if (v->numnodes == v->maxnodes) {
+        nodes = malloc(2 * v->maxnodes * sizeof(struct hview_node));
+        if (nodes == NULL) return 0;
+        memcpy(nodes, v->nodes, v->numnodes * sizeof(struct hview_node));
+        if (v->nodes != v->inl) free(v->nodes);
+        v->nodes = nodes;
+        v->maxnodes *= 2;
+    }
+
+    i = v->numnodes++;
+    n = &v->nodes[i];
+    memset(n, 0, sizeof(struct hview_node));
+    n->nsrc = name;
+    n->nlen = nlen;
+    n->name = dst;
+
+    if (last) v->nodes[last].next = i;
+    else v->nodes[parent].child = i;
+
+    return i;
+}
+
+static void node_value(struct hview *v, int i,
+                       char *val, size_t vlen, char *dst)
+{
+    struct hview_node *n = &v->nodes[i];
+
+    n->vsrc = val;
+    n->vlen = vlen;
+    n->value = dst;
+    n->ibuf[0] = '\0';
+}
+
+static int parse_text(struct hview *v, char *buf, size_t len)
+{
+    int stack[HVIEW_MAX_DEPTH];
+    int depth = 0, i;
+    char *p, *end, *eol, *s, *e, *name;
+
+    stack[0] = 0;
+    p = buf;
+    end = buf + len;
+
+    while (p < end) {
+        eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+
+        s = p;
+        p = eol + 1;
+
+        while (s < eol && isspace(*s)) s++;
+        if (s == eol) continue;
+        if (*s == '#') {
+            if (!strncmp(s, "#include", 8)) return 1;
+            continue;
+        }
+
+        if (*s == '}') {
+            if (depth == 0) return -1;
+            depth--;
+            continue;
+        }
+
+        name = s;
+        while (s < eol && (isalnum(*s) || *s == '_' || *s == '-')) s++;
+        if (s == name || (s < eol && *s == '.')) return 1;
+        e = s;
+        while (s < eol && (*s == ' ' || *s == '\t')) s++;
+        if (s == eol) return 1;
+
+        if (*s == '=') {
+            i = node_child(v, stack[depth], name, e - name, name);
+            if (i == 0) return 1;
+
+            s++;
+            while (s < eol && isspace(*s)) s++;
+            e = eol;
+            while (e > s && isspace(*(e-1))) e--;
+            node_value(v, i, s, e - s, s);
+        } else if (*s == '{') {
+            if (depth == HVIEW_MAX_DEPTH - 1) return 1;
+            i = node_child(v, stack[depth], name, e - name, name);
+            if (i == 0) return 1;
+            stack[++depth] = i;
+        } else {
+            /* attributes, links, multi line values... */
+            return 1;
+        }
+    }
+
+    /* let hdf_read_string() report it */
+    if (depth != 0) return 1;
+
+    return 0;
+}
+
+static int parse_bin(struct hview *v, int parent,
+                     unsigned char *buf, size_t len, int depth)
+{
+    unsigned char *p, *val;
+    size_t pos = 0, ksize, n;
+    uint64_t ival;
+    int i, rv;
+
+    if (depth == HVIEW_MAX_DEPTH) return 1;
+
+    while (pos < len) {
+        if (len - pos < 2) return -1;
+
+        p = buf + pos;
+        ksize = p[1];
+        if (ksize == 0 || ksize > len - pos - 2) return -1;
+        if (memchr(p+2, '.', ksize)) return 1;
+
+        n = unpack_varint(p + 2 + ksize, len - pos - 2 - ksize, &ival);
+        if (n == 0) return -1;
+        val = p + 2 + ksize + n;
+        pos += 2 + ksize + n;
+
+        if (p[0] == DATA_TYPE_ATTR) return 1;
+
+        /* the name goes to the head of it's entry */
+        i = node_child(v, parent, (char*)p+2, ksize, (char*)p);
+        if (i == 0) return 1;
+
+        switch (p[0]) {
+        case DATA_TYPE_U32:
+        case DATA_TYPE_ULONG:
+            node_value(v, i, NULL, 0, v->nodes[i].ibuf);
+            snprintf(v->nodes[i].ibuf, sizeof(v->nodes[i].ibuf),
+                     "%llu", (unsigned long long)ival);
+            break;
+        case DATA_TYPE_STRING:
+            if (ival > len - pos) return -1;
+            /* the value goes to where it's size was */
+            node_value(v, i, (char*)val, ival, (char*)p + 2 + ksize);
+            pos += ival;
+            break;
+        case DATA_TYPE_ARRAY:
+            if (ival > len - pos) return -1;
+            rv = parse_bin(v, i, val, ival, depth + 1);
+            if (rv != 0) return rv;
+            pos += ival;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int hview_parse(struct hview *v, unsigned char *buf, size_t len, bool binary)
+{
+    struct hview_node *n;
+    unsigned char *val;
+    size_t vsize;
+    int rv, i;
+
+    hview_clear(v);
+
+    if (buf == NULL) return 0;
+
+    if (binary) {
+        vsize = unpack_data_array(buf, len, &val);
+        if (vsize == 0) return -1;
+        rv = parse_bin(v, 0, val, vsize - (val - buf), 0);
+    } else {
+        rv = parse_text(v, (char*)buf, len);
+    }
+
+    if (rv != 0) {
+        hview_clear(v);
+        return rv;
+    }
+
+    /*
+     * buf is only changed after the whole parse succeed, so it's still
+     * good for hdf_read_string() on the others.
+     * integer values are formated already, and ibuf only moves with
+     * the nodes array, which can't grow from now on.
+     */
+    for (i = 1; i < v->numnodes; i++) {
+        n = &v->nodes[i];
+
+        memmove(n->name, n->nsrc, n->nlen);
+        n->name[n->nlen] = '\0';
+
+        if (n->vsrc) {
+            memmove(n->value, n->vsrc, n->vlen);
+            n->value[n->vlen] = '\0';
+        } else if (n->ibuf[0] != '\0') {
+            n->value = n->ibuf;
+        }
+    }
+
+    return 0;
+}
+
+struct hview_node* hview_get_obj(struct hview *v, const char *name)
+{
+    const char *s, *dot;
+    size_t len;
+    int cur = 0, i;
+
+    if (v == NULL || name == NULL) return NULL;
+
+    for (s = name; ; s = dot + 1) {
+        dot = strchr(s, '.');
+        len = dot ? (size_t)(dot - s) : strlen(s);
+
+        for (i = v->nodes[cur].child; i; i = v->nodes[i].next) {
+            if (!strncmp(v->nodes[i].name, s, len) &&
+                v->nodes[i].name[len] == '\0')
+                break;
+        }
+        if (i == 0) return NULL;
+        if (dot == NULL) return &v->nodes[i];
+
+        cur = i;
+    }
+}
+
+char* hview_get_value(struct hview *v, const char *name, char *defval)
+{
+    struct hview_node *n = hview_get_obj(v, name);
+
+    if (n == NULL || n->value == NULL) return defval;
+
+    return n->value;
+}
+
+int hview_get_int_value(struct hview *v, const char *name, int defval)
+{
+    char *val, *eptr;
+    int rv;
+
+    val = hview_get_value(v, name, NULL);
+    if (val == NULL) return defval;
+
+    rv = strtol(val, &eptr, 10);
+    if (eptr == val) return defval;
+
+    return rv;
+}
+
+struct hview_node* hview_obj_child(struct hview *v, struct hview_node *node)
+{
+    if (v == NULL) return NULL;
+    if (node == NULL) node = &v->nodes[0];
+
+    return node->child ? &v->nodes[node->child] : NULL;
+}
+
+struct hview_node* hview_obj_next(struct hview *v, struct hview_node *node)
+{
+    if (v == NULL || node == NULL) return NULL;
+
+    return node->next ? &v->nodes[node->next] : NULL;
+}
+
+static NEOERR* node_to_hdf(struct hview *v, int parent, HDF *hdf)
+{
+    struct hview_node *n;
+    HDF *node;
+    NEOERR *err;
+    int i;
+
+    for (i = v->nodes[parent].child; i; i = n->next) {
+        n = &v->nodes[i];
+
+        if (n->value) {
+            err = hdf_set_value(hdf, n->name, n->value);
+            if (err != STATUS_OK) return nerr_pass(err);
+        }
+
+        if (n->child) {
+            err = hdf_get_node(hdf, n->name, &node);
+            if (err != STATUS_OK) return nerr_pass(err);
+
+            err = node_to_hdf(v, i, node);
+            if (err != STATUS_OK) return nerr_pass(err);
+        }
+    }
+
+    return STATUS_OK;
+}
+
+NEOERR* hview_to_hdf(struct hview *v, HDF *hdf)
+{
+    MCS_NOT_NULLB(v, hdf);
+
+    return nerr_pass(node_to_hdf(v, 0, hdf));
+}
@@ -0,0 +1,62 @@
+/*
+ * Read only view of a received hdf. See hview.c for more information.
+ */
+#ifndef _HVIEW_H
+#define _HVIEW_H
+
+#define HVIEW_INLINE_NODES  16
+
+struct hview_node {
+    char *name;
+    char *value;            /* NULL for none */
+    int child;              /* index in nodes, 0 for none */
+    int next;
+
+    /* where the parser found them, moved to name/value by hview_parse() */
+    char *nsrc, *vsrc;
+    size_t nlen, vlen;
+
+    char ibuf[24];          /* formated integer value, of binary encoding */
+};
+
+struct hview {
+    /* nodes[0] is the root, it has no name and value */
+    struct hview_node *nodes;
+    int numnodes;
+    int maxnodes;
+
+    struct hview_node inl[HVIEW_INLINE_NODES];
+};
+
+typedef struct hview_node HviewNode;
+
+void hview_init(struct hview *v);
+void hview_clear(struct hview *v);
+
+/*
+ * index buf (a hdf string, or pack_hdf_bin() output) in place, no memory
+ * allocated per node. buf is modified to '\0' terminate names and values,
+ * so it must be writable and live as long as the view.
+ * return 0 on ok,
+ *        1 if the hdf uses something the view don't know (attributes,
+ *          multi line values, links...), buf is untouched then, and should
+ *          be decoded into a real HDF,
+ *       -1 if buf is broken
+ */
+int hview_parse(struct hview *v, unsigned char *buf, size_t len, bool binary);
+
+/*
+ * same semantics as hdf_get_obj(), hdf_get_value()... on the view
+ */
+struct hview_node* hview_get_obj(struct hview *v, const char *name);
+char* hview_get_value(struct hview *v, const char *name, char *defval);
+int hview_get_int_value(struct hview *v, const char *name, int defval);
+struct hview_node* hview_obj_child(struct hview *v, struct hview_node *node);
+struct hview_node* hview_obj_next(struct hview *v, struct hview_node *node);
+
+/*
+ * copy the view into hdf, to get a mutable one
+ */
+NEOERR* hview_to_hdf(struct hview *v, HDF *hdf);
+
+#endif
@@ -13,7 +13,6 @@ extern volatile time_t g_ctime;
  */
 extern volatile double g_ctimef;
 
-extern struct stats g_stat;
 extern struct moc *g_moc;
 
 #endif    /* __LGLOBAL_H__ */
@@ -9,13 +9,19 @@
 #include "lglobal.h"
 
 #include "cache.h"
+#include "cache_open.h"
+#include "cache_snap.h"
+#include "cache_flight.h"
+#include "cache_tag.h"
+#include "scache.h"
+#include "hview.h"
 #include "queue.h"
 #include "parse.h"
 #include "req.h"
+#include "syscmd.h"
 #include "tcp.h"
 #include "net.h"
 #include "mocd.h"
-#include "syscmd.h"
 
 /*
  * we need talk to other moc server through moc_trigger() and wait for response
@@ -7,7 +7,6 @@ HASH *g_datah = NULL;
 volatile time_t g_ctime = 0;
 volatile double g_ctimef = 0.0;
 
-struct stats g_stat = {0};
 struct moc *g_moc = NULL;
 
 static void useage(void)
@@ -53,8 +52,6 @@ int main(int argc, char *argv[])
     /* fell tired */
     moc_hdfsnd(NULL);
     
-    sys_stats_init(&g_stat);
-
     err = mcfg_parse_file(myset.conffname, &g_cfg);
     OUTPUT_NOK(err);
     
@@ -78,12 +75,23 @@ int main(int argc, char *argv[])
 
     signal(SIGPIPE, SIG_IGN);
 
+    /* caches reload their snapshot with it, before the timer runs */
+    g_ctimef = ne_timef();
+    g_ctime = (time_t) g_ctimef;
+
+    err = scache_init();
+    RETURN_V_NOK(err, 1);
+
     g_moc = moc_start();
 
     net_go();
 
     moc_stop(g_moc);
 
+    net_stop();
+
+    scache_stop();
+
     mcfg_cleanup(&g_cfg);
 
     return 0;
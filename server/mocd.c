@@ -32,51 +32,59 @@ static uint32_t hash(const unsigned char *key, const size_t ksize)
 static void* moc_start_base_entry(void *arg)
 {
     int rv;
-    struct timespec ts;
-    struct queue_entry *q;
+    struct queue_entry *q, *n;
 
-    struct event_entry *e = (struct event_entry*)arg;
+    struct op_worker *w = (struct op_worker*)arg;
+    struct event_entry *e = w->entry;
+    struct cache *cd = e->cache;
+    double expired_at = 0;
 
     for (;;) {
-        /* Condition waits are specified with absolute timeouts, see
-         * pthread_cond_timedwait()'s SUSv3 specification for more
-         * information. We need to calculate it each time.
-         * We sleep for 1 sec. There's no real need for it to be too
-         * fast (it's only used so that stop detection doesn't take
-         * long), but we don't want it to be too slow either. */
-        mutil_utc_time(&ts);
-        ts.tv_sec += 1;
-
-        rv = 0;
-        queue_lock(e->op_queue);
-        while (queue_isempty(e->op_queue) && rv == 0) {
-            rv = queue_timedwait(e->op_queue, &ts);
+        /* reclaim a bit of expired cache entries each tick, busy or not */
+        if (cd != NULL && (g_ctimef - expired_at) * 1000 >= EXPIRE_TICK) {
+            expired_at = g_ctimef;
+            cache_expire(cd, e->expire_work);
+            cache_snap_tick(cd, CACHE_SNAP_WORK);
         }
 
-        if (rv != 0 && rv != ETIMEDOUT) {
-            mtc_err("Error in queue_timedwait()");
-            /* When the timedwait fails the lock is released, so
-             * we need to properly annotate this case. */
-            __release(e->op_queue->lock);
-            continue;
-        }
-
-        q = queue_get(e->op_queue);
-        queue_unlock(e->op_queue);
+        /* Take all the pending entries in one shot, and process them as a
+         * batch without touching the queue again. */
+        q = queue_get_all(w->op_queue);
 
         if (q == NULL) {
             if (e->loop_should_stop) {
                 break;
-            } else {
-                continue;
             }
+
+            /* We sleep for 1 sec at most (a tick with a cache to expire).
+             * There's no real need for it to be too fast (it's only used so
+             * that stop detection doesn't take long), producers wake us up
+             * as soon as they put. */
+            rv = queue_wait(w->op_queue, cd ? EXPIRE_TICK : 1000);
+            if (rv != 0 && rv != ETIMEDOUT && rv != EINTR) {
+                mtc_err("Error in queue_wait() %d", rv);
+            }
+            continue;
         }
 
-        e->process_driver(e, q);
+        while (q != NULL) {
+            n = q->prev;
 
-        /* Free the entry that was allocated when tipc queued the
-         * operation. This also frees it's components. */
-        queue_entry_free(q);
+            if (queue_entry_decode(q) == 0) {
+                e->process_driver(e, q);
+            } else {
+                __sync_add_and_fetch(&q->req->tcpsock->reactor->st.net_broken_req, 1);
+                if (q->req->flags & FLAGS_SYNC)
+                    q->req->reply_mini(q->req, REP_ERR_BROKEN);
+            }
+
+            /* Free the entry that was allocated when tipc queued the
+             * operation. This also frees it's components. */
+            if (!q->held) queue_entry_free(q);
+            queue_consumed(w->op_queue, 1);
+
+            q = n;
+        }
     }
     
     return NULL;
@@ -88,25 +96,76 @@ static void moc_stop_driver(struct event_entry *e)
 
     //dlclose(e->lib);
     e->loop_should_stop = 1;
+    for (int i = 0; i < e->numworkers; i++) {
+        queue_signal(e->workers[i].op_queue);
+    }
+    for (int i = 0; i < e->numworkers; i++) {
+        pthread_join(e->workers[i].op_thread, NULL);
+        queue_free(e->workers[i].op_queue);
+    }
+    /* after the op threads, they may use the plugin's cache till then */
+    if (e->cache != NULL && e->cache->snap != NULL)
+        cache_snap_write(e->cache);
     e->stop_driver(e);
-    pthread_join(*(e->op_thread), NULL);
-    free(e->op_thread);
-    queue_free(e->op_queue);
+    free(e->workers);
+    if (e->route_param != NULL) free(e->route_param);
     if (e->name != NULL) free(e->name);
     free(e);
 }
 
 static int moc_start_driver(struct moc *evt, struct event_driver *d, void *lib)
 {
+    char key[256];
+    int num = 1;
+
     if (evt == NULL || evt->table == NULL || d == NULL) return 0;
 
     struct event_entry *e = d->init_driver();
     if (e == NULL) return 0;
 
+    if (d->flags & DRIVER_F_MULTI_THREAD) {
+        snprintf(key, sizeof(key), "Plugin.%s.threads", (char*)d->name);
+        num = hdf_get_int_value(g_cfg, key, 1);
+        if (num < 1) num = 1;
+        if (num > 1 && e->cache != NULL) {
+            mtc_err("plugin %s has it's own cache, one op thread only",
+                    (char*)d->name);
+            num = 1;
+        }
+    }
+    snprintf(key, sizeof(key), "Plugin.%s.route_param", (char*)d->name);
+    e->route_param = strdup(hdf_get_value(g_cfg, key, "userid"));
+    snprintf(key, sizeof(key), "Plugin.%s.expire_work", (char*)d->name);
+    e->expire_work = hdf_get_int_value(g_cfg, key, EXPIRE_WORK);
+
     //e->lib = lib;
-    e->op_queue = queue_create();
-    e->op_thread = malloc(sizeof(pthread_t));
-    pthread_create(e->op_thread, NULL, moc_start_base_entry, (void*)e);
+    e->workers = calloc(num, sizeof(struct op_worker));
+    if (e->workers == NULL) {
+        mtc_err("alloc %d op workers of %s failure", num, (char*)d->name);
+        moc_stop_driver(e);
+        return 0;
+    }
+    /* counted as they start, moc_stop_driver() stops those only */
+    e->numworkers = 0;
+    for (int i = 0; i < num; i++) {
+        struct op_worker *w = &e->workers[i];
+
+        w->entry = e;
+        w->op_queue = queue_create();
+        if (w->op_queue == NULL) {
+            mtc_err("create op queue of %s failure", (char*)d->name);
+            moc_stop_driver(e);
+            return 0;
+        }
+        if (pthread_create(&w->op_thread, NULL, moc_start_base_entry,
+                           (void*)w) != 0) {
+            mtc_err("create op thread of %s failure", (char*)d->name);
+            queue_free(w->op_queue);
+            moc_stop_driver(e);
+            return 0;
+        }
+        e->numworkers++;
+    }
     
     uint32_t h;
     struct event_chain *c;
@@ -254,3 +313,85 @@ struct event_entry* find_entry_in_table(struct moc *evt,
 
     return find_in_chain(c, key, ksize);
 }
+
+/* Find the value of a top level "name = value" line in the string written by
+ * hdf_write_string(), without decoding the whole dataset. */
+static const char* raw_param(const char *raw, const char *name, size_t *vlen)
+{
+    const char *p, *v;
+    size_t nlen = strlen(name);
+
+    for (p = raw; p != NULL && *p != '\0'; p = strchr(p, '\n')) {
+        if (*p == '\n') p++;
+        if (strncmp(p, name, nlen)) continue;
+
+        v = p + nlen;
+        while (*v == ' ') v++;
+        if (*v != '=') continue;
+        v++;
+        while (*v == ' ') v++;
+
+        *vlen = strcspn(v, "\r\n");
+        return v;
+    }
+
+    return NULL;
+}
+
+struct op_worker* moc_route_worker(struct event_entry *e,
+                                   const struct req_info *req,
+                                   const unsigned char *hdfraw, size_t rawsize)
+{
+    uint32_t h, none = 0;
+    const char *key = NULL;
+    char vbuf[256];
+    size_t klen = 0;
+
+    if (e->numworkers == 1) return &e->workers[0];
+
+    /*
+     * a connection keeps the route of it's first request, so a join and the
+     * requests after it never run on two threads at once, out of order
+     */
+    if (req->tcpsock) {
+        h = __atomic_load_n(&req->tcpsock->route, __ATOMIC_ACQUIRE);
+        if (h != 0) return &e->workers[h % e->numworkers];
+    }
+
+    if (hdfraw != NULL) {
+        if (req->flags & FLAGS_BINARY) {
+            key = unpack_hdf_bin_value((unsigned char*)hdfraw, rawsize,
+                                       e->route_param, vbuf, sizeof(vbuf));
+            if (key) klen = strlen(key);
+        } else {
+            key = raw_param((const char*)hdfraw, e->route_param, &klen);
+        }
+    }
+
+    if (key != NULL && klen > 0) {
+        h = hash((const unsigned char*)key, klen);
+    } else {
+        h = hash((unsigned char*)&req->fd, sizeof(req->fd));
+    }
+    if (h == 0) h = 1;
+
+    /* moc_set_route_key() may have been first */
+    if (req->tcpsock &&
+        !__atomic_compare_exchange_n(&req->tcpsock->route, &none, h, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        h = none;
+
+    return &e->workers[h % e->numworkers];
+}
+
+void moc_set_route_key(struct tcp_socket *tcpsock, const char *key)
+{
+    uint32_t h, none = 0;
+
+    if (!tcpsock || !key) return;
+
+    /* 0 means none, and a connection already routed keeps it's route */
+    h = hash((const unsigned char*)key, strlen(key));
+    __atomic_compare_exchange_n(&tcpsock->route, &none, h ? h : 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
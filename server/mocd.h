@@ -26,17 +26,28 @@ struct timer_entry {
     struct timer_entry *next;
 };
 
+/*
+ * one op thread, and it's own queue
+ */
+struct op_worker {
+    struct event_entry *entry;
+    struct queue *op_queue;
+    pthread_t op_thread;
+};
+
 struct event_entry {
     /*
      * public, init in moc_start_driver()
      */
     //void *lib;        /* for dlopen() */
-    struct queue *op_queue;
-    pthread_t *op_thread;
+    struct op_worker *workers;
+    int numworkers;
+    char *route_param;
     int loop_should_stop;
     struct event_entry *prev;
     struct event_entry *next;
     struct timer_entry *timers;
+    int expire_work;            /* cache entries looked at per expire tick */
 
     /*
      * different by plugin, init in init_driver()
@@ -45,14 +56,39 @@ struct event_entry {
     size_t ksize;
     void (*process_driver)(struct event_entry *e, struct queue_entry *q);
     void (*stop_driver)(struct event_entry *e);
+    /*
+     * the plugin's own cache, if any, it's expired entries are reclaimed, and
+     * it's snapshot written, by the op thread between requests. A plugin
+     * with it runs on one op thread, see DRIVER_F_MULTI_THREAD.
+     */
+    struct cache *cache;
 
     /*
      * extensions after here...
      */
 };
+/*
+ * event_driver flags
+ * DRIVER_F_MULTI_THREAD: process_driver() is thread safe, and can be run on
+ *     Plugin.<name>.threads op threads at the same time. Requests with the same
+ *     route key (see moc_route_worker()) always go to the same thread, in order.
+ *     Without it, the plugin have only one op thread.
+ *     A plugin with it's own cache (event_entry.cache) gets one op thread
+ *     anyway: the cache isn't thread safe, share a scache instead.
+ */
+#define DRIVER_F_MULTI_THREAD    0x01
+
+/*
+ * a plugin's cache (event_entry.cache) is expired every EXPIRE_TICK msec,
+ * looking at Plugin.<name>.expire_work entries, EXPIRE_WORK by default
+ */
+#define EXPIRE_TICK     100
+#define EXPIRE_WORK     1024
+
 struct event_driver {
     unsigned char *name;
     struct event_entry* (*init_driver)(void);
+    unsigned int flags;
 };
 
 typedef struct event_entry EventEntry;
@@ -69,4 +105,18 @@ void moc_add_timer(struct timer_entry **timers, int timeout, bool repeat,
 struct event_entry* find_entry_in_table(struct moc *evt,
                                         const unsigned char *key, size_t ksize);
 
+/*
+ * pick the op worker for the request, by the route key of:
+ * 1. the tcp socket, set by it's first request, or moc_set_route_key()
+ * 2. Plugin.<name>.route_param in the raw hdf, default "userid"
+ * 3. the connection
+ * the key of a request is the route of it's tcp socket from then on, so all
+ * requests of a connection go to one thread, in order.
+ */
+struct op_worker* moc_route_worker(struct event_entry *e,
+                                   const struct req_info *req,
+                                   const unsigned char *hdfraw, size_t rawsize);
+/* route tcpsock by key (e.g. on user login), if it's not routed yet */
+void moc_set_route_key(struct tcp_socket *tcpsock, const char *key);
+
 #endif    /* __MOCD_H__ */
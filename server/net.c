@@ -1,20 +1,17 @@
 #include "mheads.h"
 #include "lheads.h"
 
+#include <event2/thread.h>
+
+static struct net_reactor *m_reactors = NULL;
+static int m_nreactors = 0;
+
+/* Called by reactor 0's persist timer every 100ms */
 static void time_up(int fd, short flags, void* arg)
 {
-    struct event *ev = (struct event*)arg;
-    struct timeval t = {.tv_sec = 0, .tv_usec = 100000};
-    static bool initialized = false;
     static int upsec = 0;
     bool stepsec = false;
 
-    if (initialized) event_del(ev);
-    else initialized = true;
-
-    evtimer_set(ev, time_up, ev);
-    evtimer_add(ev, &t);
-
     g_ctimef = ne_timef();
     if ((time_t)g_ctimef - g_ctime >= 1) {
         upsec += (time_t)g_ctimef - g_ctime;
@@ -60,40 +57,179 @@ static void time_up(int fd, short flags, void* arg)
     }
 }
 
+static void* reactor_routine(void *arg)
+{
+    struct net_reactor *r = (struct net_reactor*)arg;
+
+    mtc_dbg("reactor %d started", r->id);
+
+    event_base_dispatch(r->base);
+
+    return NULL;
+}
+
+static int reactor_init(struct net_reactor *r, int id,
+                        const char *ip, int port, bool reuseport)
+{
+    r->id = id;
+    r->numconns = 0;
+    sys_stats_init(&r->st);
+
+    r->rbuf = malloc(SBSIZE);
+    if (r->rbuf == NULL)
+        return 0;
+
+    r->base = event_base_new();
+    if (r->base == NULL)
+        return 0;
+
+    r->fd = tcp_init(ip, port, reuseport);
+    if (r->fd <= 0) {
+        mtc_err("init tcp socket on %s %d failure %d", ip, port, r->fd);
+        return 0;
+    }
+
+    event_assign(&r->lev, r->base, r->fd, EV_READ | EV_PERSIST,
+                 tcp_newconnection, r);
+    event_add(&r->lev, NULL);
+
+    return 1;
+}
+
+static void reactor_destroy(struct net_reactor *r)
+{
+    if (r->fd > 0) {
+        event_del(&r->lev);
+        tcp_close(r->fd);
+    }
+    if (r->base) event_base_free(r->base);
+    if (r->rbuf) free(r->rbuf);
+    tcp_rbuf_pool_free(r);
+    tcp_conn_slab_free(r);
+}
+
+void net_stats(HDF *node)
+{
+    struct stats sum;
+    struct stats *st;
+    size_t numconns = 0;
+    unsigned long gets = 0, hits = 0;
+    size_t inuse = 0, cached = 0, slab = 0;
+    char key[64];
+
+    sys_stats_init(&sum);
+
+    for (int i = 0; i < m_nreactors; i++) {
+        st = &m_reactors[i].st;
+
+        sum.msg_tcp += st->msg_tcp;
+        sum.net_version_mismatch += st->net_version_mismatch;
+        sum.net_broken_req += st->net_broken_req;
+        sum.net_unk_req += st->net_unk_req;
+        sum.pro_busy += st->pro_busy;
+        sum.net_push_drop += st->net_push_drop;
+        sum.net_slow_close += st->net_slow_close;
+        sum.net_bcast_sent += st->net_bcast_sent;
+        sum.net_bcast_drop += st->net_bcast_drop;
+        sum.net_bcast_lat_us += st->net_bcast_lat_us;
+        if (st->net_bcast_lat_max_us > sum.net_bcast_lat_max_us)
+            sum.net_bcast_lat_max_us = st->net_bcast_lat_max_us;
+        numconns += m_reactors[i].numconns;
+        gets += m_reactors[i].pool.gets;
+        hits += m_reactors[i].pool.hits;
+        inuse += m_reactors[i].pool.inuse;
+        cached += m_reactors[i].pool.cached;
+        slab += m_reactors[i].slab.total;
+
+        snprintf(key, sizeof(key), "reactor.%d.numconns", i);
+        hdf_set_int_value(node, key, m_reactors[i].numconns);
+        snprintf(key, sizeof(key), "reactor.%d.msg_tcp", i);
+        hdf_set_int_value(node, key, st->msg_tcp);
+        snprintf(key, sizeof(key), "reactor.%d.net_broken_req", i);
+        hdf_set_int_value(node, key, st->net_broken_req);
+        snprintf(key, sizeof(key), "reactor.%d.pro_busy", i);
+        hdf_set_int_value(node, key, st->pro_busy);
+    }
+
+    hdf_set_int_value(node, "numconns", numconns);
+    hdf_set_int_value(node, "msg_tipc", sum.msg_tipc);
+    hdf_set_int_value(node, "msg_tcp", sum.msg_tcp);
+    hdf_set_int_value(node, "msg_udp", sum.msg_udp);
+    hdf_set_int_value(node, "msg_sctp", sum.msg_sctp);
+    hdf_set_int_value(node, "net_version_mismatch", sum.net_version_mismatch);
+    hdf_set_int_value(node, "net_broken_req", sum.net_broken_req);
+    hdf_set_int_value(node, "net_unk_req", sum.net_unk_req);
+    hdf_set_int_value(node, "pro_busy", sum.pro_busy);
+    hdf_set_int_value(node, "net_push_drop", sum.net_push_drop);
+    hdf_set_int_value(node, "net_slow_close", sum.net_slow_close);
+    hdf_set_int_value(node, "net_bcast_sent", sum.net_bcast_sent);
+    hdf_set_int_value(node, "net_bcast_drop", sum.net_bcast_drop);
+    hdf_set_int_value(node, "net_bcast_lat_avg_us", sum.net_bcast_sent ?
+                      sum.net_bcast_lat_us / sum.net_bcast_sent : 0);
+    hdf_set_int_value(node, "net_bcast_lat_max_us", sum.net_bcast_lat_max_us);
+    hdf_set_int_value(node, "rbuf_pool_gets", gets);
+    hdf_set_int_value(node, "rbuf_pool_hit_pct", gets ? hits * 100 / gets : 0);
+    hdf_set_int_value(node, "rbuf_pool_inuse_bytes", inuse);
+    hdf_set_int_value(node, "rbuf_pool_cached_bytes", cached);
+    hdf_set_int_value(node, "conn_slab_total", slab);
+}
+
 void net_go()
 {
-    struct event ev, ev_clock;
-    int fd = -1;
+    struct event ev_clock;
     char *ip;
-    int port;
+    int port, num;
 
     ip = hdf_get_value(g_cfg, PRE_SERVER".ip", "127.0.0.1");
     port = hdf_get_int_value(g_cfg, PRE_SERVER".port", 5000);
+    num = hdf_get_int_value(g_cfg, PRE_SERVER".io_threads", 1);
+    if (num < 1) num = 1;
 
     /*
-     * we use DEPRECATED event_init() here because:
-     * event_init() more simple than event_base_xxx(),
-     * and I can make sure the server's event just used by the main thread only
+     * app threads add the tcp socket's write event when they have pending
+     * output, so make libevent thread safe before creating any base.
      */
-    event_init();
+    evthread_use_pthreads();
 
-    fd = tcp_init(ip, port);
-    if (fd <= 0) {
-        mtc_err("init tcp socket on %s %d failure %d", ip, port, fd);
+    m_reactors = calloc(num, sizeof(struct net_reactor));
+    if (m_reactors == NULL) {
+        mtc_err("alloc %d reactors failure", num);
         return;
     }
-    
-    event_set(&ev, fd, EV_READ | EV_PERSIST, tcp_newconnection, &ev);
-    event_add(&ev, NULL);
+    m_nreactors = num;
+
+    for (int i = 0; i < num; i++) {
+        if (!reactor_init(&m_reactors[i], i, ip, port, num > 1))
+            return;
+    }
 
     struct timeval t = {.tv_sec = 0, .tv_usec = 100000};
-    evtimer_set(&ev_clock, time_up, &ev_clock);
+    event_assign(&ev_clock, m_reactors[0].base, -1, EV_PERSIST, time_up, NULL);
     evtimer_add(&ev_clock, &t);
 
-    event_dispatch();
+    for (int i = 1; i < num; i++) {
+        pthread_create(&m_reactors[i].thread, NULL, reactor_routine,
+                       &m_reactors[i]);
+    }
+
+    mtc_foo("listen on %s %d with %d io threads", ip, port, num);
+
+    event_base_dispatch(m_reactors[0].base);
 
-    event_del(&ev);
     event_del(&ev_clock);
-    
-    tcp_close(fd);
+
+    for (int i = 1; i < num; i++) {
+        event_base_loopbreak(m_reactors[i].base);
+        pthread_join(m_reactors[i].thread, NULL);
+    }
+}
+
+void net_stop()
+{
+    for (int i = 0; i < m_nreactors; i++) {
+        reactor_destroy(&m_reactors[i]);
+    }
+    free(m_reactors);
+    m_reactors = NULL;
+    m_nreactors = 0;
 }
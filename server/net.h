@@ -1,6 +1,76 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+/*
+ * Receive buffers of partial messages, in size classes up to the biggest
+ * message, kept for reuse on free lists (linked through the buffers).
+ */
+#define RPOOL_CLASSES   5
+#define RPOOL_MAX_CACHED (4 * 1024 * 1024)  /* bytes kept on the lists */
+struct rbuf_pool {
+    unsigned char *free[RPOOL_CLASSES];
+    size_t cached;          /* bytes on the free lists */
+    size_t inuse;           /* bytes held by connections */
+    unsigned long gets;
+    unsigned long hits;     /* gets served from a free list */
+};
+
+/*
+ * tcp_sockets of the reactor's connections, carved out of CONN_SLAB_NUM
+ * sized chunks and recycled, instead of malloc()'d and free()'d one by one.
+ * The last reference may go on any thread, so freed ones are pushed on
+ * remote with a CAS, and the reactor takes them all at once when it's own
+ * list runs out.
+ */
+#define CONN_SLAB_NUM   64
+struct conn_chunk {
+    struct tcp_socket *objs;
+    struct conn_chunk *next;
+};
+struct conn_slab {
+    struct tcp_socket *local;   /* the reactor's thread only */
+    struct tcp_socket *remote;
+    struct conn_chunk *chunks;
+    size_t total;               /* objects in the chunks */
+};
+
+/*
+ * One event loop (with it's own SO_REUSEPORT listen socket) per I/O thread.
+ * Reactor 0 runs on the main thread, and also drives the timers.
+ * Connections accepted by a reactor stay on it until closed.
+ */
+struct net_reactor {
+    int id;
+    int fd;
+    pthread_t thread;
+    struct event_base *base;
+    struct event lev;
+
+    /* buffer for the common case of entire messages per recv() */
+    unsigned char *rbuf;
+    /* and the ones of partial messages, see rbuf_get() */
+    struct rbuf_pool pool;
+    struct conn_slab slab;
+    /* requests of the current read event, put in the queues at it's end */
+    struct queue_batch qb;
+
+    size_t numconns;
+    struct stats st;
+};
+
 void net_go();
 
+/*
+ * free the reactors, with their connection slabs and receive buffer pools.
+ * app threads hold tcp sockets until they're stopped, so call it after
+ * moc_stop()
+ */
+void net_stop();
+
+/*
+ * fill node with the summary of all reactors' stats, and per reactor's
+ * detail under node.reactor.N
+ */
+void net_stats(HDF *node);
+
 #endif  /* __NET_H__ */
@@ -3,14 +3,8 @@
 
 static void parse_stats(struct queue_entry *q)
 {
-    hdf_set_int_value(q->hdfsnd, "msg_tipc", g_stat.msg_tipc);
-    hdf_set_int_value(q->hdfsnd, "msg_tcp", g_stat.msg_tcp);
-    hdf_set_int_value(q->hdfsnd, "msg_udp", g_stat.msg_udp);
-    hdf_set_int_value(q->hdfsnd, "msg_sctp", g_stat.msg_sctp);
-    hdf_set_int_value(q->hdfsnd, "net_version_mismatch", g_stat.net_version_mismatch);
-    hdf_set_int_value(q->hdfsnd, "net_broken_req", g_stat.net_broken_req);
-    hdf_set_int_value(q->hdfsnd, "net_unk_req", g_stat.net_unk_req);
-    hdf_set_int_value(q->hdfsnd, "pro_busy", g_stat.pro_busy);
+    net_stats(q->hdfsnd);
+    scache_stats(q->hdfsnd);
 
     reply_trigger(q, REP_OK);
 
@@ -32,15 +26,18 @@ static void parse_clientmod(struct queue_entry *q)
 
 
 /* Create a queue entry structure based on the parameters passed. Memory
- * allocated here will be free()'d in queue_entry_free(). It's not the
- * cleanest way, but the alternatives are even messier. */
+ * allocated here comes from the entry's arena, and is given back at once in
+ * queue_entry_free(). */
 static struct queue_entry *make_queue_long_entry(const struct req_info *req,
                                                  const unsigned char *ename,
                                                  size_t esize,
-                                                 HDF *hdfrcv)
+                                                 const unsigned char *hdfraw,
+                                                 size_t rawsize)
 {
     struct queue_entry *e;
+    struct req_info *rcopy;
     unsigned char *ecopy;
+    unsigned char *rawcopy;
 
     e = queue_entry_create();
     if (e == NULL) {
@@ -49,7 +46,7 @@ static struct queue_entry *make_queue_long_entry(const struct req_info *req,
 
     ecopy = NULL;
     if (ename != NULL) {
-        ecopy = malloc(esize);
+        ecopy = ne_arena_alloc(e->arena, esize);
         if (ecopy == NULL) {
             queue_entry_free(e);
             return NULL;
@@ -60,24 +57,39 @@ static struct queue_entry *make_queue_long_entry(const struct req_info *req,
     e->operation = (uint32_t)req->cmd;
     e->ename = ecopy;
     e->esize = esize;
-    e->hdfrcv = hdfrcv;
+
+    /* Only the raw hdf is copied here, it's decoded on the app thread, see
+     * queue_entry_decode(). The '\0' terminates hdf string. */
+    if (hdfraw != NULL) {
+        rawcopy = ne_arena_alloc(e->arena, rawsize + 1);
+        if (rawcopy == NULL) {
+            queue_entry_free(e);
+            return NULL;
+        }
+        memcpy(rawcopy, hdfraw, rawsize);
+        rawcopy[rawsize] = '\0';
+        e->hdfraw = rawcopy;
+        e->rawsize = rawsize;
+    }
 
     /* Create a copy of req, including clisa */
-    e->req = malloc(sizeof(struct req_info));
-    if (e->req == NULL) {
+    rcopy = ne_arena_alloc(e->arena, sizeof(struct req_info));
+    if (rcopy == NULL) {
         queue_entry_free(e);
         return NULL;
     }
-    memcpy(e->req, req, sizeof(struct req_info));
+    memcpy(rcopy, req, sizeof(struct req_info));
 
-    e->req->clisa = malloc(req->clilen);
-    if (e->req->clisa == NULL) {
+    rcopy->clisa = ne_arena_alloc(e->arena, req->clilen);
+    if (rcopy->clisa == NULL) {
         queue_entry_free(e);
         return NULL;
     }
-    memcpy(e->req->clisa, req->clisa, req->clilen);
+    memcpy(rcopy->clisa, req->clisa, req->clilen);
 
-    tcp_socket_add_ref(e->req->tcpsock);
+    /* only now, queue_entry_free() drops the reference of e->req */
+    tcp_socket_add_ref(rcopy->tcpsock);
+    e->req = rcopy;
 
     /* clear out unused fields */
     e->req->payload = NULL;
@@ -92,14 +104,15 @@ static struct queue_entry *make_queue_long_entry(const struct req_info *req,
  * 0 if memory error. */
 static int put_in_queue_long(const struct req_info *req, int sync,
                              const unsigned char *ename, size_t esize,
-                             HDF *hdfrcv)
+                             const unsigned char *hdfraw, size_t rawsize)
 {
     struct queue_entry *e;
+    struct queue *queue;
 
     struct event_entry *entry = find_entry_in_table(g_moc, ename, esize);
     if (entry == NULL) {
         if (!strncmp((char*)ename, "_Reserve.Status", esize)) {
-            e = make_queue_long_entry(req, ename, esize, hdfrcv);
+            e = make_queue_long_entry(req, ename, esize, NULL, 0);
             if (e == NULL) {
                 return 0;
             }
@@ -107,7 +120,7 @@ static int put_in_queue_long(const struct req_info *req, int sync,
             queue_entry_free(e);
             return 1;
         } else if (!strncmp((char*)ename, "_Reserve.Clientmod", esize)) {
-            e = make_queue_long_entry(req, ename, esize, hdfrcv);
+            e = make_queue_long_entry(req, ename, esize, NULL, 0);
             if (e == NULL) {
                 return 0;
             }
@@ -115,55 +128,36 @@ static int put_in_queue_long(const struct req_info *req, int sync,
             queue_entry_free(e);
             return 1;
         }
-        hdf_destroy(&hdfrcv);
-        g_stat.net_unk_req++;
+        req->tcpsock->reactor->st.net_unk_req++;
         if (sync) req->reply_mini(req, REP_ERR_UNKREQ);
         return 1;
     }
     
-    if (entry->op_queue->size > QUEUE_SIZE_WARNING &&
-        entry->op_queue->size % 100 == 0) {
-        mtc_err("plugin %s size exceed %ld",
-                entry->name, entry->op_queue->size);
+    queue = moc_route_worker(entry, req, hdfraw, rawsize)->op_queue;
+
+    if (queue->size > QUEUE_SIZE_WARNING && queue->size % 100 == 0) {
+        mtc_err("plugin %s size exceed %ld", entry->name, queue->size);
     }
-    if (entry->op_queue->size > MAX_QUEUE_ENTRY &&
-        entry->op_queue->size % 100 == 0) {
-        mtc_foo("plugin %s busy, queue size is %ld",
-                entry->name, entry->op_queue->size);
-        hdf_destroy(&hdfrcv);
-        g_stat.pro_busy++;
+    if (queue->size > MAX_QUEUE_ENTRY && queue->size % 100 == 0) {
+        mtc_foo("plugin %s busy, queue size is %ld", entry->name, queue->size);
+        req->tcpsock->reactor->st.pro_busy++;
         if (sync) req->reply_mini(req, REP_ERR_BUSY);
         return 1;
     }
     
-    e = make_queue_long_entry(req, ename, esize, hdfrcv);
+    e = make_queue_long_entry(req, ename, esize, hdfraw, rawsize);
     if (e == NULL) {
         return 0;
     }
 
-    queue_lock(entry->op_queue);
-    if (sync) queue_cas(entry->op_queue, e);
-    else queue_put(entry->op_queue, e);
-    queue_unlock(entry->op_queue);
-
-#if 0
-    if (sync) {
-        /* Signal the app thread it has work only if it's a
-         * synchronous operation, asynchronous don't mind
-         * waiting. It does have a measurable impact on
-         * performance (2083847usec vs 2804973usec for sets on
-         * "test2d 100000 10 10"). */
-        queue_signal(entry->op_queue);
-    }
-#endif
-
     /*
-     * TEMP
-     * Always signal the app thread
-     * Because current moc client SYNC mode will block the main thread
-     * Caller always used the ASYNC mode and expect response as soon as possible
+     * Lock free, and the app thread is woken up only if it's sleeping.
+     * SYNC requests go ahead of the others, the client is blocked on them.
+     * Others wait for the end of the read event, to go in with the rest of
+     * it's requests, see tcp_recv().
      */
-    queue_signal(entry->op_queue);
+    if (sync) queue_cas(queue, e);
+    else queue_batch_put(&req->tcpsock->reactor->qb, queue, e);
     
     return 1;
 }
@@ -172,9 +166,9 @@ static int put_in_queue_long(const struct req_info *req, int sync,
  * not need newval. */
 static int put_in_queue(const struct req_info *req, int sync,
                         const unsigned char *ename, size_t esize,
-                        HDF *hdfrcv)
+                        const unsigned char *hdfraw, size_t rawsize)
 {
-    return put_in_queue_long(req, sync, ename, esize, hdfrcv);
+    return put_in_queue_long(req, sync, ename, esize, hdfraw, rawsize);
 }
 
 
@@ -189,7 +183,8 @@ static void parse_event(struct req_info *req)
     const unsigned char *ename;
     uint32_t esize, rsize;
     unsigned char *pos;
-    HDF *hdfrcv = NULL;
+    unsigned char *hdfraw = NULL;
+    size_t rawsize;
 
     FILL_SYNC_FLAG();
     
@@ -211,16 +206,40 @@ static void parse_event(struct req_info *req)
     pos = pos + sizeof(uint32_t);
     ename = pos;
 
+    if (req->psize < esize + sizeof(uint32_t)) {
+        req->tcpsock->reactor->st.net_broken_req++;
+        if (sync) req->reply_mini(req, REP_ERR_BROKEN);
+        return;
+    }
+
+    /*
+     * Only frame the hdf here, it's decoded on the app thread.
+     * Binary one is kept as packed, for unpack_hdf_bin().
+     */
     pos = pos + esize;
-    rsize = unpack_hdf(pos, req->psize-esize-sizeof(uint32_t), &hdfrcv);
-    if (rsize == 0 || rsize+esize+sizeof(uint32_t) > MAX_PACKET_LEN ||
-        req->psize < esize) {
-        g_stat.net_broken_req++;
+    if (req->flags & FLAGS_BINARY) {
+        rsize = unpack_data_array(pos, req->psize-esize-sizeof(uint32_t),
+                                  &hdfraw);
+    } else {
+        rsize = unpack_data_str(pos, req->psize-esize-sizeof(uint32_t),
+                                (char**)&hdfraw);
+    }
+    if (rsize == 0 || rsize+esize+sizeof(uint32_t) > MAX_PACKET_LEN) {
+        req->tcpsock->reactor->st.net_broken_req++;
         if (sync) req->reply_mini(req, REP_ERR_BROKEN);
         return;
     }
 
-    rv = put_in_queue(req, sync, ename, esize, hdfrcv);
+    if (req->flags & FLAGS_BINARY) {
+        hdfraw = pos;
+        rawsize = rsize;
+    } else {
+        rawsize = rsize - (hdfraw - pos);
+        /* the trailing '\0' packed by pack_data_str() */
+        while (rawsize > 0 && hdfraw[rawsize-1] == '\0') rawsize--;
+    }
+
+    rv = put_in_queue(req, sync, ename, esize, hdfraw, rawsize);
     if (!rv) {
         if (sync) req->reply_mini(req, REP_ERR_MEM);
         return;
@@ -243,7 +262,7 @@ int parse_message(struct req_info *req,
     size_t psize;
 
     if (len < 17) {
-        g_stat.net_broken_req++;
+        req->tcpsock->reactor->st.net_broken_req++;
         req->reply_mini(req, REP_ERR_BROKEN);
         return 0;
     }
@@ -269,7 +288,7 @@ int parse_message(struct req_info *req,
     flags = ntohs(* ((uint16_t *) buf + 3));
 
     if (ver != PROTO_VER) {
-        g_stat.net_version_mismatch++;
+        req->tcpsock->reactor->st.net_version_mismatch++;
         req->reply_mini(req, REP_ERR_VER);
         return 0;
     }
@@ -287,6 +306,8 @@ int parse_message(struct req_info *req,
     req->cmd = cmd;
     req->flags = flags;
     req->payload = payload;
+    /* pushes to the client follow the encoding of it's last request */
+    req->tcpsock->binary = (flags & FLAGS_BINARY) != 0;
     req->psize = psize;
 
     parse_event(req);
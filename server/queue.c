@@ -1,47 +1,44 @@
 #include "mheads.h"
 #include "lheads.h"
 
+#include <sys/eventfd.h>
+#include <poll.h>
+
 struct queue *queue_create(void)
 {
     struct queue *q;
-    pthread_mutexattr_t attr;
 
     q = malloc(sizeof(struct queue));
     if (q == NULL)
         return NULL;
 
+    q->head = NULL;
+    q->urgent = NULL;
     q->size = 0;
-    q->top = NULL;
-    q->bottom = NULL;
-
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_NORMAL);
-    pthread_mutex_init(&(q->lock), &attr);
-    pthread_mutexattr_destroy(&attr);
+    q->parked = 0;
 
-    pthread_cond_init(&(q->cond), NULL);
+    q->efd = eventfd(0, EFD_NONBLOCK);
+    if (q->efd < 0) {
+        free(q);
+        return NULL;
+    }
 
     return q;
 }
 
 void queue_free(struct queue *q)
 {
-    struct queue_entry *e;
+    struct queue_entry *e, *n;
 
-    /* We know when we're called there is no other possible queue user;
-     * however, we don't have any sane way to tell sparse about this, so
-     * fake the acquisition of the lock to comply with the operations
-     * performed inside. Obviously, it would be completely safe to do the
-     * queue_lock()/unlock(), but it'd be misleading to the reader */
-    __acquire(q->lock);
-    e = queue_get(q);
+    /* We know when we're called there is no other possible queue user */
+    e = queue_get_all(q);
     while (e != NULL) {
+        n = e->prev;
         queue_entry_free(e);
-        e = queue_get(q);
+        e = n;
     }
-    __release(q->lock);
 
-    pthread_mutex_destroy(&(q->lock));
+    close(q->efd);
 
     free(q);
     return;
@@ -51,114 +48,333 @@ size_t queue_entry_size(struct queue_entry *e)
 {
     if (e == NULL) return 0;
     
-    size_t rv = sizeof(struct queue_entry);
-    rv += e->esize;
-    rv += sizeof(struct req_info);
-    rv += e->req->clilen;
-    rv += e->req->psize;
-    /* TODO hdfrcv, hdfsnd size */
-
-    return rv;
+    /* everything but attributes of the hdfs */
+    return e->arena->used;
 }
 
 
-void queue_lock(struct queue *q)
+struct queue_entry *queue_entry_create(void)
 {
-    pthread_mutex_lock(&(q->lock));
+    struct queue_entry *e;
+    NE_ARENA *arena;
+    NEOERR *err;
+
+    err = ne_arena_get(&arena);
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
+        return NULL;
+    }
+
+    e = ne_arena_alloc(arena, sizeof(struct queue_entry));
+    if (e == NULL) {
+        ne_arena_release(&arena);
+        return NULL;
+    }
+
+    err = hdf_init_arena(&e->hdfsnd, arena);
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
+        ne_arena_release(&arena);
+        return NULL;
+    }
+
+    e->arena = arena;
+    e->operation = 0;
+    e->req = NULL;
+    e->ename = NULL;
+    e->esize = 0;
+    e->hdfraw = NULL;            /* copied in parse_event() */
+    e->rawsize = 0;
+    hview_init(&e->hview);
+    e->hdfrcv = NULL;            /* made in queue_entry_hdfrcv() */
+    e->held = 0;
+    e->zval = NULL;
+    e->prev = NULL;
+
+    return e;
 }
 
-void queue_unlock(struct queue *q)
+void queue_entry_free(struct queue_entry *e) {
+    NE_ARENA *arena = e->arena;
+
+    if (e->req && e->req->tcpsock) tcp_socket_remove_ref(e->req->tcpsock);
+    if (e->zval) cache_val_put(e->zval);
+
+    hview_clear(&e->hview);
+    /* only attributes are malloc()'d in arena hdfs, nothing to do mostly */
+    hdf_destroy(&e->hdfrcv);
+    hdf_destroy(&e->hdfsnd);
+
+    /* e itself goes with it */
+    ne_arena_release(&arena);
+    return;
+}
+
+int queue_entry_decode(struct queue_entry *e)
 {
-    pthread_mutex_unlock(&(q->lock));
+    NEOERR *err;
+    int rv;
+
+    rv = hview_parse(&e->hview, e->hdfraw, e->rawsize,
+                     (e->req->flags & FLAGS_BINARY) != 0);
+    if (rv <= 0) return rv;
+
+    /* the view can't index it, decode it the old way */
+    err = hdf_init_arena(&e->hdfrcv, e->arena);
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
+        return -1;
+    }
+
+    if (e->req->flags & FLAGS_BINARY) {
+        if (unpack_hdf_bin(e->hdfraw, e->rawsize, &e->hdfrcv) == 0)
+            err = nerr_raise(NERR_ASSERT, "broken binary hdf");
+    } else {
+        err = hdf_read_string(e->hdfrcv, (char*)e->hdfraw);
+    }
+    e->hdfraw = NULL;
+    e->rawsize = 0;
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
+        return -1;
+    }
+
+    return 0;
 }
 
-void queue_signal(struct queue *q)
+char* queue_entry_get_value(struct queue_entry *e, const char *name,
+                            char *defval)
 {
-    pthread_cond_signal(&(q->cond));
+    if (e->hdfrcv != NULL) return hdf_get_value(e->hdfrcv, name, defval);
+
+    return hview_get_value(&e->hview, name, defval);
 }
 
-int queue_timedwait(struct queue *q, struct timespec *ts)
+int queue_entry_get_int_value(struct queue_entry *e, const char *name,
+                              int defval)
 {
-    return pthread_cond_timedwait(&(q->cond), &(q->lock), ts);
+    if (e->hdfrcv != NULL) return hdf_get_int_value(e->hdfrcv, name, defval);
+
+    return hview_get_int_value(&e->hview, name, defval);
 }
 
+int queue_entry_get_list(struct queue_entry *e, const char *name,
+                         char **vals, int max)
+{
+    struct hview_node *vn;
+    HDF *node;
+    int n = 0;
 
-struct queue_entry *queue_entry_create(void)
+    if (e->hdfrcv != NULL) {
+        node = hdf_get_child(e->hdfrcv, name);
+        for (; node != NULL; node = hdf_obj_next(node)) {
+            if (n == max) return -1;
+            vals[n++] = hdf_obj_value(node);
+        }
+        return n;
+    }
+
+    vn = hview_get_obj(&e->hview, name);
+    if (vn == NULL) return 0;
+
+    vn = hview_obj_child(&e->hview, vn);
+    for (; vn != NULL; vn = hview_obj_next(&e->hview, vn)) {
+        if (n == max) return -1;
+        vals[n++] = vn->value;
+    }
+    return n;
+}
+
+HDF* queue_entry_hdfrcv(struct queue_entry *e)
 {
-    struct queue_entry *e;
+    NEOERR *err;
+
+    if (e->hdfrcv != NULL) return e->hdfrcv;
 
-    e = malloc(sizeof(struct queue_entry));
-    if (e == NULL)
+    err = hdf_init_arena(&e->hdfrcv, e->arena);
+    if (err != STATUS_OK) {
+        nerr_ignore(&err);
         return NULL;
+    }
 
-    e->operation = 0;
-    e->ename = NULL;
-    e->esize = 0;
-    e->hdfrcv = NULL;            /* hdfrcv inited in parse_event() */
-    hdf_init(&e->hdfsnd);
-    e->prev = NULL;
+    err = hview_to_hdf(&e->hview, e->hdfrcv);
+    if (err != STATUS_OK) {
+        TRACE_NOK(err);
+    }
 
-    return e;
+    return e->hdfrcv;
 }
 
-void queue_entry_free(struct queue_entry *e) {
-    if (e->req) {
-        if (e->req->tcpsock) tcp_socket_remove_ref(e->req->tcpsock);
-        
-        free(e->req->clisa);
-        free(e->req);
-    }
-    if (e->ename)
-        free(e->ename);
-    hdf_destroy(&e->hdfrcv);
-    hdf_destroy(&e->hdfsnd);
-    free(e);
-    return;
+/* Push e onto the stack. Returns the previous top. */
+static struct queue_entry *push(struct queue_entry **top, struct queue_entry *e)
+{
+    struct queue_entry *old;
+
+    old = __atomic_load_n(top, __ATOMIC_RELAXED);
+    do {
+        e->prev = old;
+    } while (!__atomic_compare_exchange_n(top, &old, e, true,
+                                          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return old;
+}
+
+/* Take the whole stack, and reverse it to the arrival order. The last entry
+ * of the returned list is stored in *last. */
+static struct queue_entry *take(struct queue_entry **top,
+                                struct queue_entry **last)
+{
+    struct queue_entry *e, *n, *r = NULL;
+
+    e = __atomic_exchange_n(top, NULL, __ATOMIC_ACQUIRE);
+    *last = e;
+    while (e != NULL) {
+        n = e->prev;
+        e->prev = r;
+        r = e;
+        e = n;
+    }
+    return r;
+}
+
+void queue_signal(struct queue *q)
+{
+    uint64_t one = 1;
+
+    if (write(q->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        mtc_err("write queue eventfd failure %s", strerror(errno));
+}
+
+/* Wake the consumer up, only if it's sleeping (or going to). */
+static void queue_wakeup(struct queue *q)
+{
+    if (__atomic_exchange_n(&q->parked, 0, __ATOMIC_SEQ_CST))
+        queue_signal(q);
 }
 
 void queue_put(struct queue *q, struct queue_entry *e)
 {
-    if (q->top == NULL) {
-        q->top = q->bottom = e;
-    } else {
-        q->top->prev = e;
-        q->top = e;
+    __atomic_fetch_add(&q->size, 1, __ATOMIC_RELAXED);
+    push(&q->head, e);
+    queue_wakeup(q);
+}
+
+/* Stage e on the batch of q, queue_batch_flush() publishes it with one CAS */
+void queue_batch_put(struct queue_batch *qb, struct queue *q,
+                     struct queue_entry *e)
+{
+    int i;
+
+    for (i = 0; i < qb->num; i++) {
+        if (qb->b[i].q == q) break;
     }
-    q->size += 1;
-    return;
+
+    if (i == qb->num) {
+        if (qb->num == QUEUE_BATCH_MAX) {
+            queue_batch_flush(qb);
+            i = 0;
+        }
+        qb->b[i].q = q;
+        qb->b[i].top = qb->b[i].bottom = NULL;
+        qb->b[i].n = 0;
+        qb->num = i + 1;
+    }
+
+    e->prev = qb->b[i].top;
+    qb->b[i].top = e;
+    if (qb->b[i].bottom == NULL) qb->b[i].bottom = e;
+    qb->b[i].n++;
 }
 
-void queue_cas(struct queue *q, struct queue_entry *e)
+void queue_batch_flush(struct queue_batch *qb)
 {
-    if (q->top == NULL) {
-        q->top = q->bottom = e;
-    } else {
-        e->prev = q->bottom;
-        q->bottom = e;
+    struct queue_entry *old, *top, *bottom;
+    struct queue *q;
+    int i;
+
+    for (i = 0; i < qb->num; i++) {
+        q = qb->b[i].q;
+        top = qb->b[i].top;
+        bottom = qb->b[i].bottom;
+
+        /* the whole chain goes on the stack at once, like one push() */
+        __atomic_fetch_add(&q->size, qb->b[i].n, __ATOMIC_RELAXED);
+        old = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        do {
+            bottom->prev = old;
+        } while (!__atomic_compare_exchange_n(&q->head, &old, top, true,
+                                              __ATOMIC_SEQ_CST,
+                                              __ATOMIC_RELAXED));
+        queue_wakeup(q);
     }
-    q->size += 1;
-    return;
+
+    qb->num = 0;
 }
 
-struct queue_entry *queue_get(struct queue *q)
+/* Like queue_put(), but e will be processed before all the put() ones */
+void queue_cas(struct queue *q, struct queue_entry *e)
 {
-    struct queue_entry *e, *t;
+    __atomic_fetch_add(&q->size, 1, __ATOMIC_RELAXED);
+    push(&q->urgent, e);
+    queue_wakeup(q);
+}
 
-    if (q->bottom == NULL)
-        return NULL;
+struct queue_entry *queue_get_all(struct queue *q)
+{
+    struct queue_entry *u, *ulast, *e, *elast;
+
+    u = take(&q->urgent, &ulast);
+    e = take(&q->head, &elast);
+
+    if (u == NULL)
+        return e;
 
-    e = q->bottom;
-    t = q->bottom->prev;
-    q->bottom = t;
-    if (t == NULL) {
-        /* it's empty now */
-        q->top = NULL;
+    /* ulast was the top of the urgent stack, the last one after reverse */
+    ulast->prev = e;
+    return u;
+}
+
+void queue_consumed(struct queue *q, size_t num)
+{
+    __atomic_fetch_sub(&q->size, num, __ATOMIC_RELAXED);
+}
+
+/* Sleep until something is put, or msec passed.
+ * Returns 0 on wakeup, ETIMEDOUT on timeout, or other error number. */
+int queue_wait(struct queue *q, int msec)
+{
+    struct pollfd pfd;
+    uint64_t cnt;
+    int rv;
+
+    __atomic_store_n(&q->parked, 1, __ATOMIC_SEQ_CST);
+
+    /* a producer may have pushed before it could see we're parked */
+    if (!queue_isempty(q)) {
+        __atomic_store_n(&q->parked, 0, __ATOMIC_SEQ_CST);
+        return 0;
     }
-    q->size -= 1;
-    return e;
+
+    pfd.fd = q->efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    rv = poll(&pfd, 1, msec);
+
+    __atomic_store_n(&q->parked, 0, __ATOMIC_SEQ_CST);
+
+    if (rv < 0)
+        return errno;
+    if (rv == 0)
+        return ETIMEDOUT;
+
+    /* reset the counter, we'll take everything anyway */
+    if (read(q->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        return errno;
+
+    return 0;
 }
 
 int queue_isempty(struct queue *q)
 {
-    return (q->size == 0);
+    return (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == NULL &&
+            __atomic_load_n(&q->urgent, __ATOMIC_SEQ_CST) == NULL);
 }
@@ -5,30 +5,30 @@
 #define QUEUE_SIZE_WARNING     1000000
 #define MAX_QUEUE_ENTRY        2097152
 
-#ifdef __CHECKER__
-# define __acquires(x) __attribute__((exact_context(x,0,1)))
-# define __releases(x) __attribute__((exact_context(x,1,0)))
-# define __with_lock_acquired(x) __attribute__((exact_context(x,1,1)))
-# define __acquire(x) __context__(x,1,0)
-# define __release(x) __context__(x,-1,1)
-#else
-# define __acquires(x)
-# define __releases(x)
-# define __with_lock_acquired(x)
-# define __acquire(x) (void)0
-# define __release(x) (void)0
-#endif
-
+/*
+ * Intrusive lock free queue, multi producer (the reactors) and single
+ * consumer (the plugin's op thread).
+ * Producers push entries onto an atomic stack with a CAS, linked by
+ * queue_entry->prev. The consumer takes the whole stack with one exchange
+ * and reverses it, so it can process the backlog as a batch in arrival order.
+ * The consumer only sleeps (on an eventfd) after announcing it in parked,
+ * and producers only write to the eventfd when it is.
+ */
 struct queue {
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
+    struct queue_entry *head;   /* newest put() entry */
+    struct queue_entry *urgent; /* newest cas() entry, taken before head */
 
+    /* entries put and not yet consumed, approximate */
     size_t size;
-    struct queue_entry *top, *bottom;
+
+    int parked;
+    int efd;
 };
 
 /*
  * queue_entry
+ * 0. the entry itself, req, ename, hdfraw, hdfrcv and hdfsnd are all
+ *    allocated from arena, and freed together by queue_entry_free()
  * 1. created by main thread
  * 2. used on app thread
  * 3. freeed by main thread(after app thread process done)
@@ -41,46 +41,104 @@ struct queue {
  *                 I pick reference couting here.
  */
 struct queue_entry {
+    NE_ARENA *arena;
     uint32_t operation;
     struct req_info *req;
 
     unsigned char *ename;
     size_t esize;
-    HDF *hdfrcv;
-    HDF *hdfsnd;
+    unsigned char *hdfraw;  /* received hdf, indexed in place by hview */
+    size_t rawsize;
+    struct hview hview;     /* read only view of hdfraw */
+    HDF *hdfrcv;            /* NULL till queue_entry_hdfrcv() */
+    HDF *hdfsnd;            /* hdf_init_arena()'d, don't hdf_destroy() it */
+    int held;               /* parked by the op thread, which answers and
+                               frees it later, not after process_driver() */
+    struct cache_val *zval; /* a cached value to reply with no copy, see
+                               sys_cmd_cache_get(), put by queue_entry_free() */
 
     struct queue_entry *prev;
     /* A pointer to the next element on the list is actually not
      * necessary, because it's not needed for put and get.
+     * In the queue, prev points to the entry put before this one; in a
+     * batch returned by queue_get_all(), to the one to process after.
      */
 };
 
 typedef struct queue_entry QueueEntry;
 
+/*
+ * Entries a reactor put in one go, e.g. all requests of one recv(), chained
+ * per queue, so each queue gets them with one CAS and one wakeup.
+ */
+#define QUEUE_BATCH_MAX        8
+struct queue_batch {
+    int num;
+    struct {
+        struct queue *q;
+        struct queue_entry *top;    /* the newest, linked by prev */
+        struct queue_entry *bottom; /* the oldest */
+        size_t n;
+    } b[QUEUE_BATCH_MAX];
+};
+
 struct queue *queue_create();
 void queue_free(struct queue *q);
 
 struct queue_entry *queue_entry_create();
 void queue_entry_free(struct queue_entry *e);
+/*
+ * index hdfraw with the hview, done on app thread, so the reactor only copy
+ * the raw payload. it's a hdf string, or pack_hdf_bin() output for
+ * FLAGS_BINARY. the ones hview don't know are decoded into hdfrcv directly.
+ * return 0 on ok, -1 if the payload is broken.
+ */
+int queue_entry_decode(struct queue_entry *e);
+/*
+ * request params, read from the view, or from hdfrcv once it's made
+ */
+char* queue_entry_get_value(struct queue_entry *e, const char *name,
+                            char *defval);
+int queue_entry_get_int_value(struct queue_entry *e, const char *name,
+                              int defval);
+/*
+ * the values of name's children (a list, e.g. name.0, name.1...), in order,
+ * into vals. return how many, or -1 if there are more than max.
+ */
+int queue_entry_get_list(struct queue_entry *e, const char *name,
+                         char **vals, int max);
+/*
+ * the request as a real HDF, made from the view on first call.
+ * use it to change the request, or to get a HDF node of it.
+ */
+HDF* queue_entry_hdfrcv(struct queue_entry *e);
 
 size_t queue_entry_size(struct queue_entry *e);
 
-void queue_lock(struct queue *q)
-    __acquires(q->lock);
-void queue_unlock(struct queue *q)
-    __releases(q->lock);
+/*
+ * producer side, safe to be called from any thread
+ */
+void queue_put(struct queue *q, struct queue_entry *e);
+void queue_cas(struct queue *q, struct queue_entry *e);
 void queue_signal(struct queue *q);
-int queue_timedwait(struct queue *q, struct timespec *ts)
-    __with_lock_acquired(q->lock);
-
-void queue_put(struct queue *q, struct queue_entry *e)
-    __with_lock_acquired(q->lock);
-void queue_cas(struct queue *q, struct queue_entry *e)
-    __with_lock_acquired(q->lock);
-struct queue_entry *queue_get(struct queue *q)
-    __with_lock_acquired(q->lock);
-int queue_isempty(struct queue *q)
-    __with_lock_acquired(q->lock);
+/*
+ * queue_put() e to q in the batch, they're put by queue_batch_flush().
+ * zero the batch before first use.
+ */
+void queue_batch_put(struct queue_batch *qb, struct queue *q,
+                     struct queue_entry *e);
+void queue_batch_flush(struct queue_batch *qb);
+
+/*
+ * consumer side, one thread only
+ * queue_get_all() returns all the entries in processing order (urgent ones
+ * first), linked by prev, or NULL if empty. Call queue_consumed() after each
+ * entry is processed to keep size in sync.
+ */
+struct queue_entry *queue_get_all(struct queue *q);
+void queue_consumed(struct queue *q, size_t num);
+int queue_wait(struct queue *q, int msec);
+int queue_isempty(struct queue *q);
 
 #endif
 
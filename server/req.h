@@ -3,93 +3,97 @@
 
 #define REQTYPE_TCP 2
 
-#define REQ_MAKESURE_PARAM(hdf, key)                                \
+/*
+ * q is the queue_entry, params are read from it's hview, without making
+ * a HDF, except for the OBJ/CHILD ones which return HDF nodes.
+ */
+#define REQ_MAKESURE_PARAM(q, key)                                  \
     do {                                                            \
-        if (!hdf_get_value(hdf, key, NULL))                         \
+        if (!queue_entry_get_value(q, key, NULL))                   \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
     } while (0)
 
-#define REQ_GET_PARAM_INT(hdf, key, ret)                            \
+#define REQ_GET_PARAM_INT(q, key, ret)                              \
     do {                                                            \
-        if (!hdf_get_value(hdf, key, NULL)) {                       \
+        if (!queue_entry_get_value(q, key, NULL)) {                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
-        ret = hdf_get_int_value(hdf, key, 0);                       \
+        ret = queue_entry_get_int_value(q, key, 0);                 \
     } while (0)
 
-#define REQ_GET_PARAM_FLOAT(hdf, key, ret)                          \
+#define REQ_GET_PARAM_FLOAT(q, key, ret)                            \
     do {                                                            \
-        if (!hdf_get_value(hdf, key, NULL)) {                       \
+        if (!queue_entry_get_value(q, key, NULL)) {                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
-        ret = mcs_get_float_value(hdf, key, 0.0);                   \
+        ret = strtof(queue_entry_get_value(q, key, NULL), NULL);    \
     } while (0)
 
-#define REQ_GET_PARAM_LONG(hdf, key, ret)                           \
+#define REQ_GET_PARAM_LONG(q, key, ret)                             \
     do {                                                            \
-        if (!hdf_get_value(hdf, key, NULL)) {                       \
+        if (!queue_entry_get_value(q, key, NULL)) {                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
-        ret = strtoul(hdf_get_value(hdf, key, NULL), NULL, 10);     \
+        ret = strtoul(queue_entry_get_value(q, key, NULL), NULL, 10); \
     } while (0)
 
-#define REQ_GET_PARAM_STR(hdf, key, ret)                            \
+#define REQ_GET_PARAM_STR(q, key, ret)                              \
     do {                                                            \
-        ret = hdf_get_value(hdf, key, NULL);                        \
+        ret = queue_entry_get_value(q, key, NULL);                  \
         if (!ret || *ret == '\0') {                                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
     } while (0)
 
-#define REQ_GET_PARAM_OBJ(hdf, key, ret)                            \
+#define REQ_GET_PARAM_OBJ(q, key, ret)                              \
     do {                                                            \
-        ret = hdf_get_obj(hdf, key);                                \
+        ret = hdf_get_obj(queue_entry_hdfrcv(q), key);              \
         if (!ret) {                                                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
     } while (0)
 
-#define REQ_GET_PARAM_CHILD(hdf, key, ret)                          \
+#define REQ_GET_PARAM_CHILD(q, key, ret)                            \
     do {                                                            \
-        ret = hdf_get_child(hdf, key);                              \
+        ret = hdf_get_child(queue_entry_hdfrcv(q), key);            \
         if (!ret) {                                                 \
             return nerr_raise(REP_ERR_BADPARAM, "need %s", key);    \
         }                                                           \
     } while (0)
 
 
-#define REQ_FETCH_PARAM_INT(hdf, key, ret)          \
-    do {                                            \
-        ret = 0;                                    \
-        if (hdf_get_value(hdf, key, NULL)) {        \
-            ret = hdf_get_int_value(hdf, key, 0);   \
-        }                                           \
-    } while (0)
-
-#define REQ_FETCH_PARAM_FLOAT(hdf, key, ret)            \
+#define REQ_FETCH_PARAM_INT(q, key, ret)                \
     do {                                                \
-        ret = 0.0;                                      \
-        if (hdf_get_value(hdf, key, NULL)) {            \
-            ret = mcs_get_float_value(hdf, key, 0.0);   \
+        ret = 0;                                        \
+        if (queue_entry_get_value(q, key, NULL)) {      \
+            ret = queue_entry_get_int_value(q, key, 0); \
         }                                               \
     } while (0)
 
-#define REQ_FETCH_PARAM_LONG(hdf, key, ret)                         \
-    do {                                                            \
-        ret = 0;                                                    \
-        if (hdf_get_value(hdf, key, NULL)) {                        \
-            ret = strtoul(hdf_get_value(hdf, key, NULL), NULL, 10); \
-        }                                                           \
+#define REQ_FETCH_PARAM_FLOAT(q, key, ret)                              \
+    do {                                                                \
+        ret = 0.0;                                                      \
+        if (queue_entry_get_value(q, key, NULL)) {                      \
+            ret = strtof(queue_entry_get_value(q, key, NULL), NULL);    \
+        }                                                               \
     } while (0)
 
-#define REQ_FETCH_PARAM_STR(hdf, key, ret)                  \
+#define REQ_FETCH_PARAM_LONG(q, key, ret)                               \
+    do {                                                                \
+        ret = 0;                                                        \
+        if (queue_entry_get_value(q, key, NULL)) {                      \
+            ret = strtoul(queue_entry_get_value(q, key, NULL), NULL, 10); \
+        }                                                               \
+    } while (0)
+
+#define REQ_FETCH_PARAM_STR(q, key, ret)                    \
     do {                                                    \
-        ret = hdf_get_value(hdf, key, NULL);                \
+        ret = queue_entry_get_value(q, key, NULL);          \
     } while (0)
 
-#define REQ_FETCH_PARAM_OBJ(hdf, key, ret)      \
-    do {                                        \
-        ret = hdf_get_obj(hdf, key);            \
+#define REQ_FETCH_PARAM_OBJ(q, key, ret)                \
+    do {                                                \
+        ret = hdf_get_obj(queue_entry_hdfrcv(q), key);  \
     } while (0)
 
 
@@ -114,6 +118,12 @@ struct req_info {
     void (*reply_err)(const struct req_info *req, uint32_t reply);
     void (*reply_long)(const struct req_info *req, uint32_t reply,
             unsigned char *val, size_t vsize);
+    /* like reply_long, but the val is at buf + REPLY_HEAD_LEN already */
+    void (*reply_frame)(const struct req_info *req, uint32_t reply,
+            unsigned char *buf, size_t vsize);
+    /* like reply_long, the val in n parts, sent from where they are */
+    void (*reply_iov)(const struct req_info *req, uint32_t reply,
+            const struct iovec *iov, int n);
     
     struct tcp_socket *tcpsock;
 };
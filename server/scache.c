@@ -0,0 +1,506 @@
+/* Shared caches.
+ * A plugin's own cache (e->cd) is only touched by it's op thread. The caches
+ * here are for data more than one plugin, or thread, needs: they're created
+ * by name from the server config before plugins start, and plugins get them
+ * with scache_lookup().
+ *
+ * Each one is split in shards by key hash, every shard a plain struct cache
+ * under it's own mutex, so threads on different keys rarely wait on each
+ * other. The budget and size configured are for the whole, and divided
+ * among shards. A get needs the lock too, it moves the CLOCK reference bit
+ * and may expire or rehash.
+ *
+ * Their expired entries are reclaimed, and snapshots written, every
+ * EXPIRE_TICK by a thread of their own, a shard at a time, off the network
+ * threads. A snapshot is copied under the shard's lock, and written out of it.
+ * A shard's snapshot is it's own file, they're reloaded through scache_set(),
+ * so the number of shards may change between restarts.
+ */
+#include "mheads.h"
+#include "lheads.h"
+
+/* all of them, built by scache_init() and read only after, no lock needed */
+static struct scache *m_caches = NULL;
+
+/* the expire and snapshot thread */
+static pthread_t m_thread;
+static bool m_running = false;
+static int m_stop = 0;
+
+static void* scache_routine(void *arg);
+
+static inline struct scache_shard *shard_of(struct scache *sc,
+        const unsigned char *key, size_t ksize)
+{
+    /* mix the hash, the shard bits must not be the ones picking buckets */
+    uint32_t h = cache_hash(key, ksize) * 2654435761u;
+
+    return &sc->shards[(h >> 16) & (sc->nshards - 1)];
+}
+
+static void scache_free(struct scache *sc)
+{
+    unsigned int i;
+
+    for (i = 0; i < sc->nshards; i++) {
+        if (sc->shards[i].cd == NULL)
+            continue;
+        pthread_mutex_destroy(&sc->shards[i].lock);
+        cache_free(sc->shards[i].cd);
+    }
+    free(sc->shards);
+    free(sc->name);
+    free(sc);
+}
+
+static int snap_set(void *arg, const unsigned char *key, size_t ksize,
+                    const unsigned char *val, size_t vsize, int kind,
+                    int timeout)
+{
+    int64_t n;
+
+    if (kind == CACHE_VAL_INT) {
+        memcpy(&n, val, sizeof(n));
+        return scache_set_int((struct scache*)arg, key, ksize, n, timeout);
+    }
+
+    return scache_set((struct scache*)arg, key, ksize, val, vsize, timeout);
+}
+
+/* Reload all file.<n> there are, and set the shards to write theirs. */
+static void scache_snap_init(struct scache *sc, const char *file, int interval)
+{
+    char path[PATH_MAX];
+    double start = ne_timef();
+    unsigned int i;
+    long n;
+
+    for (i = 0; ; i++) {
+        snprintf(path, sizeof(path), "%s.%u", file, i);
+        n = cache_snap_read(path, snap_set, sc);
+        if (n < 0) break;
+        sc->snap_loaded += n;
+
+        /* of a former, larger, number of shards */
+        if (i >= sc->nshards) unlink(path);
+    }
+    sc->snap_load_ms = (ne_timef() - start) * 1000;
+    if (i > 0)
+        mtc_foo("cache %s reloaded, %zu entries in %.1fms",
+                sc->name, sc->snap_loaded, sc->snap_load_ms);
+
+    for (i = 0; i < sc->nshards; i++) {
+        snprintf(path, sizeof(path), "%s.%u", file, i);
+        if (!cache_snap_init(sc->shards[i].cd, path, interval))
+            mtc_err("cache %s snapshot %s failure", sc->name, path);
+    }
+}
+
+static NEOERR* scache_create(HDF *node, struct scache **res)
+{
+    char path[256];
+    struct scache *sc;
+    size_t numobjs, maxbytes;
+    unsigned int flags, n, i;
+    HDF *idx;
+    char *val;
+
+    *res = NULL;
+
+    snprintf(path, sizeof(path), SCACHE_CONFIG".%s", hdf_obj_name(node));
+    cache_config(path, &numobjs, &maxbytes, &flags);
+
+    n = hdf_get_int_value(node, "shards", 16);
+    if (n < 1) n = 1;
+    if (n > SCACHE_MAX_SHARDS) n = SCACHE_MAX_SHARDS;
+    for (i = 1; i < n; i <<= 1) ;
+    n = i;
+
+    sc = calloc(1, sizeof(struct scache));
+    if (sc == NULL)
+        return nerr_raise(NERR_NOMEM, "alloc scache %s", path);
+
+    sc->name = strdup(hdf_obj_name(node));
+    sc->nshards = n;
+    sc->expire_work = hdf_get_int_value(node, "expire_work", EXPIRE_WORK);
+    if (posix_memalign((void**)&sc->shards, 64,
+                       n * sizeof(struct scache_shard)) != 0) {
+        sc->shards = NULL;
+        sc->nshards = 0;
+        scache_free(sc);
+        return nerr_raise(NERR_NOMEM, "alloc scache %s shards", path);
+    }
+    memset(sc->shards, 0, n * sizeof(struct scache_shard));
+
+    for (i = 0; i < n; i++) {
+        sc->shards[i].cd = cache_create(numobjs / n ? numobjs / n : 1,
+                                        maxbytes / n, flags);
+        if (sc->shards[i].cd == NULL) {
+            scache_free(sc);
+            return nerr_raise(NERR_NOMEM, "create scache %s shard %u",
+                              path, i);
+        }
+        pthread_mutex_init(&sc->shards[i].lock, NULL);
+    }
+
+    /* all shards index the same prefixes, before the snapshot reload */
+    val = hdf_get_value(node, "index_delim", "_");
+    for (idx = hdf_get_child(node, "index_prefix"); idx;
+         idx = hdf_obj_next(idx)) {
+        for (i = 0; i < n; i++) {
+            if (*val != '\0') sc->shards[i].cd->tdelim = *val;
+            if (hdf_obj_value(idx) &&
+                !cache_tag_prefix(sc->shards[i].cd, hdf_obj_value(idx)))
+                mtc_err("cache %s index %s failure", sc->name,
+                        hdf_obj_value(idx));
+        }
+    }
+
+    if (hdf_get_value(node, "snapshot", NULL) != NULL)
+        scache_snap_init(sc, hdf_get_value(node, "snapshot", NULL),
+                         hdf_get_int_value(node, "snapshot_interval", 300));
+
+    *res = sc;
+    return STATUS_OK;
+}
+
+NEOERR* scache_init(void)
+{
+    struct scache *sc;
+    HDF *node;
+    NEOERR *err;
+
+    node = hdf_get_child(g_cfg, SCACHE_CONFIG);
+    while (node != NULL) {
+        if (scache_lookup(hdf_obj_name(node)) != NULL) {
+            mtc_warn("cache %s configured twice", hdf_obj_name(node));
+            node = hdf_obj_next(node);
+            continue;
+        }
+
+        err = scache_create(node, &sc);
+        if (err != STATUS_OK) return nerr_pass(err);
+
+        sc->next = m_caches;
+        m_caches = sc;
+        mtc_dbg("cache %s created, %u shards", sc->name, sc->nshards);
+
+        node = hdf_obj_next(node);
+    }
+
+    if (m_caches != NULL) {
+        if (pthread_create(&m_thread, NULL, scache_routine, NULL) != 0)
+            return nerr_raise(NERR_SYSTEM, "create cache expire thread");
+        m_running = true;
+    }
+
+    return STATUS_OK;
+}
+
+void scache_stop(void)
+{
+    struct scache *sc, *n;
+
+    if (m_running) {
+        __atomic_store_n(&m_stop, 1, __ATOMIC_RELEASE);
+        pthread_join(m_thread, NULL);
+        m_running = false;
+    }
+
+    for (sc = m_caches; sc != NULL; sc = n) {
+        n = sc->next;
+        for (unsigned int i = 0; i < sc->nshards; i++) {
+            if (sc->shards[i].cd->snap != NULL)
+                cache_snap_write(sc->shards[i].cd);
+        }
+        scache_free(sc);
+    }
+    m_caches = NULL;
+}
+
+struct scache* scache_lookup(const char *name)
+{
+    struct scache *sc;
+
+    if (name == NULL) return NULL;
+
+    for (sc = m_caches; sc != NULL; sc = sc->next) {
+        if (!strcmp(sc->name, name))
+            return sc;
+    }
+
+    return NULL;
+}
+
+/* Reclaim some expired entries of all caches, and go on with their
+ * snapshots, the file I/O out of the shard's lock. */
+static void scache_tick(void)
+{
+    struct scache *sc;
+    struct scache_shard *s;
+    unsigned int i;
+    bool snap;
+
+    for (sc = m_caches; sc != NULL; sc = sc->next) {
+        for (i = 0; i < sc->nshards; i++) {
+            s = &sc->shards[i];
+            snap = cache_snap_begin(s->cd);
+
+            pthread_mutex_lock(&s->lock);
+            cache_expire(s->cd, sc->expire_work / sc->nshards + 1);
+            if (snap)
+                cache_snap_fill(s->cd, CACHE_SNAP_WORK / sc->nshards + 1);
+            pthread_mutex_unlock(&s->lock);
+
+            if (snap)
+                cache_snap_flush(s->cd);
+        }
+    }
+}
+
+static void* scache_routine(void *arg)
+{
+    while (!__atomic_load_n(&m_stop, __ATOMIC_ACQUIRE)) {
+        scache_tick();
+        usleep(EXPIRE_TICK * 1000);
+    }
+
+    return NULL;
+}
+
+void scache_stats(HDF *node)
+{
+    struct scache *sc;
+    struct cache *cd;
+    size_t count, bytes, expired, evicted;
+    char key[256];
+    unsigned int i;
+
+    for (sc = m_caches; sc != NULL; sc = sc->next) {
+        count = bytes = expired = evicted = 0;
+        for (i = 0; i < sc->nshards; i++) {
+            cd = sc->shards[i].cd;
+            pthread_mutex_lock(&sc->shards[i].lock);
+            count += cd->count - cd->stale;
+            bytes += cd->bytes;
+            expired += cd->expired;
+            evicted += cd->evicted;
+            pthread_mutex_unlock(&sc->shards[i].lock);
+        }
+
+        snprintf(key, sizeof(key), "cache.%s.count", sc->name);
+        hdf_set_int_value(node, key, count);
+        snprintf(key, sizeof(key), "cache.%s.bytes", sc->name);
+        hdf_set_int_value(node, key, bytes);
+        snprintf(key, sizeof(key), "cache.%s.expired", sc->name);
+        hdf_set_int_value(node, key, expired);
+        snprintf(key, sizeof(key), "cache.%s.evicted", sc->name);
+        hdf_set_int_value(node, key, evicted);
+        snprintf(key, sizeof(key), "cache.%s.snap_loaded", sc->name);
+        hdf_set_int_value(node, key, sc->snap_loaded);
+        snprintf(key, sizeof(key), "cache.%s.snap_load_ms", sc->name);
+        hdf_set_int_value(node, key, sc->snap_load_ms);
+    }
+}
+
+int scache_get(struct scache *sc, const unsigned char *key, size_t ksize,
+               unsigned char **val, size_t *vsize)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    unsigned char *v;
+    size_t vs;
+    int rv;
+
+    *val = NULL;
+    *vsize = 0;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_get(s->cd, key, ksize, &v, &vs);
+    if (rv) {
+        /* the entry may go as soon as we unlock */
+        *val = malloc(vs ? vs : 1);
+        if (*val == NULL) {
+            rv = 0;
+        } else {
+            memcpy(*val, v, vs);
+            *vsize = vs;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+/* no copy, the lock is held only to take the reference */
+int scache_get_ref(struct scache *sc, const unsigned char *key, size_t ksize,
+                   struct cache_val **ref)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_get_ref(s->cd, key, ksize, ref);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_set(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *val, size_t vsize, int timeout)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_set(s->cd, key, ksize, val, vsize, timeout);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_del(struct scache *sc, const unsigned char *key, size_t ksize)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_del(s->cd, key, ksize);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_cas(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *oldval, size_t ovsize,
+               const unsigned char *newval, size_t nvsize)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_cas(s->cd, key, ksize, oldval, ovsize, newval, nvsize);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_incr(struct scache *sc, const unsigned char *key, size_t ksize,
+                int64_t increment, int64_t *newval)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_incr(s->cd, key, ksize, increment, newval);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_counter(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t increment, int timeout, int64_t *newval)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_counter(s->cd, key, ksize, increment, timeout, newval);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_set_int(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t num, int timeout)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_set_int(s->cd, key, ksize, num, timeout);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_get_int(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t *num)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_get_int(s->cd, key, ksize, num);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_getset_int(struct scache *sc, const unsigned char *key,
+                      size_t ksize, int64_t num, int timeout, int64_t *old)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_getset_int(s->cd, key, ksize, num, timeout, old);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+int scache_tag(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *tag, size_t tsize)
+{
+    struct scache_shard *s = shard_of(sc, key, ksize);
+    int rv;
+
+    pthread_mutex_lock(&s->lock);
+    rv = cache_tag(s->cd, key, ksize, tag, tsize);
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+/* members are spread over the shards, by their own key */
+int scache_del_tag(struct scache *sc, const unsigned char *tag, size_t tsize)
+{
+    unsigned int i;
+    int n = 0;
+
+    for (i = 0; i < sc->nshards; i++) {
+        pthread_mutex_lock(&sc->shards[i].lock);
+        n += cache_del_tag(sc->shards[i].cd, tag, tsize);
+        pthread_mutex_unlock(&sc->shards[i].lock);
+    }
+
+    return n;
+}
+
+int scache_del_prefix(struct scache *sc, const unsigned char *prefix,
+                      size_t psize)
+{
+    unsigned int i;
+    int n = 0, r;
+
+    for (i = 0; i < sc->nshards; i++) {
+        pthread_mutex_lock(&sc->shards[i].lock);
+        r = cache_del_prefix(sc->shards[i].cd, prefix, psize);
+        pthread_mutex_unlock(&sc->shards[i].lock);
+        if (r < 0) return r;
+        n += r;
+    }
+
+    return n;
+}
+
+void scache_empty(struct scache *sc)
+{
+    unsigned int i;
+
+    for (i = 0; i < sc->nshards; i++) {
+        pthread_mutex_lock(&sc->shards[i].lock);
+        cache_empty(sc->shards[i].cd);
+        pthread_mutex_unlock(&sc->shards[i].lock);
+    }
+}
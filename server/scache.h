@@ -0,0 +1,82 @@
+/*
+ * Shared caches, for all plugins. See scache.c for more information.
+ */
+#ifndef _SCACHE_H
+#define _SCACHE_H
+
+#define SCACHE_CONFIG       "Cache"
+#define SCACHE_MAX_SHARDS   256
+
+struct scache_shard {
+    pthread_mutex_t lock;
+    struct cache *cd;
+} __attribute__((aligned(64)));     /* a cache line each, no false sharing */
+
+struct scache {
+    char *name;
+    unsigned int nshards;           /* power of 2 */
+    size_t expire_work;             /* entries looked at per EXPIRE_TICK */
+
+    /* snapshot reload on start, into all shards */
+    size_t snap_loaded;
+    double snap_load_ms;
+    struct scache_shard *shards;
+    struct scache *next;
+};
+
+/*
+ * create the caches configured under Cache in g_cfg, before the plugins start,
+ * and the thread expiring them, and writing their snapshots:
+ * Cache {
+ *     session {
+ *         shards = 16
+ *         expire_work = 1024
+ *         snapshot = file, each shard to file.<shard>, reloaded on start
+ *         snapshot_interval = 300
+ *         numobjs, cache_bytes, cache_engine: for all shards, see cache.h
+ *         index_prefix, index_delim: every shard's, see cache.h
+ *     }
+ * }
+ */
+NEOERR* scache_init(void);
+/* after the plugins stopped, snapshots are written here */
+void scache_stop(void);
+/* NULL if there is no such cache */
+struct scache* scache_lookup(const char *name);
+/* cache.<name>.count, bytes, expired, evicted, snap_loaded and snap_load_ms,
+ * for all caches */
+void scache_stats(HDF *node);
+
+/*
+ * same as the cache_*() ones, but thread safe.
+ * scache_get() copies the value out, free() *val after use, scache_get_ref()
+ * holds it instead, cache_val_put() it after use.
+ */
+int scache_get(struct scache *sc, const unsigned char *key, size_t ksize,
+               unsigned char **val, size_t *vsize);
+int scache_get_ref(struct scache *sc, const unsigned char *key, size_t ksize,
+                   struct cache_val **ref);
+int scache_set(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *val, size_t vsize, int timeout);
+int scache_del(struct scache *sc, const unsigned char *key, size_t ksize);
+int scache_cas(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *oldval, size_t ovsize,
+               const unsigned char *newval, size_t nvsize);
+int scache_incr(struct scache *sc, const unsigned char *key, size_t ksize,
+                int64_t increment, int64_t *newval);
+int scache_counter(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t increment, int timeout, int64_t *newval);
+int scache_set_int(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t num, int timeout);
+int scache_get_int(struct scache *sc, const unsigned char *key, size_t ksize,
+                   int64_t *num);
+int scache_getset_int(struct scache *sc, const unsigned char *key,
+                      size_t ksize, int64_t num, int timeout, int64_t *old);
+int scache_tag(struct scache *sc, const unsigned char *key, size_t ksize,
+               const unsigned char *tag, size_t tsize);
+int scache_del_tag(struct scache *sc, const unsigned char *tag, size_t tsize);
+int scache_del_prefix(struct scache *sc, const unsigned char *prefix,
+                      size_t psize);
+void scache_empty(struct scache *sc);
+
+#endif
@@ -13,73 +13,255 @@ void sys_stats_init(struct stats *s)
     s->net_unk_req = 0;
 
     s->pro_busy = 0;
+
+    s->net_push_drop = 0;
+    s->net_slow_close = 0;
+
+    s->net_bcast_sent = 0;
+    s->net_bcast_drop = 0;
+    s->net_bcast_lat_us = 0;
+    s->net_bcast_lat_max_us = 0;
+}
+
+void sys_cache_stats(HDF *node, struct cache *cd)
+{
+    if (node == NULL || cd == NULL) return;
+
+    hdf_set_int_value(node, "cache_count", cd->count - cd->stale);
+    hdf_set_int_value(node, "cache_bytes", cd->bytes);
+    hdf_set_int_value(node, "cache_expired", cd->expired);
+    hdf_set_int_value(node, "cache_evicted", cd->evicted);
+    hdf_set_int_value(node, "cache_coalesced", cd->coalesced);
+    hdf_set_int_value(node, "cache_flushed", cd->flushed);
+    hdf_set_int_value(node, "cache_stale", cd->stale);
+
+    if (cd->snap) {
+        hdf_set_int_value(node, "cache_snap_loaded", cd->snap->loaded);
+        hdf_set_int_value(node, "cache_snap_load_ms", cd->snap->load_ms);
+        hdf_set_int_value(node, "cache_snap_write_ms", cd->snap->write_ms);
+    }
+}
+
+/* allocated on first use, lives as long as the thread */
+static __thread unsigned char *m_reply_buf = NULL;
+
+unsigned char* reply_buf(void)
+{
+    if (m_reply_buf == NULL) m_reply_buf = malloc(REPLY_BUF_LEN);
+
+    return m_reply_buf;
+}
+
+/* Reply with q->zval alone, packed around it, see sys_cmd_cache_get() */
+static int reply_zval(struct queue_entry *q, uint32_t reply)
+{
+    static const unsigned char eof[PACK_BIN_TAIL_LEN] = {0};
+    unsigned char head[PACK_BIN_HEAD_MAX];
+    struct iovec iov[3];
+    size_t hsize, vsize;
+
+    /* the '\0' isn't on the wire */
+    vsize = q->zval->size - 1;
+    hsize = pack_hdf_bin_head(VNAME_CACHE_VAL, vsize, head, sizeof(head));
+    if (hsize == 0 || hsize + vsize + PACK_BIN_TAIL_LEN > MAX_PACKET_LEN) {
+        q->req->reply_mini(q->req, REP_ERR_PACK);
+        return 0;
+    }
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = hsize;
+    iov[1].iov_base = q->zval->data;
+    iov[1].iov_len = vsize;
+    iov[2].iov_base = (void*)eof;
+    iov[2].iov_len = PACK_BIN_TAIL_LEN;
+
+    q->req->reply_iov(q->req, reply, iov, 3);
+
+    return 1;
 }
 
 int reply_trigger(struct queue_entry *q, uint32_t reply)
 {
     if (q == NULL) return 0;
 
+    /* answered later, by who parked it */
+    if (q->held) return 1;
+
+    if (q->zval != NULL) {
+        if (q->hdfsnd == NULL || hdf_obj_child(q->hdfsnd) == NULL)
+            return reply_zval(q, reply);
+
+        /* more was set since, pack it all */
+        hdf_set_value(q->hdfsnd, VNAME_CACHE_VAL, (char*)q->zval->data);
+        cache_val_put(q->zval);
+        q->zval = NULL;
+    }
+
     if (q->hdfsnd == NULL || hdf_obj_child(q->hdfsnd) == NULL) {
         q->req->reply_mini(q->req, reply);
         return 1;
     }
     
-    unsigned char *buf = calloc(1, MAX_PACKET_LEN);
+    unsigned char *buf = reply_buf();
     if (buf == NULL) {
         q->req->reply_mini(q->req, REP_ERR_MEM);
         return 0;
     }
 
+    /* packed behind the header, which reply_frame() fills in place */
     size_t vsize;
-    vsize = pack_hdf(q->hdfsnd, buf, MAX_PACKET_LEN);
+    if (q->req->flags & FLAGS_BINARY)
+        vsize = pack_hdf_bin(q->hdfsnd, buf + REPLY_HEAD_LEN, MAX_PACKET_LEN);
+    else
+        vsize = pack_hdf(q->hdfsnd, buf + REPLY_HEAD_LEN, MAX_PACKET_LEN);
     if (vsize == 0) goto error;
  
-    q->req->reply_long(q->req, reply, buf, vsize);
+    q->req->reply_frame(q->req, reply, buf, vsize);
 
-    free(buf);
     return 1;
     
  error:
     q->req->reply_mini(q->req, REP_ERR_PACK);
-    free(buf);
     return 0;
 }
 
+/* The shared cache the request names in VNAME_CACHE_NAME, NULL for the
+ * plugin's own one. */
+static NEOERR* named_cache(struct queue_entry *q, struct scache **sc)
+{
+    char *name;
+
+    *sc = NULL;
+
+    name = queue_entry_get_value(q, VNAME_CACHE_NAME, NULL);
+    if (name == NULL)
+        return STATUS_OK;
+
+    *sc = scache_lookup(name);
+    if (*sc == NULL)
+        return nerr_raise(REP_ERR_BADPARAM, "no cache %s", name);
+
+    return STATUS_OK;
+}
+
+/* The value cache_get() found, a counter is formatted in buf. */
+static char* cache_text(int kind, unsigned char *val, size_t *vsize,
+                        char *buf, size_t len)
+{
+    int64_t n;
+
+    if (kind != CACHE_VAL_INT) return (char*)val;
+
+    memcpy(&n, val, sizeof(n));
+    *vsize = snprintf(buf, len, "%lld", (long long int)n) + 1;
+
+    return buf;
+}
+
+/* Answer a get parked on a single flight, see cache_flight.c */
+static void flight_land(void *waiter, const unsigned char *val, size_t vsize)
+{
+    struct queue_entry *q = waiter;
+    uint32_t ret = REP_OK;
+
+    q->held = 0;
+
+    if (val != NULL && vsize > 0)
+        hdf_set_value(q->hdfsnd, VNAME_CACHE_VAL, (char*)val);
+    else
+        ret = REP_ERR_CACHE_MISS;
+
+    if (q->req->flags & FLAGS_SYNC)
+        reply_trigger(q, ret);
+
+    queue_entry_free(q);
+}
+
 NEOERR* sys_cmd_cache_get(struct queue_entry *q, struct cache *cd, bool reply)
 {
     unsigned char *val = NULL;
-    size_t vsize = 0;
-    char *key;
+    size_t vsize = 0, ksize;
+    char *key, *text = NULL, nbuf[24];
+    int kind = 0;
+    struct scache *sc = NULL;
+    struct cache_val *ref = NULL;
+    bool zcopy = false;
     NEOERR *err = STATUS_OK;
 
-    if (q == NULL || cd == NULL) {
+    if (q == NULL) {
         err = nerr_raise(REP_ERR, "param null");
         goto done;
     }
 
-    key = hdf_get_value(q->hdfrcv, VNAME_CACHE_KEY, NULL);
+    err = named_cache(q, &sc);
+    if (err != STATUS_OK) goto done;
+    if (sc == NULL && cd == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    key = queue_entry_get_value(q, VNAME_CACHE_KEY, NULL);
     if (!key) {
         err = nerr_raise(REP_ERR_BADPARAM, "need %s", VNAME_CACHE_KEY);
         goto done;
     }
 
-    if (!cache_get(cd, (unsigned char*)key, strlen((char*)key), &val, &vsize))
+    ksize = strlen(key);
+
+    /* a binary reply of the value alone can be sent from the cache */
+    zcopy = !reply && (q->req->flags & FLAGS_BINARY) &&
+        hdf_obj_child(q->hdfsnd) == NULL;
+
+    if (zcopy) {
+        if (sc) kind = scache_get_ref(sc, (unsigned char*)key, ksize, &ref);
+        else kind = cache_get_ref(cd, (unsigned char*)key, ksize, &ref);
+        if (kind) {
+            val = ref->data;
+            vsize = ref->size;
+        }
+    } else if (sc) {
+        kind = scache_get(sc, (unsigned char*)key, ksize, &val, &vsize);
+    } else {
+        kind = cache_get(cd, (unsigned char*)key, ksize, &val, &vsize);
+    }
+
+    if (!kind) {
+        /* the first miss goes to compute it, others wait for it's set */
+        if (!sc && !reply &&
+            cache_flight_join(cd, (unsigned char*)key, ksize,
+                              q, flight_land) == CACHE_FLIGHT_PARKED) {
+            q->held = 1;
+            return STATUS_OK;
+        }
         err = nerr_raise(REP_ERR_CACHE_MISS, "miss %s", key);
+    } else if (ref && kind == CACHE_VAL_BYTES && vsize > REPLY_ZCOPY_MIN &&
+               strnlen((char*)val, vsize) == vsize - 1) {
+        /* held till reply_trigger() sends it */
+        q->zval = ref;
+        ref = NULL;
+    } else {
+        /* counters are binary in the cache, text on the wire */
+        text = cache_text(kind, val, &vsize, nbuf, sizeof(nbuf));
+    }
 
  done:
     if (reply) {
         if (err == STATUS_OK) {
-            q->req->reply_long(q->req, reply, val, vsize);
+            q->req->reply_long(q->req, reply, (unsigned char*)text, vsize);
         } else {
             q->req->reply_mini(q->req, reply);
         }
     } else {
-        if (err == STATUS_OK && val != NULL && vsize > 0) {
+        if (err == STATUS_OK && text != NULL && vsize > 0) {
             /* if we don't reply to client, store them in replydata */
-            hdf_set_value(q->hdfsnd, VNAME_CACHE_VAL, (char*)val);
+            hdf_set_value(q->hdfsnd, VNAME_CACHE_VAL, text);
         }
     }
 
+    /* a copy, the cache's own one can't be used out of the lock */
+    if (sc && !zcopy) free(val);
+    if (ref) cache_val_put(ref);
+
     return err;
 }
 
@@ -87,30 +269,59 @@ NEOERR* sys_cmd_cache_set(struct queue_entry *q, struct cache *cd, bool reply)
 {
     char *val = NULL;
     size_t vsize = 0;
-    char *key;
+    char *key, *tags[MAX_CACHE_TAGS];
+    int ntag, i;
+    struct scache *sc = NULL;
     NEOERR *err = STATUS_OK;
 
-    if (q == NULL || cd == NULL) {
+    if (q == NULL) {
         err = nerr_raise(REP_ERR, "param null");
         goto done;
     }
 
-    key = hdf_get_value(q->hdfrcv, VNAME_CACHE_KEY, NULL);
+    err = named_cache(q, &sc);
+    if (err != STATUS_OK) goto done;
+    if (sc == NULL && cd == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    key = queue_entry_get_value(q, VNAME_CACHE_KEY, NULL);
     if (!key) {
         err = nerr_raise(REP_ERR_BADPARAM, "need %s", VNAME_CACHE_KEY);
         goto done;
     }
 
-    HDF *node = hdf_get_obj(q->hdfrcv, VNAME_CACHE_VAL);
-    if (!node) {
+    val = queue_entry_get_value(q, VNAME_CACHE_VAL, NULL);
+    if (!val) {
         err = nerr_raise(REP_ERR_BADPARAM, "need %s", VNAME_CACHE_VAL);
         goto done;
     }
     
-    val = hdf_obj_value(node);
     vsize = strlen(val)+1;
-    cache_set(cd, (unsigned char*)key, strlen((char*)key),
-              (unsigned char*)val, vsize, 0);
+    if (sc)
+        scache_set(sc, (unsigned char*)key, strlen(key),
+                   (unsigned char*)val, vsize, 0);
+    else
+        cache_set(cd, (unsigned char*)key, strlen(key),
+                  (unsigned char*)val, vsize, 0);
+
+    /* and it's tags, for REQ_CMD_CACHE_DEL_TAG */
+    ntag = queue_entry_get_list(q, VNAME_CACHE_TAGS, tags, MAX_CACHE_TAGS);
+    if (ntag < 0) {
+        err = nerr_raise(REP_ERR_BADPARAM, "%s more than %d",
+                         VNAME_CACHE_TAGS, MAX_CACHE_TAGS);
+        goto done;
+    }
+    for (i = 0; i < ntag; i++) {
+        if (tags[i] == NULL) continue;
+        if (sc)
+            scache_tag(sc, (unsigned char*)key, strlen(key),
+                       (unsigned char*)tags[i], strlen(tags[i]));
+        else
+            cache_tag(cd, (unsigned char*)key, strlen(key),
+                      (unsigned char*)tags[i], strlen(tags[i]));
+    }
 
  done:
     if (reply) {
@@ -124,19 +335,28 @@ NEOERR* sys_cmd_cache_set(struct queue_entry *q, struct cache *cd, bool reply)
 NEOERR* sys_cmd_cache_del(struct queue_entry *q, struct cache *cd, bool reply)
 {
     char *key;
+    struct scache *sc = NULL;
     NEOERR *err = STATUS_OK;
 
-    if (q == NULL || cd == NULL) {
+    if (q == NULL) {
         err = nerr_raise(REP_ERR, "param null");
         goto done;
     }
 
-    key = hdf_get_value(q->hdfrcv, VNAME_CACHE_KEY, NULL);
+    err = named_cache(q, &sc);
+    if (err != STATUS_OK) goto done;
+    if (sc == NULL && cd == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    key = queue_entry_get_value(q, VNAME_CACHE_KEY, NULL);
     if (!key) {
         err = nerr_raise(REP_ERR_BADPARAM, "need %s", VNAME_CACHE_KEY);
         goto done;
     }
-    cache_del(cd, (unsigned char*)key, strlen(key));
+    if (sc) scache_del(sc, (unsigned char*)key, strlen(key));
+    else cache_del(cd, (unsigned char*)key, strlen(key));
 
  done:
     if (reply) {
@@ -148,21 +368,28 @@ NEOERR* sys_cmd_cache_del(struct queue_entry *q, struct cache *cd, bool reply)
 
 NEOERR* sys_cmd_cache_empty(struct queue_entry *q, struct cache **cd, bool reply)
 {
+    struct scache *sc = NULL;
     NEOERR *err = STATUS_OK;
-    size_t num;
 
-    if (q == NULL || cd == NULL || *cd == NULL) {
+    if (q == NULL) {
         err = nerr_raise(REP_ERR, "param null");
         goto done;
     }
 
-    
-    struct cache *oldcd = *cd;
-    
-    num = oldcd->numobjs;
-    if (oldcd) cache_free(oldcd);
+    err = named_cache(q, &sc);
+    if (err != STATUS_OK) goto done;
+    if (sc) {
+        scache_empty(sc);
+        goto done;
+    }
 
-    *cd = cache_create(num, 0);
+    if (cd == NULL || *cd == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    /* keeps the budget and flags it was created with */
+    cache_empty(*cd);
     
  done:
     if (reply) {
@@ -171,3 +398,201 @@ NEOERR* sys_cmd_cache_empty(struct queue_entry *q, struct cache **cd, bool reply
 
     return err;
 }
+
+/*
+ * delete all entries of an index prefix (VNAME_CACHE_KEY), or a tag
+ * (VNAME_CACHE_TAG), see cache_tag.c
+ */
+static NEOERR* cache_drop(struct queue_entry *q, struct cache *cd,
+                          bool reply, bool prefix)
+{
+    char *name;
+    struct scache *sc = NULL;
+    int deleted = 0;
+    NEOERR *err = STATUS_OK;
+
+    if (q == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    err = named_cache(q, &sc);
+    if (err != STATUS_OK) goto done;
+    if (sc == NULL && cd == NULL) {
+        err = nerr_raise(REP_ERR, "param null");
+        goto done;
+    }
+
+    name = queue_entry_get_value(q, prefix ? VNAME_CACHE_KEY : VNAME_CACHE_TAG,
+                                 NULL);
+    if (!name) {
+        err = nerr_raise(REP_ERR_BADPARAM, "need %s",
+                         prefix ? VNAME_CACHE_KEY : VNAME_CACHE_TAG);
+        goto done;
+    }
+
+    if (prefix) {
+        deleted = sc ?
+            scache_del_prefix(sc, (unsigned char*)name, strlen(name)) :
+            cache_del_prefix(cd, (unsigned char*)name, strlen(name));
+        if (deleted < 0) {
+            err = nerr_raise(REP_ERR_BADPARAM, "%s not indexed", name);
+            goto done;
+        }
+    } else {
+        deleted = sc ?
+            scache_del_tag(sc, (unsigned char*)name, strlen(name)) :
+            cache_del_tag(cd, (unsigned char*)name, strlen(name));
+    }
+
+    hdf_set_int_value(q->hdfsnd, VNAME_CACHE_NUM, deleted);
+
+ done:
+    if (reply) {
+        if (err == STATUS_OK) reply_trigger(q, REP_OK);
+        else q->req->reply_mini(q->req, REP_ERR);
+    }
+
+    return err;
+}
+
+NEOERR* sys_cmd_cache_del_prefix(struct queue_entry *q, struct cache *cd,
+                                 bool reply)
+{
+    return cache_drop(q, cd, reply, true);
+}
+
+NEOERR* sys_cmd_cache_del_tag(struct queue_entry *q, struct cache *cd,
+                              bool reply)
+{
+    return cache_drop(q, cd, reply, false);
+}
+
+/* The cache, and the keys, of a multi key command. */
+static NEOERR* multi_keys(struct queue_entry *q, struct cache *cd,
+                          struct scache **sc, char **keys, int *num)
+{
+    NEOERR *err;
+
+    if (q == NULL)
+        return nerr_raise(REP_ERR, "param null");
+
+    err = named_cache(q, sc);
+    if (err != STATUS_OK) return nerr_pass(err);
+    if (*sc == NULL && cd == NULL)
+        return nerr_raise(REP_ERR, "param null");
+
+    *num = queue_entry_get_list(q, VNAME_CACHE_KEYS, keys, MAX_CACHE_MULTI);
+    if (*num < 0)
+        return nerr_raise(REP_ERR_BADPARAM, "%s more than %d",
+                          VNAME_CACHE_KEYS, MAX_CACHE_MULTI);
+    if (*num == 0)
+        return nerr_raise(REP_ERR_BADPARAM, "need %s", VNAME_CACHE_KEYS);
+
+    return STATUS_OK;
+}
+
+NEOERR* sys_cmd_cache_mget(struct queue_entry *q, struct cache *cd, bool reply)
+{
+    char *keys[MAX_CACHE_MULTI], name[64], nbuf[24];
+    unsigned char *val;
+    size_t vsize;
+    struct scache *sc = NULL;
+    int num, i, hit;
+    NEOERR *err;
+
+    err = multi_keys(q, cd, &sc, keys, &num);
+    if (err != STATUS_OK) goto done;
+
+    for (i = 0; i < num; i++) {
+        if (keys[i] == NULL) continue;
+
+        if (sc)
+            hit = scache_get(sc, (unsigned char*)keys[i], strlen(keys[i]),
+                             &val, &vsize);
+        else
+            hit = cache_get(cd, (unsigned char*)keys[i], strlen(keys[i]),
+                            &val, &vsize);
+        if (!hit) continue;
+
+        /* by index, keys may have '.' in them */
+        if (vsize > 0) {
+            snprintf(name, sizeof(name), VNAME_CACHE_VALS".%d", i);
+            hdf_set_value(q->hdfsnd, name,
+                          cache_text(hit, val, &vsize, nbuf, sizeof(nbuf)));
+        }
+        if (sc) free(val);
+    }
+
+ done:
+    if (reply) {
+        if (err == STATUS_OK) reply_trigger(q, REP_OK);
+        else q->req->reply_mini(q->req, REP_ERR);
+    }
+
+    return err;
+}
+
+NEOERR* sys_cmd_cache_mset(struct queue_entry *q, struct cache *cd, bool reply)
+{
+    char *keys[MAX_CACHE_MULTI], *vals[MAX_CACHE_MULTI];
+    struct scache *sc = NULL;
+    int num, i;
+    NEOERR *err;
+
+    err = multi_keys(q, cd, &sc, keys, &num);
+    if (err != STATUS_OK) goto done;
+
+    if (queue_entry_get_list(q, VNAME_CACHE_VALS, vals, MAX_CACHE_MULTI) != num) {
+        err = nerr_raise(REP_ERR_BADPARAM, "need %d %s", num, VNAME_CACHE_VALS);
+        goto done;
+    }
+
+    for (i = 0; i < num; i++) {
+        if (keys[i] == NULL || vals[i] == NULL) continue;
+
+        if (sc)
+            scache_set(sc, (unsigned char*)keys[i], strlen(keys[i]),
+                       (unsigned char*)vals[i], strlen(vals[i])+1, 0);
+        else
+            cache_set(cd, (unsigned char*)keys[i], strlen(keys[i]),
+                      (unsigned char*)vals[i], strlen(vals[i])+1, 0);
+    }
+
+ done:
+    if (reply) {
+        q->req->reply_mini(q->req, err == STATUS_OK ? REP_OK : REP_ERR);
+    }
+
+    return err;
+}
+
+NEOERR* sys_cmd_cache_mdel(struct queue_entry *q, struct cache *cd, bool reply)
+{
+    char *keys[MAX_CACHE_MULTI];
+    struct scache *sc = NULL;
+    int num, i, deleted = 0;
+    NEOERR *err;
+
+    err = multi_keys(q, cd, &sc, keys, &num);
+    if (err != STATUS_OK) goto done;
+
+    for (i = 0; i < num; i++) {
+        if (keys[i] == NULL) continue;
+
+        if (sc)
+            deleted += scache_del(sc, (unsigned char*)keys[i], strlen(keys[i]));
+        else
+            deleted += cache_del(cd, (unsigned char*)keys[i], strlen(keys[i]));
+    }
+
+    hdf_set_int_value(q->hdfsnd, VNAME_CACHE_NUM, deleted);
+
+ done:
+    if (reply) {
+        if (err == STATUS_OK) reply_trigger(q, REP_OK);
+        else q->req->reply_mini(q->req, REP_ERR);
+    }
+
+    return err;
+}
@@ -13,12 +13,42 @@ struct stats {
     unsigned long net_unk_req;
 
     unsigned long pro_busy;
+
+    /* these two and net_bcast_drop are bumped by app threads, atomically */
+    unsigned long net_push_drop;        /* 10 */
+    unsigned long net_slow_close;
+
+    unsigned long net_bcast_sent;       /* broadcast recipients sent to */
+    unsigned long net_bcast_drop;       /* and skipped, gone or too slow */
+    unsigned long net_bcast_lat_us;     /* sum of their queued to sent time */
+    unsigned long net_bcast_lat_max_us;
 };
 
 #define STATS_REPLY_SIZE 8
-#define VNAME_CACHE_KEY    "cachekey"         /* DATA_TYPE_STRING */
-#define VNAME_CACHE_VAL    "cacheval"      /* DATA_TYPE_ANY */
 
+/*
+ * replies are packed REPLY_HEAD_LEN bytes into a buffer, and the header is
+ * written in front of them by req->reply_frame(), with no copy.
+ * reply_buf() returns the calling thread's one, of REPLY_BUF_LEN bytes, it's
+ * reused by the next reply of the thread.
+ */
+#define REPLY_HEAD_LEN   16
+#define REPLY_BUF_LEN    (2 * (REPLY_HEAD_LEN + MAX_PACKET_LEN))
+/*
+ * a binary reply of a cached value alone is sent from the cache, with
+ * req->reply_iov(), if it's longer than this. Shorter ones are cheaper to
+ * copy, and may be packed as numbers.
+ */
+#define REPLY_ZCOPY_MIN  64
+/* keys of one REQ_CMD_CACHE_MGET, MSET or MDEL */
+#define MAX_CACHE_MULTI    1024
+/* tags of one REQ_CMD_CACHE_SET */
+#define MAX_CACHE_TAGS     16
+
+/*
+ * cd is the plugin's own cache (event_entry.cache), not thread safe: it's
+ * only there on a plugin with one op thread, see DRIVER_F_MULTI_THREAD
+ */
 #define CASE_SYS_CMD(cmd, q, cd, err)               \
     {                                               \
     case REQ_CMD_CACHE_GET:                         \
@@ -30,17 +60,53 @@ struct stats {
     case REQ_CMD_CACHE_DEL:                         \
         err = sys_cmd_cache_del(q, cd, false);      \
         break;                                      \
+    case REQ_CMD_CACHE_DEL_PREFIX:                  \
+        err = sys_cmd_cache_del_prefix(q, cd, false); \
+        break;                                      \
+    case REQ_CMD_CACHE_DEL_TAG:                     \
+        err = sys_cmd_cache_del_tag(q, cd, false);  \
+        break;                                      \
     case REQ_CMD_CACHE_EMPTY:                       \
         err = sys_cmd_cache_empty(q, &cd, false);   \
         break;                                      \
+    case REQ_CMD_CACHE_MGET:                        \
+        err = sys_cmd_cache_mget(q, cd, false);     \
+        break;                                      \
+    case REQ_CMD_CACHE_MSET:                        \
+        err = sys_cmd_cache_mset(q, cd, false);     \
+        break;                                      \
+    case REQ_CMD_CACHE_MDEL:                        \
+        err = sys_cmd_cache_mdel(q, cd, false);     \
+        break;                                      \
     }
         
 void sys_stats_init(struct stats *s);
+/* cache_count, bytes, expired, evicted and snapshot ones, for REQ_CMD_STATS */
+void sys_cache_stats(HDF *node, struct cache *cd);
 int  reply_trigger(struct queue_entry *q, uint32_t reply);
+unsigned char* reply_buf(void);
 
 NEOERR* sys_cmd_cache_get(struct queue_entry *q, struct cache *cd, bool reply);
 NEOERR* sys_cmd_cache_set(struct queue_entry *q, struct cache *cd, bool reply);
 NEOERR* sys_cmd_cache_del(struct queue_entry *q, struct cache *cd, bool reply);
 NEOERR* sys_cmd_cache_empty(struct queue_entry *q, struct cache **cd, bool reply);
+/*
+ * delete all entries whose key has the indexed prefix VNAME_CACHE_KEY, or
+ * in tag VNAME_CACHE_TAG (given by VNAME_CACHE_TAGS of REQ_CMD_CACHE_SET).
+ * the number deleted as VNAME_CACHE_NUM
+ */
+NEOERR* sys_cmd_cache_del_prefix(struct queue_entry *q, struct cache *cd,
+                                 bool reply);
+NEOERR* sys_cmd_cache_del_tag(struct queue_entry *q, struct cache *cd,
+                              bool reply);
+/*
+ * one request for many keys, VNAME_CACHE_KEYS.0, 1... (and VNAME_CACHE_VALS.n
+ * for each key of mset), done in one pass.
+ * mget: the value of key n as VNAME_CACHE_VALS.n, absent on miss
+ * mdel: the number of keys deleted as VNAME_CACHE_NUM
+ */
+NEOERR* sys_cmd_cache_mget(struct queue_entry *q, struct cache *cd, bool reply);
+NEOERR* sys_cmd_cache_mset(struct queue_entry *q, struct cache *cd, bool reply);
+NEOERR* sys_cmd_cache_mdel(struct queue_entry *q, struct cache *cd, bool reply);
 
 #endif  /* __SYS_CMD_H__ */
@@ -2,36 +2,248 @@
 #include "lheads.h"
 
 static void tcp_recv(int fd, short event, void *arg);
-static void process_buf(struct tcp_socket *tcpsock,
+static void tcp_send(int fd, short event, void *arg);
+static int process_buf(struct tcp_socket *tcpsock,
         unsigned char *buf, size_t len);
+static void sock_rbuf_put(struct tcp_socket *tcpsock);
+static void conn_release(struct tcp_socket *tcpsock);
 
 static void tcp_reply_mini(const struct req_info *req, uint32_t reply);
 static void tcp_reply_err(const struct req_info *req, uint32_t reply);
 static void tcp_reply_long(const struct req_info *req, uint32_t reply,
         unsigned char *val, size_t vsize);
+static void tcp_reply_frame(const struct req_info *req, uint32_t reply,
+        unsigned char *buf, size_t vsize);
+static void tcp_reply_iov(const struct req_info *req, uint32_t reply,
+        const struct iovec *iov, int n);
+
+
+/* Default watermarks of the per connection output queue. Above the high
+ * one, pushes to the client are dropped until the queue drains below the low
+ * one; a reply which can't fit in closes the connection. */
+#define WBUF_LOW_DEFAULT    (256 * 1024)
+#define WBUF_HIGH_DEFAULT   (1024 * 1024)
+
+static size_t m_wbuf_low = WBUF_LOW_DEFAULT;
+static size_t m_wbuf_high = WBUF_HIGH_DEFAULT;
+
+/* Output buffers sent by one sendmsg() on EV_WRITE. */
+#define OUTQ_BATCH          16
 
 
 /*
  * Miscelaneous helper functions
  */
 
+struct tcp_shbuf *tcp_shbuf_new(size_t len)
+{
+    struct tcp_shbuf *sb;
+
+    sb = malloc(sizeof(struct tcp_shbuf) + len);
+    if (sb == NULL)
+        return NULL;
+    sb->refcount = 1;
+    sb->born = ne_timef();
+    sb->len = len;
+
+    return sb;
+}
+
+struct tcp_shbuf *tcp_shbuf_trim(struct tcp_shbuf *sb, size_t len)
+{
+    struct tcp_shbuf *n;
+
+    /* keep the larger one if it can't shrink */
+    n = realloc(sb, sizeof(struct tcp_shbuf) + len);
+    if (n == NULL)
+        n = sb;
+    n->len = len;
+
+    return n;
+}
+
+void tcp_shbuf_put(struct tcp_shbuf *sb)
+{
+    if (sb == NULL) return;
+
+    if (__sync_sub_and_fetch(&sb->refcount, 1) == 0)
+        free(sb);
+}
+
+static void outbuf_free(struct tcp_outbuf *o)
+{
+    if (o->shared) tcp_shbuf_put(o->shared);
+    else free(o->buf);
+    free(o);
+}
+
+/* Free all pending output buffers. Called with wlock held. */
+static void outq_free(struct tcp_socket *tcpsock)
+{
+    struct tcp_outbuf *o, *n;
+
+    o = tcpsock->ohead;
+    while (o != NULL) {
+        n = o->next;
+        outbuf_free(o);
+        o = n;
+    }
+    tcpsock->ohead = tcpsock->otail = NULL;
+    tcpsock->osize = 0;
+}
+
+/* Link o at the end of the output queue. Called with wlock held. */
+static void outq_push(struct tcp_socket *tcpsock, struct tcp_outbuf *o)
+{
+    o->next = NULL;
+    if (tcpsock->otail == NULL) {
+        tcpsock->ohead = tcpsock->otail = o;
+    } else {
+        tcpsock->otail->next = o;
+        tcpsock->otail = o;
+    }
+    tcpsock->osize += o->len - o->pos;
+}
+
+/* Append the unsent part of a message, from byte c of iov on, to the output
+ * queue, in one buffer. Called with wlock held. Returns 1 if success, 0 if
+ * memory error. */
+static int outq_append(struct tcp_socket *tcpsock,
+                       const struct iovec *iov, int n, size_t c)
+{
+    struct tcp_outbuf *o;
+    size_t len = 0, l;
+    int i;
+
+    for (i = 0; i < n; i++)
+        len += iov[i].iov_len;
+    len -= c;
+
+    o = malloc(sizeof(struct tcp_outbuf));
+    if (o == NULL)
+        return 0;
+
+    o->buf = malloc(len);
+    if (o->buf == NULL) {
+        free(o);
+        return 0;
+    }
+    o->len = 0;
+    for (i = 0; i < n; i++) {
+        l = iov[i].iov_len;
+        if (c >= l) {
+            c -= l;
+            continue;
+        }
+        memcpy(o->buf + o->len, (unsigned char*)iov[i].iov_base + c, l - c);
+        o->len += l - c;
+        c = 0;
+    }
+    o->pos = 0;
+    o->shared = NULL;
+
+    outq_push(tcpsock, o);
+
+    return 1;
+}
+
+/* A broadcast got out to one of it's recipients, record how long it took. */
+static void bcast_sent(struct tcp_socket *tcpsock, struct tcp_shbuf *sb,
+                       double now)
+{
+    struct stats *st = &tcpsock->reactor->st;
+    unsigned long us;
+
+    us = now > sb->born ? (now - sb->born) * 1000000 : 0;
+
+    st->net_bcast_sent++;
+    st->net_bcast_lat_us += us;
+    if (us > st->net_bcast_lat_max_us)
+        st->net_bcast_lat_max_us = us;
+}
+
+/* Send as much of the output queue as the socket takes, OUTQ_BATCH buffers
+ * at a time. Called with wlock held. Returns 0 if the socket is full or the
+ * queue is empty, -1 on error. */
+static int outq_flush(struct tcp_socket *tcpsock)
+{
+    struct iovec iov[OUTQ_BATCH];
+    struct msghdr msg;
+    struct tcp_outbuf *o;
+    double now = 0;
+    ssize_t rv;
+    size_t l;
+    int n;
+
+    while (tcpsock->ohead != NULL) {
+        n = 0;
+        for (o = tcpsock->ohead; o != NULL && n < OUTQ_BATCH; o = o->next) {
+            iov[n].iov_base = o->buf + o->pos;
+            iov[n].iov_len = o->len - o->pos;
+            n++;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        rv = sendmsg(tcpsock->fd, &msg, MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        tcpsock->osize -= rv;
+        while ((o = tcpsock->ohead) != NULL) {
+            l = o->len - o->pos;
+            if ((size_t)rv < l) {
+                o->pos += rv;
+                break;
+            }
+            rv -= l;
+
+            tcpsock->ohead = o->next;
+            if (o->shared) {
+                if (now == 0) now = ne_timef();
+                bcast_sent(tcpsock, o->shared, now);
+            }
+            outbuf_free(o);
+        }
+        if (tcpsock->ohead == NULL)
+            tcpsock->otail = NULL;
+    }
+
+    if (tcpsock->throttled && tcpsock->osize <= m_wbuf_low)
+        tcpsock->throttled = false;
+
+    return 0;
+}
+
 void tcp_socket_free(struct tcp_socket *tcpsock)
 {
     if (!tcpsock) return;
     
     //mtc_dbg("destroy tcpsock %d", tcpsock->fd);
     
+    /* they're in tcpsock, only make sure they aren't pending */
+    event_del(tcpsock->evt);
+    event_del(tcpsock->wevt);
+
+    pthread_mutex_lock(&tcpsock->wlock);
     if (tcpsock->fd > 0) {
         close(tcpsock->fd);
         tcpsock->fd = -1;
     }
-    if (tcpsock->evt) {
-        event_del(tcpsock->evt);
-        free(tcpsock->evt);
-        tcpsock->evt = NULL;
-    }
-    if (tcpsock->buf)
+    outq_free(tcpsock);
+    pthread_mutex_unlock(&tcpsock->wlock);
+
+    if (tcpsock->buf && tcpsock->buf != tcpsock->ibuf) {
+        /* not on the reactor's thread, don't touch it's free lists */
+        __sync_fetch_and_sub(&tcpsock->reactor->pool.inuse, tcpsock->bufsize);
         free(tcpsock->buf);
+    }
     if (tcpsock->on_close) {
         tcpsock->on_close(tcpsock->appdata);
         /*
@@ -40,7 +252,213 @@ void tcp_socket_free(struct tcp_socket *tcpsock)
         tcpsock->on_close = NULL;
         tcpsock->appdata = NULL;
     }
-    free(tcpsock);
+    pthread_mutex_destroy(&tcpsock->wlock);
+    __sync_fetch_and_sub(&tcpsock->reactor->numconns, 1);
+    conn_release(tcpsock);
+}
+
+/* Close the connection from the main thread. The memory will be released by
+ * the last tcp_socket_remove_ref(), app threads may still hold one. */
+static void tcp_socket_close(struct tcp_socket *tcpsock)
+{
+    pthread_mutex_lock(&tcpsock->wlock);
+    if (tcpsock->fd < 0) {
+        /* avoid duplicate remove_ref() */
+        pthread_mutex_unlock(&tcpsock->wlock);
+        return;
+    }
+    close(tcpsock->fd);
+    tcpsock->fd = -1;
+    outq_free(tcpsock);
+    pthread_mutex_unlock(&tcpsock->wlock);
+
+    if (tcpsock->buf)
+        sock_rbuf_put(tcpsock);
+
+    event_del(tcpsock->evt);
+    event_del(tcpsock->wevt);
+    tcp_socket_remove_ref(tcpsock);
+}
+
+/* The part of iov from byte c on, in out, returns it's count. */
+static int iov_skip(const struct iovec *iov, int n, size_t c,
+                    struct iovec *out)
+{
+    int i, m = 0;
+
+    for (i = 0; i < n; i++) {
+        if (c >= iov[i].iov_len) {
+            c -= iov[i].iov_len;
+            continue;
+        }
+        out[m].iov_base = (unsigned char*)iov[i].iov_base + c;
+        out[m].iov_len = iov[i].iov_len - c;
+        m++;
+        c = 0;
+    }
+
+    return m;
+}
+
+int tcp_socket_send(struct tcp_socket *tcpsock, const unsigned char *buf,
+                    size_t size, bool droppable)
+{
+    struct iovec iov;
+
+    if (buf == NULL)
+        return 0;
+
+    iov.iov_base = (void*)buf;
+    iov.iov_len = size;
+
+    return tcp_socket_sendv(tcpsock, &iov, 1, droppable);
+}
+
+int tcp_socket_sendv(struct tcp_socket *tcpsock, const struct iovec *iov,
+                     int n, bool droppable)
+{
+    struct iovec left[TCP_IOV_MAX];
+    struct msghdr msg;
+    ssize_t rv;
+    size_t c = 0, size = 0;
+    int ret = 1, i;
+
+    if (tcpsock == NULL || iov == NULL || n <= 0 || n > TCP_IOV_MAX)
+        return 0;
+
+    for (i = 0; i < n; i++) {
+        MSG_DUMP("send: ", iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&tcpsock->wlock);
+
+    if (tcpsock->fd < 0) {
+        ret = 0;
+        goto done;
+    }
+
+    if (droppable && tcpsock->throttled) {
+        __atomic_fetch_add(&tcpsock->reactor->st.net_push_drop, 1,
+                           __ATOMIC_RELAXED);
+        ret = 0;
+        goto done;
+    }
+
+    if (tcpsock->ohead == NULL) {
+        /* Nothing pending, try to send it right now. With big packets,
+         * or a client which stopped reading, the receiver window gets
+         * exhausted and send() returns EAGAIN on our non-blocking fd;
+         * the rest will be sent on EV_WRITE. */
+        while (c < size) {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = left;
+            msg.msg_iovlen = iov_skip(iov, n, c, left);
+            rv = sendmsg(tcpsock->fd, &msg, MSG_NOSIGNAL);
+            if (rv < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                /* let the main thread see the error and close it */
+                shutdown(tcpsock->fd, SHUT_RDWR);
+                ret = 0;
+                goto done;
+            }
+            c += rv;
+        }
+        if (c == size)
+            goto done;
+    }
+
+    if (tcpsock->osize + (size - c) > m_wbuf_high) {
+        /* slow consumer */
+        if (droppable) {
+            tcpsock->throttled = true;
+            if (c == 0) {
+                __atomic_fetch_add(&tcpsock->reactor->st.net_push_drop, 1,
+                                   __ATOMIC_RELAXED);
+                ret = 0;
+                goto done;
+            }
+        } else {
+            mtc_warn("%d output queue exceed %zu, close it",
+                     tcpsock->fd, tcpsock->osize);
+            __atomic_fetch_add(&tcpsock->reactor->st.net_slow_close, 1,
+                               __ATOMIC_RELAXED);
+            shutdown(tcpsock->fd, SHUT_RDWR);
+            ret = 0;
+            goto done;
+        }
+    }
+
+    if (!outq_append(tcpsock, iov, n, c)) {
+        shutdown(tcpsock->fd, SHUT_RDWR);
+        ret = 0;
+        goto done;
+    }
+    event_add(tcpsock->wevt, NULL);
+
+done:
+    pthread_mutex_unlock(&tcpsock->wlock);
+    return ret;
+}
+
+int tcp_broadcast(struct tcp_shbuf *sb, const unsigned char *buf, size_t len,
+                  struct tcp_socket **socks, int n)
+{
+    struct tcp_socket *tcpsock;
+    struct tcp_outbuf *o;
+    int i, queued = 0;
+    bool idle;
+
+    if (sb == NULL || buf == NULL || len == 0 || socks == NULL)
+        return 0;
+
+    MSG_DUMP("bcast: ", buf, len);
+
+    for (i = 0; i < n; i++) {
+        tcpsock = socks[i];
+        if (tcpsock == NULL)
+            continue;
+
+        pthread_mutex_lock(&tcpsock->wlock);
+
+        if (tcpsock->fd < 0 || tcpsock->throttled ||
+            tcpsock->osize + len > m_wbuf_high) {
+            /* gone, or a slow consumer */
+            if (tcpsock->fd >= 0)
+                tcpsock->throttled = true;
+            __atomic_fetch_add(&tcpsock->reactor->st.net_bcast_drop, 1,
+                               __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&tcpsock->wlock);
+            continue;
+        }
+
+        o = malloc(sizeof(struct tcp_outbuf));
+        if (o == NULL) {
+            __atomic_fetch_add(&tcpsock->reactor->st.net_bcast_drop, 1,
+                               __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&tcpsock->wlock);
+            continue;
+        }
+        o->buf = (unsigned char*)buf;
+        o->len = len;
+        o->pos = 0;
+        o->shared = sb;
+        __sync_fetch_and_add(&sb->refcount, 1);
+
+        /* the write event is pending already if the queue isn't empty */
+        idle = tcpsock->ohead == NULL;
+        outq_push(tcpsock, o);
+        if (idle)
+            event_add(tcpsock->wevt, NULL);
+
+        pthread_mutex_unlock(&tcpsock->wlock);
+        queued++;
+    }
+
+    return queued;
 }
 
 static void init_req(struct tcp_socket *tcpsock)
@@ -52,6 +470,8 @@ static void init_req(struct tcp_socket *tcpsock)
     tcpsock->req.reply_mini = tcp_reply_mini;
     tcpsock->req.reply_err = tcp_reply_err;
     tcpsock->req.reply_long = tcp_reply_long;
+    tcpsock->req.reply_frame = tcp_reply_frame;
+    tcpsock->req.reply_iov = tcp_reply_iov;
 
     tcpsock->req.tcpsock = tcpsock;
 }
@@ -70,59 +490,59 @@ static void rep_send_error(const struct req_info *req, const unsigned int code)
     memcpy(minibuf + 8, &r, 4);
     memcpy(minibuf + 12, &c, 4);
 
-    MSG_DUMP("send: ",  minibuf, 4 * 4);
-    
     /* If this send fails, there's nothing to be done */
-    r = send(req->fd, minibuf, 4 * 4, MSG_NOSIGNAL);
-
-    if (r < 0) {
+    if (!tcp_socket_send(req->tcpsock, minibuf, 4 * 4, false)) {
         mtc_err("rep_send_error() failed");
     }
 }
 
 
-static void tcp_reply_mini(const struct req_info *req, uint32_t reply);
+static int rep_sendv(const struct req_info *req, const struct iovec *iov,
+        int n)
+{
+    /* The reply is sent, or queued on the tcp socket and flushed by the
+     * main thread when the fd becomes writable. Never block or spin on the
+     * app thread here. */
+    if (!tcp_socket_sendv(req->tcpsock, iov, n, false)) {
+        mtc_err("send to %d failure", req->fd);
+        return 0;
+    }
+
+    return 1;
+}
+
 static int rep_send(const struct req_info *req, const unsigned char *buf,
         const size_t size)
 {
-    ssize_t rv, c;
+    struct iovec iov;
 
-    MSG_DUMP("send: ",  buf, size);
-    
-    c = 0;
-    while (c < size) {
-        rv = send(req->fd, buf + c, size - c, MSG_NOSIGNAL);
-
-        if (rv == size) {
-            return 1;
-        } else if (rv < 0) {
-            if (errno != EAGAIN || errno != EWOULDBLOCK) {
-                rep_send_error(req, REP_ERR_SEND);
-                /* tcp_reply_mini will call rep_send(), cause core dump */
-                //tcp_reply_mini(req, REP_ERR_SEND);
-                return 0;
-            } else {
-                /* With big packets, the receiver window might
-                 * get exhausted and send() would block, but
-                 * as the fd is set in non-blocking mode, it
-                 * returns EAGAIN. This makes us to retry when
-                 * send() fails in this way.
-                 *
-                 * The proper way to fix this would be to add
-                 * an event so we get notified when the fd is
-                 * available for writing, and retry the send;
-                 * but this is complex so leave it for when
-                 * it's really needed. */
-                continue;
-            }
-        } else if (rv == 0) {
-            return 1;
-        }
+    iov.iov_base = (void*)buf;
+    iov.iov_len = size;
 
-        c += rv;
-    }
+    return rep_sendv(req, &iov, 1);
+}
 
-    return 1;
+/* Write the header of a reply with a vsize bytes value in head, id is in
+ * network byte order already. */
+static void rep_head(unsigned char *head, uint32_t id, uint32_t reply,
+        size_t vsize)
+{
+    uint32_t t;
+
+    /* The reply length is:
+     * 4        total length
+     * 4        id
+     * 4        reply code
+     * 4        vsize
+     * vsize    val
+     */
+    t = htonl(REPLY_HEAD_LEN + vsize);
+    memcpy(head, &t, 4);
+    memcpy(head + 4, &id, 4);
+    t = htonl(reply);
+    memcpy(head + 8, &t, 4);
+    t = htonl(vsize);
+    memcpy(head + 12, &t, 4);
 }
 
 
@@ -149,44 +569,77 @@ static void tcp_reply_err(const struct req_info *req, uint32_t reply)
     rep_send_error(req, reply);
 }
 
+/* The header is on the stack, and val is sent from where it is. */
 static void tcp_reply_long(const struct req_info *req, uint32_t reply,
             unsigned char *val, size_t vsize)
 {
+    struct iovec iov;
+
     if (val == NULL) {
         /* miss */
         tcp_reply_mini(req, reply);
-    } else {
-        unsigned char *buf;
-        size_t bsize;
-        uint32_t t;
-
-        reply = htonl(reply);
-
-        /* The reply length is:
-         * 4        total length
-         * 4        id
-         * 4        reply code
-         * 4        vsize
-         * vsize    val
-         */
-        bsize = 4 + 4 + 4 + 4 + vsize;
-        buf = malloc(bsize);
+        return;
+    }
 
-        t = htonl(bsize);
-        memcpy(buf, &t, 4);
+    iov.iov_base = val;
+    iov.iov_len = vsize;
+    tcp_reply_iov(req, reply, &iov, 1);
+}
 
-        memcpy(buf + 4, &(req->id), 4);
-        memcpy(buf + 8, &reply, 4);
+/* Send a reply packed at buf + REPLY_HEAD_LEN, the header is written in the
+ * room left for it, see reply_trigger(). */
+static void tcp_reply_frame(const struct req_info *req, uint32_t reply,
+            unsigned char *buf, size_t vsize)
+{
+    rep_head(buf, req->id, reply, vsize);
+    rep_send(req, buf, REPLY_HEAD_LEN + vsize);
+}
 
-        t = htonl(vsize);
-        memcpy(buf + 12, &t, 4);
-        memcpy(buf + 16, val, vsize);
 
-        rep_send(req, buf, bsize);
-        free(buf);
+/* Send a reply whose value is in n parts, e.g. a cached value, with no copy:
+ * the header and the parts go in one sendmsg(). */
+static void tcp_reply_iov(const struct req_info *req, uint32_t reply,
+            const struct iovec *iov, int n)
+{
+    struct iovec msg[TCP_IOV_MAX];
+    unsigned char head[REPLY_HEAD_LEN];
+    size_t vsize = 0;
+    int i;
+
+    if (n <= 0 || n >= TCP_IOV_MAX) {
+        tcp_reply_mini(req, REP_ERR_PACK);
+        return;
     }
-    return;
 
+    for (i = 0; i < n; i++) {
+        msg[i + 1] = iov[i];
+        vsize += iov[i].iov_len;
+    }
+
+    rep_head(head, req->id, reply, vsize);
+    msg[0].iov_base = head;
+    msg[0].iov_len = REPLY_HEAD_LEN;
+
+    rep_sendv(req, msg, n + 1);
+}
+
+int tcp_socket_push(struct tcp_socket *tcpsock, uint32_t code,
+                    const unsigned char *val, size_t vsize)
+{
+    struct iovec iov[2];
+    unsigned char head[REPLY_HEAD_LEN];
+
+    if (val == NULL)
+        return 0;
+
+    /* server messages have id 0 */
+    rep_head(head, 0, code, vsize);
+    iov[0].iov_base = head;
+    iov[0].iov_len = REPLY_HEAD_LEN;
+    iov[1].iov_base = (void*)val;
+    iov[1].iov_len = vsize;
+
+    return tcp_socket_sendv(tcpsock, iov, 2, true);
 }
 
 
@@ -194,7 +647,7 @@ static void tcp_reply_long(const struct req_info *req, uint32_t reply,
  * Main functions for receiving and parsing
  */
 
-int tcp_init(const char *ip, int port)
+int tcp_init(const char *ip, int port, bool reuseport)
 {
     int fd, rv;
     struct sockaddr_in srvsa;
@@ -208,7 +661,15 @@ int tcp_init(const char *ip, int port)
     srvsa.sin_addr.s_addr = ia.s_addr;
     srvsa.sin_port = htons(port);
 
-    fd = socket(AF_INET, SOCK_STREAM, 0);
+    m_wbuf_low = hdf_get_int_value(g_cfg, PRE_SERVER".wbuf_low",
+                                   WBUF_LOW_DEFAULT);
+    m_wbuf_high = hdf_get_int_value(g_cfg, PRE_SERVER".wbuf_high",
+                                    WBUF_HIGH_DEFAULT);
+    if (m_wbuf_low > m_wbuf_high)
+        m_wbuf_low = m_wbuf_high;
+
+    /* non blocking, tcp_newconnection() accepts until EAGAIN */
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (fd < 0)
         return -1;
 
@@ -218,6 +679,15 @@ int tcp_init(const char *ip, int port)
         return -1;
     }
 
+    /* Every I/O thread listens on it's own socket, and the kernel spreads
+     * the incoming connections among them. */
+    rv = 1;
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &rv, sizeof(rv)) < 0) {
+        close(fd);
+        return -1;
+    }
+
     rv = bind(fd, (struct sockaddr *) &srvsa, sizeof(srvsa));
     if (rv < 0) {
         close(fd);
@@ -248,220 +718,400 @@ void tcp_close(int fd)
 }
 
 
-/* Called by libevent for each receive event on our listen fd */
+/* A tcp_socket from the reactor's slab, on it's thread. */
+static struct tcp_socket *conn_alloc(struct net_reactor *r)
+{
+    struct conn_slab *sl = &r->slab;
+    struct tcp_socket *tcpsock;
+    struct conn_chunk *c;
+    void *objs;
+    int i;
+
+    if (sl->local == NULL)
+        sl->local = __atomic_exchange_n(&sl->remote, NULL, __ATOMIC_ACQUIRE);
+
+    if (sl->local == NULL) {
+        c = malloc(sizeof(struct conn_chunk));
+        if (c == NULL)
+            return NULL;
+        if (posix_memalign(&objs, TCP_CACHELINE,
+                           CONN_SLAB_NUM * sizeof(struct tcp_socket)) != 0) {
+            free(c);
+            return NULL;
+        }
+        c->objs = objs;
+        c->next = sl->chunks;
+        sl->chunks = c;
+        sl->total += CONN_SLAB_NUM;
+
+        for (i = CONN_SLAB_NUM - 1; i >= 0; i--) {
+            c->objs[i].fnext = sl->local;
+            sl->local = &c->objs[i];
+        }
+    }
+
+    tcpsock = sl->local;
+    sl->local = tcpsock->fnext;
+
+    return tcpsock;
+}
+
+/* Back to it's reactor's slab, from any thread. */
+static void conn_release(struct tcp_socket *tcpsock)
+{
+    struct conn_slab *sl = &tcpsock->reactor->slab;
+    struct tcp_socket *old;
+
+    old = __atomic_load_n(&sl->remote, __ATOMIC_RELAXED);
+    do {
+        tcpsock->fnext = old;
+    } while (!__atomic_compare_exchange_n(&sl->remote, &old, tcpsock, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void tcp_conn_slab_free(struct net_reactor *r)
+{
+    struct conn_chunk *c;
+
+    while ((c = r->slab.chunks) != NULL) {
+        r->slab.chunks = c->next;
+        free(c->objs);
+        free(c);
+    }
+    r->slab.local = r->slab.remote = NULL;
+    r->slab.total = 0;
+}
+
+/* Called by libevent for each receive event on our listen fd, arg is the
+ * reactor which owns it. Accepts all the pending connections, so a
+ * reconnect storm is drained by one event. */
 void tcp_newconnection(int fd, short event, void *arg)
 {
     int newfd, optval;
+    struct net_reactor *r = (struct net_reactor *) arg;
     struct tcp_socket *tcpsock;
-    struct event *new_event;
+    struct sockaddr_in clisa;
+    socklen_t clilen;
+
+    for (;;) {
+        clilen = sizeof(clisa);
+        newfd = accept4(fd, (struct sockaddr *) &clisa, &clilen,
+                        SOCK_NONBLOCK);
+        if (newfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                mtc_err("accept on %d failure %s", fd, strerror(errno));
+            return;
+        }
 
-    tcpsock = malloc(sizeof(struct tcp_socket));
-    if (tcpsock == NULL) {
-        return;
+        tcpsock = conn_alloc(r);
+        if (tcpsock == NULL) {
+            mtc_err("alloc connection failure");
+            close(newfd);
+            continue;
+        }
+
+        optval = 1;
+        setsockopt(newfd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+
+        tcpsock->refcount = 0;
+        tcpsock->fd = newfd;
+        tcpsock->reactor = r;
+        tcpsock->route = 0;
+        tcpsock->binary = false;
+        tcpsock->clisa = clisa;
+        tcpsock->clilen = clilen;
+        tcpsock->evt = &tcpsock->rev;
+        tcpsock->buf = NULL;
+        tcpsock->bufsize = 0;
+        tcpsock->pktsize = 0;
+        tcpsock->len = 0;
+        pthread_mutex_init(&tcpsock->wlock, NULL);
+        tcpsock->wevt = &tcpsock->wev;
+        tcpsock->ohead = NULL;
+        tcpsock->otail = NULL;
+        tcpsock->osize = 0;
+        tcpsock->throttled = false;
+        tcpsock->appdata = NULL;
+        tcpsock->on_close = NULL;
+        tcpsock->fnext = NULL;
+
+        tcp_socket_add_ref(tcpsock);
+        __sync_fetch_and_add(&r->numconns, 1);
+
+        event_assign(tcpsock->evt, r->base, newfd, EV_READ | EV_PERSIST,
+                     tcp_recv, (void *) tcpsock);
+        event_add(tcpsock->evt, NULL);
+
+        /* added by tcp_socket_send() only when there are pending data */
+        event_assign(tcpsock->wevt, r->base, newfd, EV_WRITE, tcp_send,
+                     (void *) tcpsock);
     }
-    tcpsock->clilen = sizeof(tcpsock->clisa);
+}
 
-    new_event = malloc(sizeof(struct event));
-    if (new_event == NULL) {
-        free(tcpsock);
-        return;
+
+/* Each reactor has a common buffer to avoid unnecessary allocation on the
+ * common case where we get entire messages on each recv().
+ * Allocate a little bit more over the max. message size, which is 64kb. */
+#define SBSIZE (68 * 1024)
+
+/* Size classes of the receive buffer pool, the last fits any message. */
+static const size_t m_rbuf_class[RPOOL_CLASSES] = {
+    512, 2048, 8192, 32768, SBSIZE
+};
+
+static int rbuf_class(size_t size)
+{
+    int i;
+
+    for (i = 0; i < RPOOL_CLASSES; i++) {
+        if (size <= m_rbuf_class[i]) return i;
     }
 
-    newfd = accept(fd,
-            (struct sockaddr *) &(tcpsock->clisa),
-            &(tcpsock->clilen));
+    return -1;
+}
 
-    if (fcntl(newfd, F_SETFL, O_NONBLOCK) != 0) {
-        close(newfd);
-        free(new_event);
-        free(tcpsock);
-        return;
+/* A buffer of size bytes at least, it's real size in *bsize. Partial
+ * messages are the norm on slow links, so they're reused rather than
+ * malloc()'d each time. On the reactor's thread only. */
+static unsigned char *rbuf_get(struct net_reactor *r, size_t size,
+                               size_t *bsize)
+{
+    struct rbuf_pool *p = &r->pool;
+    unsigned char *buf;
+    int c;
+
+    c = rbuf_class(size);
+    if (c < 0)
+        return NULL;
+
+    p->gets++;
+    buf = p->free[c];
+    if (buf != NULL) {
+        memcpy(&p->free[c], buf, sizeof(unsigned char*));
+        p->cached -= m_rbuf_class[c];
+        p->hits++;
+    } else {
+        buf = malloc(m_rbuf_class[c]);
+        if (buf == NULL)
+            return NULL;
     }
 
-    optval = 1;
-    setsockopt(newfd, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    __sync_fetch_and_add(&p->inuse, m_rbuf_class[c]);
+    *bsize = m_rbuf_class[c];
 
-    tcpsock->refcount = 0;
-    tcpsock->fd = newfd;
-    tcpsock->evt = new_event;
-    tcpsock->buf = NULL;
-    tcpsock->pktsize = 0;
-    tcpsock->len = 0;
-    tcpsock->excess = 0;
-    tcpsock->appdata = NULL;
-    tcpsock->on_close = NULL;
+    return buf;
+}
 
-    tcp_socket_add_ref(tcpsock);
+static void rbuf_put(struct net_reactor *r, unsigned char *buf, size_t bsize)
+{
+    struct rbuf_pool *p = &r->pool;
+    int c;
 
-    event_set(new_event, newfd, EV_READ | EV_PERSIST, tcp_recv,
-            (void *) tcpsock);
-    event_add(new_event, NULL);
+    __sync_fetch_and_sub(&p->inuse, bsize);
 
-    return;
+    c = rbuf_class(bsize);
+    if (c < 0 || p->cached + bsize > RPOOL_MAX_CACHED) {
+        free(buf);
+        return;
+    }
+
+    memcpy(buf, &p->free[c], sizeof(unsigned char*));
+    p->free[c] = buf;
+    p->cached += bsize;
 }
 
+/* Give tcpsock->buf back, to the pool unless it's the inline one. */
+static void sock_rbuf_put(struct tcp_socket *tcpsock)
+{
+    if (tcpsock->buf != tcpsock->ibuf)
+        rbuf_put(tcpsock->reactor, tcpsock->buf, tcpsock->bufsize);
+    tcpsock->buf = NULL;
+    tcpsock->bufsize = 0;
+}
 
-/* Static common buffer to avoid unnecessary allocation on the common case
- * where we get an entire single message on each recv().
- * Allocate a little bit more over the max. message size, which is 64kb. */
-#define SBSIZE (68 * 1024)
-static unsigned char static_buf[SBSIZE];
+void tcp_rbuf_pool_free(struct net_reactor *r)
+{
+    unsigned char *buf;
+    int c;
 
-/* Called by libevent for each receive event */
+    for (c = 0; c < RPOOL_CLASSES; c++) {
+        while ((buf = r->pool.free[c]) != NULL) {
+            memcpy(&r->pool.free[c], buf, sizeof(unsigned char*));
+            free(buf);
+        }
+    }
+    r->pool.cached = 0;
+}
+
+/* Bytes read from one connection per read event, at most. The rest waits for
+ * the next one, after the other connections of the reactor had their turn. */
+#define RECV_BUDGET (4 * SBSIZE)
+
+/* Called by libevent for each receive event. Reads until EAGAIN, or the
+ * budget is spent, and puts the requests of it all in the queues at once. */
 static void tcp_recv(int fd, short event, void *arg)
 {
     int rv;
     struct tcp_socket *tcpsock;
+    struct net_reactor *r;
+    size_t budget = RECV_BUDGET, want;
 
     tcpsock = (struct tcp_socket *) arg;
+    r = tcpsock->reactor;
 
-    if (tcpsock->buf == NULL) {
-        /* New incoming message */
-        rv = recv(fd, static_buf, SBSIZE, MSG_NOSIGNAL);
-        if (rv < 0 && errno == EAGAIN) {
-            /* We were awoken but have no data to read, so we do
-             * nothing */
-            return;
+    while (budget > 0) {
+        if (tcpsock->buf == NULL) {
+            /* New incoming messages */
+            rv = recv(fd, r->rbuf, SBSIZE, MSG_NOSIGNAL);
+        } else {
+            /* We already got a partial message, complete it. Read no
+             * more than it, so the buffer holds just one. */
+            want = tcpsock->pktsize - tcpsock->len;
+            rv = recv(fd, tcpsock->buf + tcpsock->len, want, MSG_NOSIGNAL);
+        }
+
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* drained */
+            break;
+        } else if (rv < 0 && errno == EINTR) {
+            continue;
         } else if (rv == -1 && errno == ETIMEDOUT) {
             /*
              * network unreachable
              * may be reachable later, don't do anything
              */
-            return;
+            break;
         } else if (rv <= 0) {
             /* Orderly shutdown or error; close the file
              * descriptor in either case. */
             goto error_exit;
         }
+        budget = (size_t)rv < budget ? budget - rv : 0;
 
-        init_req(tcpsock);
-        process_buf(tcpsock, static_buf, rv);
-    } else {
-        /* We already got a partial message, complete it. */
-        size_t maxtoread = tcpsock->pktsize - tcpsock->len;
-
-        rv = recv(fd, tcpsock->buf + tcpsock->len, maxtoread, MSG_NOSIGNAL);
-        if (rv < 0 && errno == EAGAIN) {
-            return;
-        } else if (rv <= 0) {
-            goto error_exit;
+        if (tcpsock->buf == NULL) {
+            rv = process_buf(tcpsock, r->rbuf, rv);
+        } else {
+            tcpsock->len += rv;
+            if (tcpsock->len < tcpsock->pktsize)
+                continue;
+            rv = process_buf(tcpsock, tcpsock->buf, tcpsock->len);
         }
-
-        tcpsock->len += rv;
-
-        process_buf(tcpsock, tcpsock->buf, tcpsock->len);
+        if (rv < 0)
+            goto error_exit;
     }
 
+    queue_batch_flush(&r->qb);
     return;
 
 error_exit:
-    close(fd);
-    tcpsock->fd = -1;
-    /* avoid duplicate remove_ref() */
-    event_del(tcpsock->evt);
-    tcpsock->evt = NULL;
-    tcp_socket_remove_ref(tcpsock);
+    queue_batch_flush(&r->qb);
+    tcp_socket_close(tcpsock);
     return;
 }
 
 
-/* Main message unwrapping */
-static void process_buf(struct tcp_socket *tcpsock,
-                        unsigned char *buf, size_t len)
+/* Called by libevent when a fd with pending output becomes writable */
+static void tcp_send(int fd, short event, void *arg)
 {
-    uint32_t totaltoget = 0;
+    struct tcp_socket *tcpsock;
 
-    if (len >= 4) {
-        totaltoget = * (uint32_t *) buf;
-        totaltoget = ntohl(totaltoget);
-        if (totaltoget > (64 * 1024) || totaltoget <= 8) {
-            /* Message too big or too small, close the connection. */
-            goto error_exit;
-        }
-    } else {
-        /* If we didn't even read 4 bytes, we try to read 4 first and
-         * then care about the rest. */
-        totaltoget = 4;
-    }
+    tcpsock = (struct tcp_socket *) arg;
 
-    if (totaltoget > len) {
-        if (tcpsock->buf == NULL) {
-            /* The first incomplete recv().
-             * Create a temporary buffer and copy the contents of
-             * our current one (which is static_buf, otherwise
-             * tcpsock->buf wouldn't be NULL) to it. */
-            tcpsock->buf = malloc(SBSIZE);
-            if (tcpsock->buf == NULL)
-                goto error_exit;
-
-            memcpy(tcpsock->buf, buf, len);
-            tcpsock->len = len;
-            tcpsock->pktsize = totaltoget;
-        } else {
-            /* We already had an incomplete recv() and this is
-             * just another one. */
-            tcpsock->len = len;
-            tcpsock->pktsize = totaltoget;
+    pthread_mutex_lock(&tcpsock->wlock);
+    if (tcpsock->fd >= 0) {
+        if (outq_flush(tcpsock) < 0) {
+            /* the read event will see the error and close it */
+            shutdown(tcpsock->fd, SHUT_RDWR);
+        } else if (tcpsock->ohead != NULL) {
+            event_add(tcpsock->wevt, NULL);
         }
-        return;
     }
+    pthread_mutex_unlock(&tcpsock->wlock);
+}
 
-    if (totaltoget < len) {
-        /* Got more than one message in the same recv(); save the
-         * amount of bytes exceeding so we can process it later. */
-        tcpsock->excess = len - totaltoget;
-        len = totaltoget;
-    }
-
-    /* The buffer is complete, parse it as usual. */
-    g_stat.msg_tcp++;
-    if (parse_message(&(tcpsock->req), buf + 4, len - 4)) {
-        goto exit;
-    } else {
-        goto error_exit;
-    }
 
+/* Main message unwrapping. Parses the whole messages in buf one after the
+ * other, in place, and keeps a trailing partial one in tcpsock->buf for the
+ * next recv(). buf is the reactor's buffer, or tcpsock->buf holding one
+ * message. Returns 0, or -1 if the connection must be closed. */
+static int process_buf(struct tcp_socket *tcpsock,
+                       unsigned char *buf, size_t len)
+{
+    uint32_t totaltoget;
+    size_t pos = 0, left, nsize;
+    unsigned char *nbuf;
+
+    while (pos < len) {
+        left = len - pos;
+
+        if (left >= 4) {
+            memcpy(&totaltoget, buf + pos, 4);
+            totaltoget = ntohl(totaltoget);
+            if (totaltoget > (64 * 1024) || totaltoget <= 8) {
+                /* Message too big or too small, close the connection. */
+                return -1;
+            }
+        } else {
+            /* If we didn't even read 4 bytes, we try to read 4 first and
+             * then care about the rest. */
+            totaltoget = 4;
+        }
 
-exit:
-    if (tcpsock->excess) {
-        /* If there are buffer leftovers (because there was more than
-         * one message on a recv()), leave the buffer, move the
-         * leftovers to the beginning, adjust the numbers and parse
-         * recursively.
-         * The buffer can be the static one or the one in tcpsock (if
-         * we had a short recv()); we don't care because we know it
-         * will be big enough to hold an entire message anyway. */
-        memmove(buf, buf + len, tcpsock->excess);
-        tcpsock->len = tcpsock->excess;
-        tcpsock->excess = 0;
+        if (totaltoget > left) {
+            if (tcpsock->buf == NULL) {
+                /* The first incomplete recv().
+                 * Get a buffer of the message's size, the inline one if
+                 * it fits, and copy it's beginning (from the reactor's
+                 * buffer) to it. */
+                if (totaltoget <= TCP_INLINE_RBUF) {
+                    tcpsock->buf = tcpsock->ibuf;
+                    tcpsock->bufsize = TCP_INLINE_RBUF;
+                } else {
+                    tcpsock->buf = rbuf_get(tcpsock->reactor, totaltoget,
+                                            &tcpsock->bufsize);
+                    if (tcpsock->buf == NULL)
+                        return -1;
+                }
+
+                memcpy(tcpsock->buf, buf + pos, left);
+            } else if (totaltoget > tcpsock->bufsize) {
+                /* It's in there already, alone, but only the size is
+                 * known now, and it's bigger. */
+                nbuf = rbuf_get(tcpsock->reactor, totaltoget, &nsize);
+                if (nbuf == NULL)
+                    return -1;
+
+                memcpy(nbuf, tcpsock->buf, left);
+                sock_rbuf_put(tcpsock);
+                tcpsock->buf = nbuf;
+                tcpsock->bufsize = nsize;
+            }
+            tcpsock->len = left;
+            tcpsock->pktsize = totaltoget;
+            return 0;
+        }
 
-        /* Build a new req just like when we first recv(). */
+        /* The message is complete, parse it as usual. */
+        tcpsock->reactor->st.msg_tcp++;
         init_req(tcpsock);
-        process_buf(tcpsock, buf, tcpsock->len);
-        return;
+        if (!parse_message(&(tcpsock->req), buf + pos + 4, totaltoget - 4))
+            return -1;
+
+        pos += totaltoget;
     }
 
     if (tcpsock->buf) {
         /* We had an incomplete read somewhere along the processing of
-         * this message, and had to malloc() a temporary space. free()
-         * it and reset the associated information. */
-        free(tcpsock->buf);
-        tcpsock->buf = NULL;
+         * this message, and had to get a temporary space. Give it back
+         * and reset the associated information. */
+        sock_rbuf_put(tcpsock);
         tcpsock->len = 0;
         tcpsock->pktsize = 0;
-        tcpsock->excess = 0;
     }
 
-    return;
-
-error_exit:
-    close(tcpsock->fd);
-    tcpsock->fd = -1;
-    /* avoid duplicate remove_ref() */
-    event_del(tcpsock->evt);
-    tcpsock->evt = NULL;
-    tcp_socket_remove_ref(tcpsock);
-    return;
+    return 0;
 }
 
 void tcp_socket_add_ref(struct tcp_socket *tcpsock)
@@ -470,7 +1120,7 @@ void tcp_socket_add_ref(struct tcp_socket *tcpsock)
 
     //mtc_dbg("add reference count on %d %d", tcpsock->fd, tcpsock->refcount);
 
-    tcpsock->refcount++;
+    __sync_fetch_and_add(&tcpsock->refcount, 1);
 }
 
 void tcp_socket_remove_ref(struct tcp_socket *tcpsock)
@@ -479,7 +1129,7 @@ void tcp_socket_remove_ref(struct tcp_socket *tcpsock)
 
     //mtc_dbg("remove reference count on %d %d", tcpsock->fd, tcpsock->refcount);
 
-    tcpsock->refcount--;
-
-    if (tcpsock->refcount == 0) tcp_socket_free(tcpsock);
+    /* reactor and app threads both hold references */
+    if (__sync_sub_and_fetch(&tcpsock->refcount, 1) == 0)
+        tcp_socket_free(tcpsock);
 }
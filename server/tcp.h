@@ -1,32 +1,112 @@
 #ifndef _TCP_H
 #define _TCP_H
 
+/* A message shared by many output queues, e.g. a push to all users of a
+ * room, queued to each without a copy. The queues hold references, the
+ * last one frees it. */
+struct tcp_shbuf {
+    uint32_t refcount;
+    double born;                /* ne_timef() of tcp_shbuf_new() */
+    size_t len;
+    unsigned char data[];
+};
+#define TCP_SHBUF(p)    ((struct tcp_shbuf*)((unsigned char*)(p) - \
+                                             offsetof(struct tcp_shbuf, data)))
+
+/* Output buffer, one per pending chunk of a reply or push that couldn't be
+ * sent right away, or of a broadcast. */
+struct tcp_outbuf {
+    unsigned char *buf;
+    size_t len;
+    size_t pos;
+    struct tcp_shbuf *shared;   /* buf is in it, a reference, not our own */
+    struct tcp_outbuf *next;
+};
+
+#define TCP_CACHELINE   64
+#define TCP_INLINE_RBUF 256     /* partial messages this small stay inline */
+
 /* TCP socket structure. Used mainly to hold buffers from incomplete
- * recv()s. */
+ * recv()s, and the output queue for incomplete send()s.
+ * They're cache line aligned objects of the reactor's conn_slab, with their
+ * events in them. */
 struct tcp_socket {
     int refcount;
     int fd;
+    struct net_reactor *reactor;
+    uint32_t route;             /* 0 for none, see moc_route_worker(), atomic */
+    bool binary;                /* client talks in FLAGS_BINARY */
     struct sockaddr_in clisa;
     socklen_t clilen;
-    struct event *evt;
+    struct event *evt;          /* &rev */
+    struct event rev;
 
-    unsigned char *buf;
+    unsigned char *buf;         /* a partial message, ibuf or from rbuf_get() */
+    size_t bufsize;
     size_t pktsize;
     size_t len;
     struct req_info req;
-    size_t excess;
+
+    /*
+     * output queue, written by app threads and flushed by the main thread
+     * on EV_WRITE. wlock protects fd against close() too.
+     */
+    pthread_mutex_t wlock;
+    struct event *wevt;         /* &wev */
+    struct event wev;
+    struct tcp_outbuf *ohead, *otail;
+    size_t osize;
+    bool throttled;
 
     void *appdata;
     void (*on_close)(void *appdata);
-};
 
-int tcp_init(const char* ip, int port);
+    struct tcp_socket *fnext;   /* on the conn_slab's free lists */
+    unsigned char ibuf[TCP_INLINE_RBUF];
+} __attribute__((aligned(TCP_CACHELINE)));
+
+int tcp_init(const char* ip, int port, bool reuseport);
 void tcp_close(int fd);
 void tcp_newconnection(int fd, short event, void *arg);
 
+/*
+ * send buf to the client without blocking, the unsent part is queued and
+ * flushed by the main thread on EV_WRITE. droppable data (server push) is
+ * dropped when the client is too slow, others close the connection instead.
+ * return 1 on sent or queued, 0 on dropped or error
+ */
+int tcp_socket_send(struct tcp_socket *tcpsock, const unsigned char *buf,
+                    size_t size, bool droppable);
+/* the same for a message in n (TCP_IOV_MAX at most) parts, sent as they are
+ * with one sendmsg(), only a part left unsent is copied */
+#define TCP_IOV_MAX     8
+int tcp_socket_sendv(struct tcp_socket *tcpsock, const struct iovec *iov,
+                     int n, bool droppable);
+/* push val to the client, framed as a server message of code (id 0), with
+ * the header on the stack and no copy of val. it's droppable */
+int tcp_socket_push(struct tcp_socket *tcpsock, uint32_t code,
+                    const unsigned char *val, size_t vsize);
+
+/*
+ * broadcast: a tcp_shbuf_new()'d message, with a reference for the caller,
+ * tcp_shbuf_put() it when done.
+ * tcp_broadcast() queues len bytes at buf, a part of sb, to n sockets, with
+ * no copy and no send(), the network threads flush them. Like droppable
+ * data, it's dropped for the clients too slow.
+ * return the number of sockets it's queued to
+ */
+struct tcp_shbuf *tcp_shbuf_new(size_t len);
+/* give back the end of sb, not shared yet, past len. it may move */
+struct tcp_shbuf *tcp_shbuf_trim(struct tcp_shbuf *sb, size_t len);
+void tcp_shbuf_put(struct tcp_shbuf *sb);
+int tcp_broadcast(struct tcp_shbuf *sb, const unsigned char *buf, size_t len,
+                  struct tcp_socket **socks, int n);
+
 void tcp_socket_free(struct tcp_socket *tcpsock);
+/* the reactor's receive buffers and tcp_sockets, on it's destroy */
+void tcp_rbuf_pool_free(struct net_reactor *r);
+void tcp_conn_slab_free(struct net_reactor *r);
 void tcp_socket_add_ref(struct tcp_socket *tcpsock);
 void tcp_socket_remove_ref(struct tcp_socket *tcpsock);
 
 #endif
-